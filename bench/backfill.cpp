@@ -0,0 +1,96 @@
+# define GPUJOB_NO_MAIN
+# include "../src/jobd.cpp"
+# include <random>
+# include "measure.hpp"
+
+inline void benchmark_backfill(unsigned count)
+// 在模拟的时间中重放 count 个随机生成的任务 (随机数种子固定, 每次相同), 比较 fifo 和 backfill 两种策略下
+// 机器的利用率和任务的平均等待时间. 调度的过程与 assign_new_jobs 相同, 但不考虑 GPU, 公平调度和抢占.
+// 任务的实际运行时间短于它申请的时间限制.
+{
+	struct Trace_t
+	{
+		std::int64_t Submit, Runtime, TimeLimit;
+		unsigned Cores;
+	};
+	constexpr unsigned total_cores = 64;
+	std::mt19937 random{42};
+	std::vector<Trace_t> trace;
+	double time = 0;
+	for (unsigned i = 0; i < count; i++)
+	{
+		// 平均每 100 分钟到达一个任务, 使机器的负载约为九成
+		time += std::exponential_distribution{1. / 6000}(random);
+		auto runtime = std::uniform_int_distribution<std::int64_t>{600, 36000}(random);
+		trace.push_back
+		({
+			std::int64_t(time), runtime, std::int64_t(runtime * std::uniform_real_distribution{1., 2.}(random)),
+			1u << std::uniform_int_distribution{0, 6}(random)
+		});
+	}
+	GpuInventory_t inventory;
+	for (std::string policy : {"fifo", "backfill"})
+	{
+		JobStore_t store;
+		Ledger_t ledger;
+		ledger.TotalCores = total_cores;
+		ledger.Inventory = &inventory;
+		std::multimap<std::int64_t, unsigned> ends;
+		std::size_t next = 0;
+		std::int64_t waited = 0, last_end = 0;
+		double busy = 0;
+		while (next < trace.size() || !ends.empty())
+		{
+			// 跳到下一个任务到达或者结束的时刻
+			auto now = std::min
+			(
+				next < trace.size() ? trace[next].Submit : std::numeric_limits<std::int64_t>::max(),
+				ends.empty() ? std::numeric_limits<std::int64_t>::max() : ends.begin()->first
+			);
+			for (; !ends.empty() && ends.begin()->first == now; ends.erase(ends.begin()))
+			{
+				auto& job = store.Jobs.at(ends.begin()->second);
+				ledger.release(job);
+				store.set_status(job, Job_t::Status_t::Finished);
+				last_end = now;
+			}
+			for (; next < trace.size() && trace[next].Submit == now; next++)
+			{
+				Job_t job{};
+				job.Id = next;
+				job.UsingCores = trace[next].Cores;
+				job.TimeLimit = trace[next].TimeLimit;
+				job.Status = Job_t::Status_t::Pending;
+				store.add(job);
+			}
+			std::optional<Reservation_t> reservation;
+			for (auto it = store.Queue.begin(); it != store.Queue.end();)
+			{
+				auto& job = store.Jobs.at((it++)->second);
+				if (ledger.fits(job) && (!reservation || reservation->admit(job, now)))
+				{
+					job.StartTime = now;
+					ledger.acquire(job);
+					store.set_status(job, Job_t::Status_t::Running);
+					ends.emplace(now + trace[job.Id].Runtime, job.Id);
+					waited += now - trace[job.Id].Submit;
+					busy += double(job.UsingCores) * trace[job.Id].Runtime;
+				}
+				else if (policy == "backfill" && !reservation)
+					reservation = reserve(store, ledger, Topology_t{}, job, now);
+			}
+		}
+		std::cout << fmt::format
+		(
+			"{}: utilization {:.1f}%, mean wait {:.1f} h, makespan {:.1f} h\n", policy,
+			100 * busy / (double(total_cores) * (last_end - trace.front().Submit)),
+			waited / 3600. / count, (last_end - trace.front().Submit) / 3600.
+		);
+	}
+}
+
+// 用法: bench-backfill [任务数]
+int main(int argc, const char** argv)
+{
+	benchmark_backfill(argc > 1 ? std::stoul(argv[1]) : 10000);
+}
@@ -0,0 +1,65 @@
+# define GPUJOB_NO_MAIN
+# include "../src/jobd.cpp"
+# include "measure.hpp"
+
+inline void benchmark_format(unsigned count)
+// 比较 out.dat 使用以前的 JSON 格式和现在的 portable binary 格式时, 写入和读取 count 个任务所用的时间以及文件的大小.
+{
+	auto directory = std::filesystem::temp_directory_path() / fmt::format("gpujob-benchmark-{}", getpid());
+	std::filesystem::create_directories(directory);
+	setenv("GPUJOB_STATE_DIRECTORY", directory.c_str(), 1);
+	std::ofstream{directory / "out.lock"};
+	Output_t output;
+	for (unsigned i = 0; i < count; i++)
+	{
+		Job_t job{};
+		job.Id = i;
+		job.User = fmt::format("user{}", i % 16);
+		job.Comment = fmt::format("/home/{}/run/{}", job.User, i);
+		job.ProgramString = fmt::format("cd {} && mpirun -np 16 vasp_std", job.Comment);
+		job.UsingCores = 16;
+		job.UsingGpus = {i % 4};
+		job.Status = Job_t::Status_t::Finished;
+		job.StartTime = 1700000000 + i;
+		job.FinishTime = job.StartTime + 3600;
+		job.ExitCode = 0;
+		output.Jobs.push_back(job);
+	}
+	output.NextId = count;
+	auto measure = [&](const std::string& name, const std::filesystem::path& path, auto&& write, auto&& read)
+	{
+		auto begin = std::chrono::steady_clock::now();
+		write();
+		auto written = std::chrono::steady_clock::now();
+		auto jobs = read().Jobs.size();
+		auto end = std::chrono::steady_clock::now();
+		if (jobs != count)
+			throw std::runtime_error{fmt::format("{}: read {} jobs, expected {}", name, jobs, count)};
+		std::cout << fmt::format
+		(
+			"{}: write {:.1f} ms, read {:.1f} ms, {:.1f} MiB\n", name,
+			std::chrono::duration<double, std::milli>(written - begin).count(),
+			std::chrono::duration<double, std::milli>(end - written).count(),
+			std::filesystem::file_size(path) / 1048576.
+		);
+	};
+	measure("json", directory / "out.json", [&]
+	{
+		std::ofstream out{directory / "out.json"};
+		cereal::JSONOutputArchive{out}(output);
+	}, [&]
+	{
+		Output_t result;
+		std::ifstream in{directory / "out.json"};
+		cereal::JSONInputArchive{in}(result);
+		return result;
+	});
+	measure("portable binary", directory / "out.dat", [&]{write_out(output);}, []{return read_out();});
+	std::filesystem::remove_all(directory);
+}
+
+// 用法: bench-format [任务数]
+int main(int argc, const char** argv)
+{
+	benchmark_format(argc > 1 ? std::stoul(argv[1]) : 100000);
+}
@@ -0,0 +1,113 @@
+# pragma once
+# include <string>
+# include <vector>
+# include <thread>
+# include <chrono>
+# include <filesystem>
+# include <fstream>
+# include <system_error>
+# include <fmt/format.h>
+# include <sys/socket.h>
+# include <sys/un.h>
+# include <sys/wait.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <csignal>
+# include <job.hpp>
+
+# ifndef GPUJOB_JOBD
+# define GPUJOB_JOBD "jobd"
+# endif
+
+struct Jobd_t
+// 在临时目录中运行一个真正的 jobd (GPUJOB_JOBD, 由 CMake 指定为编译出的 jobd), 请求经过它的 socket,
+// handle_input 和 journal, 与客户端提交时完全相同. 状态和 socket 都放在这个目录中, 通过环境变量告诉 jobd 和
+// request_jobd; 日志写到其中的 jobd.log. 不使用 GPU 和 cgroup. 析构时杀死 jobd 并删除目录.
+{
+	std::filesystem::path Directory;
+	pid_t Pid = -1;
+
+	Jobd_t()
+	{
+		std::string path = (std::filesystem::temp_directory_path() / "gpujob-bench-XXXXXX").string();
+		if (!mkdtemp(path.data()))
+			throw std::system_error{errno, std::generic_category(), "mkdtemp"};
+		Directory = path;
+		setenv("GPUJOB_STATE_DIRECTORY", Directory.c_str(), 1);
+		setenv("GPUJOB_RUNTIME_DIRECTORY", Directory.c_str(), 1);
+		std::ofstream{Directory / "out.lock"};
+		std::ofstream{Directory / "gpus.csv"};
+	}
+	Jobd_t(const Jobd_t&) = delete;
+	~Jobd_t()
+	{
+		if (Pid > 0)
+		{
+			kill(Pid, SIGKILL);
+			waitpid(Pid, nullptr, 0);
+		}
+		std::filesystem::remove_all(Directory);
+	}
+
+	void start(std::vector<std::string> args = {})
+	// 启动 jobd, 等到它开始监听 socket. 需要预先放入的状态 (out.dat) 在此之前写入 Directory
+	{
+		args.insert
+		(
+			args.begin(),
+			{
+				GPUJOB_JOBD, "--gpu-inventory", (Directory / "gpus.csv").string(), "--cgroup-root", "",
+				"--sample-interval", "0"
+			}
+		);
+		std::vector<char*> argv;
+		for (auto& arg : args)
+			argv.push_back(arg.data());
+		argv.push_back(nullptr);
+		auto log = Directory / "jobd.log";
+		Pid = fork();
+		if (Pid < 0)
+			throw std::system_error{errno, std::generic_category(), "fork"};
+		else if (Pid == 0)
+		{
+			int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+			execvp(argv[0], argv.data());
+			_exit(127);
+		}
+		for (auto deadline = std::chrono::steady_clock::now() + 30s; ; std::this_thread::sleep_for(10ms))
+		{
+			int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			sockaddr_un address{};
+			address.sun_family = AF_UNIX;
+			std::strncpy(address.sun_path, (Directory / "jobd.sock").c_str(), sizeof(address.sun_path) - 1);
+			bool connected = !connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+			close(fd);
+			if (connected)
+				return;
+			bool exited = waitpid(Pid, nullptr, WNOHANG) == Pid;
+			if (exited || std::chrono::steady_clock::now() > deadline)
+			{
+				if (!exited)
+				{
+					kill(Pid, SIGKILL);
+					waitpid(Pid, nullptr, 0);
+				}
+				Pid = -1;
+				throw std::runtime_error{fmt::format("{} did not start, see {}", GPUJOB_JOBD, log.string())};
+			}
+		}
+	}
+};
+
+inline Job_t make_pending_job(unsigned i)
+// 提交给 jobd 的任务. 申请的核数比任何机器都多, 因此只会一直等待, 不会真的运行
+{
+	Job_t job{};
+	job.ProgramString = fmt::format("cd /home/user/run/{} && mpirun vasp_std", i);
+	job.Comment = fmt::format("user run/{}", i);
+	job.UsingCores = 1u << 20;
+	job.Status = Job_t::Status_t::Pending;
+	return job;
+}
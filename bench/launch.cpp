@@ -0,0 +1,43 @@
+# define GPUJOB_NO_MAIN
+# include "../src/jobd.cpp"
+# include "measure.hpp"
+
+inline void benchmark_launch(std::optional<Helper_t>& helper, unsigned count)
+// 比较启动一个什么也不做的任务 (true) 的延迟: 从开始启动到 jobd 得知它已经退出.
+{
+	auto passwd = getpwuid(geteuid());
+	if (!passwd)
+		throw std::runtime_error{"can not find the current user"};
+	std::string user = passwd->pw_name, shell = passwd->pw_shell;
+	auto measure = [&](const std::string& name, auto&& run){measure_latencies(name, count, run);};
+	measure("runuser", [&]
+	{
+		waitpid(spawn({"runuser", "-c", "-u", user, "--", "true"}, []{}), nullptr, 0);
+	});
+	if (helper)
+		measure("helper", [&]
+		{
+			auto pid = helper->launch({{shell, "-c", "true"}, user, {}, ""});
+			for (bool exited = false; !exited;)
+			{
+				pollfd fd{helper->ExitFd, POLLIN, 0};
+				poll(&fd, 1, -1);
+				for (auto [exited_pid, status] : helper->exited())
+					exited = exited || exited_pid == pid;
+				if (helper->Closed)
+					throw std::runtime_error{"launcher helper is gone"};
+			}
+		});
+}
+
+// 用法: bench-launch [次数]. 需要以 root 运行, 以便 runuser 和启动器切换用户
+int main(int argc, const char** argv)
+{
+	// 与 jobd 相同, 在屏蔽 SIGCHLD 之后启动启动器
+	sigset_t child_signal;
+	sigemptyset(&child_signal);
+	sigaddset(&child_signal, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &child_signal, nullptr);
+	std::optional<Helper_t> helper = Helper_t::start();
+	benchmark_launch(helper, argc > 1 ? std::stoul(argv[1]) : 1000);
+}
@@ -0,0 +1,35 @@
+# define GPUJOB_NO_MAIN
+# include "../src/jobd.cpp"
+# include "jobd.hpp"
+
+inline void benchmark_manifest(unsigned count)
+// 比较向真正的 jobd 提交 count 个任务时, 每个任务一次请求 (以前的 job-cli 循环) 和一次请求提交所有任务
+// (--manifest) 的用时. 每个请求都经过 socket, handle_input, 写入 journal 并刷到磁盘上之后才收到回复.
+{
+	auto measure = [&](const std::string& name, unsigned jobs_per_request)
+	{
+		Jobd_t jobd;
+		jobd.start();
+		auto begin = std::chrono::steady_clock::now();
+		for (unsigned submitted = 0; submitted < count; submitted += jobs_per_request)
+		{
+			Input_t input;
+			for (unsigned i = submitted; i < std::min(count, submitted + jobs_per_request); i++)
+				input.NewJobs.push_back(make_pending_job(i));
+			auto reply = request_jobd(input);
+			if (!reply || !reply->Error.empty() || reply->NewJobIds.size() != input.NewJobs.size())
+				throw std::runtime_error{fmt::format("jobd refused the request: {}", reply ? reply->Error : "")};
+		}
+		auto end = std::chrono::steady_clock::now();
+		std::cout << fmt::format("{}: {:.1f} ms for {} jobs\n", name,
+			std::chrono::duration<double, std::milli>(end - begin).count(), count);
+	};
+	measure("one request per job", 1);
+	measure("one manifest", count);
+}
+
+// 用法: bench-manifest [任务数]
+int main(int argc, const char** argv)
+{
+	benchmark_manifest(argc > 1 ? std::stoul(argv[1]) : 10000);
+}
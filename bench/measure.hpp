@@ -0,0 +1,36 @@
+# pragma once
+# include <iostream>
+# include <vector>
+# include <string>
+# include <chrono>
+# include <algorithm>
+# include <fmt/format.h>
+
+inline void report_latencies(const std::string& name, std::vector<double> latencies)
+// 输出一组测量结果 (微秒) 的平均值, 中位数和 99 分位数, 供 bench 中的各个程序使用
+{
+	if (latencies.empty())
+		return;
+	std::ranges::sort(latencies);
+	double sum = 0;
+	for (auto latency : latencies)
+		sum += latency;
+	std::cout << fmt::format
+	(
+		"{}: mean {:.0f} us, median {:.0f} us, p99 {:.0f} us\n", name, sum / latencies.size(),
+		latencies[latencies.size() / 2], latencies[std::min(latencies.size() * 99 / 100, latencies.size() - 1)]
+	);
+}
+
+template <class Function> void measure_latencies(const std::string& name, unsigned count, Function&& run)
+// 运行 count 次 run, 输出每次用的时间
+{
+	std::vector<double> latencies;
+	for (unsigned i = 0; i < count; i++)
+	{
+		auto begin = std::chrono::steady_clock::now();
+		run();
+		latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count());
+	}
+	report_latencies(name, latencies);
+}
@@ -0,0 +1,49 @@
+# define GPUJOB_NO_MAIN
+# include "../src/jobd.cpp"
+# include "jobd.hpp"
+# include "measure.hpp"
+
+inline void benchmark_schedule(unsigned history, unsigned count)
+// 向真正的 jobd 逐个提交 count 个任务, 比较它的历史中没有任务和有 history 个已经结束的任务时, 每次提交的延迟.
+// 每次提交后 jobd 都要在同一轮事件处理中调度一次; 以前每次调度都遍历所有任务, 延迟随历史增长,
+// 现在只看等待队列和增量记录的资源, 两者应当接近. 提交的任务一直等待, 因此队列的长度在两种情况下相同.
+{
+	for (auto finished : {0u, history})
+	{
+		Jobd_t jobd;
+		// 历史任务刚刚结束, 不会在启动时被移到存档中
+		{
+			Output_t output;
+			for (unsigned i = 0; i < finished; i++)
+			{
+				Job_t job{};
+				job.Id = i;
+				job.User = fmt::format("user{}", i % 16);
+				job.ProgramString = fmt::format("cd /home/{}/run/{} && mpirun vasp_std", job.User, i);
+				job.UsingCores = 16;
+				job.Status = Job_t::Status_t::Finished;
+				job.StartTime = std::time(nullptr) - 3600;
+				job.FinishTime = std::time(nullptr);
+				output.Jobs.push_back(job);
+			}
+			output.NextId = finished;
+			Journal_t journal{0};
+			journal.reset(output);
+		}
+		jobd.start({"--keep-finished", std::to_string(finished)});
+		unsigned i = 0;
+		measure_latencies(fmt::format("{} finished jobs", finished), count, [&]
+		{
+			Input_t input;
+			input.NewJobs.push_back(make_pending_job(i++));
+			if (auto reply = request_jobd(input); !reply || !reply->Error.empty())
+				throw std::runtime_error{fmt::format("jobd refused the request: {}", reply ? reply->Error : "")};
+		});
+	}
+}
+
+// 用法: bench-schedule [已经结束的任务数] [提交的任务数]
+int main(int argc, const char** argv)
+{
+	benchmark_schedule(argc > 1 ? std::stoul(argv[1]) : 50000, argc > 2 ? std::stoul(argv[2]) : 1000);
+}
@@ -0,0 +1,62 @@
+# define GPUJOB_NO_MAIN
+# include "../src/jobd.cpp"
+# include <random>
+# include "measure.hpp"
+
+inline void benchmark_submit_latency(unsigned count)
+// 比较从写入一个新任务到开始运行它的延迟: 以前每秒检查一次 spool 目录, 现在由 inotify 在事件循环中通知.
+// 每次在随机的时刻写入, 然后立即启动一个什么也不做的进程 (true) 作为 "开始运行".
+{
+	auto directory = std::filesystem::temp_directory_path() / fmt::format("gpujob-benchmark-{}", getpid());
+	std::filesystem::create_directories(directory);
+	std::mt19937 random{std::random_device{}()};
+	auto measure = [&](const std::string& name, auto&& wait)
+	{
+		std::vector<double> latencies;
+		for (unsigned i = 0; i < count; i++)
+		{
+			auto file = directory / std::to_string(i);
+			std::chrono::steady_clock::time_point written;
+			std::thread writer{[&]
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds{std::uniform_int_distribution{0, 999}(random)});
+				written = std::chrono::steady_clock::now();
+				std::ofstream{file} << "job";
+			}};
+			wait(file);
+			waitpid(spawn({"true"}, []{}), nullptr, 0);
+			auto now = std::chrono::steady_clock::now();
+			writer.join();
+			latencies.push_back(std::chrono::duration<double, std::micro>(now - written).count());
+			std::filesystem::remove(file);
+		}
+		report_latencies(name, latencies);
+	};
+	measure("poll every second", [](const std::filesystem::path& file)
+	{
+		while (!std::filesystem::exists(file))
+			std::this_thread::sleep_for(1s);
+	});
+	measure("event loop", [&](const std::filesystem::path& file)
+	{
+		EventLoop_t loop;
+		int watch = watch_directory(directory.string());
+		bool found = false;
+		loop.add(watch, [&]{drain(watch); found = std::filesystem::exists(file);});
+		while (!found)
+			loop.run_once();
+		close(watch);
+	});
+	std::filesystem::remove_all(directory);
+}
+
+// 用法: bench-submit_latency [次数]. 每次要等待随机的 0 到 1 秒再加上轮询的间隔, 默认只测 20 次.
+int main(int argc, const char** argv)
+{
+	// jobd 屏蔽了 SIGCHLD, 与它相同
+	sigset_t child_signal;
+	sigemptyset(&child_signal);
+	sigaddset(&child_signal, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &child_signal, nullptr);
+	benchmark_submit_latency(argc > 1 ? std::stoul(argv[1]) : 20);
+}
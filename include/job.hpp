@@ -1,7 +1,15 @@
 # pragma once
 # include <string>
+# include <string_view>
+# include <cstdint>
+# include <array>
+# include <cstring>
+# include <sstream>
+# include <iostream>
+# include <system_error>
 # include <optional>
 # include <vector>
+# include <algorithm>
 # include <map>
 # include <filesystem>
 # include <fstream>
@@ -13,11 +21,21 @@
 # include <cereal/types/vector.hpp>
 # include <cereal/types/utility.hpp>
 # include <cereal/archives/json.hpp>
+# include <cereal/archives/portable_binary.hpp>
 # include <fmt/format.h>
 # include <fmt/ranges.h>
 # include <pwd.h>
 # include <grp.h>
 # include <sys/stat.h>
+# include <sys/socket.h>
+# include <sys/un.h>
+# include <unistd.h>
+# include <fcntl.h>
+
+// out.dat 以及 socket 消息的格式版本. Job_t 等结构的成员有变化时加一,
+// 并在 serialize 中根据版本号读取旧的格式; 读到比自己新的版本时拒绝解析.
+inline constexpr std::uint32_t FormatVersion = 16;
+inline constexpr std::string_view OutMagic = "gpujob-out";
 
 struct Job_t
 // 用来描述一个任务的相关信息
@@ -29,15 +47,100 @@ struct Job_t
 	std::string User, ProgramString, Comment;
 	unsigned UsingCores;
 	std::vector<unsigned> UsingGpus;
-	enum class Status_t {Pending, Running, Finished} Status;
+	enum class Status_t {Pending, Running, Finished, Suspended} Status;	// Suspended: 被优先级更高的任务暂停
 	bool RunInContainer;
 	bool RunNow;
+	int Pid = 0;	// 正在运行时, 任务的进程号和它的启动时间 (/proc/<pid>/stat 中的 starttime),
+	std::uint64_t PidStartTime = 0;	// jobd 重启后据此重新找回仍在运行的任务
+	std::int64_t FinishTime = 0;	// 结束的时间 (unix 时间戳), 用于决定何时把任务移到存档中
+	std::int64_t StartTime = 0;	// 开始运行的时间 (unix 时间戳)
+	std::int64_t TimeLimit = 0;	// 最长运行时间 (秒), 超过后任务会被杀死. 0 表示不限制
+	int Priority = 0;	// 优先级, 越大越先运行. 开启抢占时, 优先级高的任务可以暂停优先级低的任务
+	std::int64_t SuspendTime = 0;	// 最近一次被暂停的时间 (unix 时间戳)
+	std::int64_t SuspendedSeconds = 0;	// 累计被暂停的时间, 不计入运行时间
+	std::vector<unsigned> Cpus;	// 运行时 jobd 分配给任务的逻辑 CPU, 任务被绑定在这些 CPU 上
+	unsigned GpuCount = 0;	// 不为 0 时由 jobd 在任务开始时挑选这么多个 GPU, 挑选的结果写入 UsingGpus
+	std::string GpuModel;	// 由 jobd 挑选 GPU 时, 只挑选型号中包含这个字符串 (不区分大小写) 的 GPU
+	std::uint64_t GpuMinMemory = 0;	// 由 jobd 挑选 GPU 时, 只挑选显存不小于这个值 (MiB) 的 GPU
+	unsigned GpuSlots = 0;	// 在每个 GPU 上占用的份数 (jobd 把每个 GPU 分为 --gpu-slots 份), 0 表示独占
+	std::uint64_t Memory = 0;	// 需要的内存 (MiB), 0 表示不指定
+	// 任务的进程 (runuser) 结束时的退出码, 或者杀死它的信号. 都没有值时表示不知道 (例如任务被取消,
+	// 或者在 jobd 重启后结束). 任务中的命令被信号杀死时, runuser 以 128 加信号的编号退出.
+	std::optional<int> ExitCode, ExitSignal;
+	// 运行前需要加载的环境模块: module use 的目录和 module load 的模块. jobd 缓存加载后的环境, 不必每次都执行 module load
+	std::vector<std::string> ModulePaths, Modules;
+	// 生成 ProgramString 的配置 (见 profile.hpp) 和参数. jobd 展开数组任务时据此为每个子任务重新生成命令
+	std::string Profile;
+	std::map<std::string, std::string> Parameters;
 
-	template <class Archive> void serialize(Archive & ar)
+	struct Array_t
+	// 数组任务: 同一个命令以不同的 GPUJOB_ARRAY_TASK_ID 运行多次.
+	// 提交时只有一条记录, 每个子任务在开始运行时才生成自己的记录.
+	{
+		unsigned First, Last;	// 子任务序号的范围, 包含两端
+		unsigned MaxRunning;	// 同时运行的子任务的数量上限, 0 表示不限制
+		unsigned Dispatched = 0, Running = 0, Finished = 0;
+
+		template <class Archive> void serialize(Archive & ar)
+		{
+			ar(First, Last, MaxRunning, Dispatched, Running, Finished);
+		}
+	};
+	std::optional<Array_t> Array;	// 有值时这是一个数组任务, 它本身不占用资源, 也不运行
+	std::optional<std::pair<unsigned, unsigned>> ArrayTask;	// 数组任务的子任务: 所属数组任务的 Id 和自己的序号
+
+	struct Measured_t
+	// jobd 运行任务时定期统计的实际使用的资源, 任务结束时是整个运行期间的总结.
+	// 用来比较申请的和实际用到的资源.
+	{
+		unsigned Samples = 0;	// 统计的次数, 0 表示没有统计过 (例如在容器中运行的任务)
+		double CpuSeconds = 0;	// 所有进程使用的 CPU 时间
+		double AverageCores = 0;	// CpuSeconds 除以运行时间 (不包括被暂停的时间)
+		std::uint64_t PeakMemory = 0;	// 所有进程同时占用的内存的最大值 (MiB)
+		std::uint64_t ReadBytes = 0, WriteBytes = 0;	// 读写磁盘的字节数
+
+		template <class Archive> void serialize(Archive & ar)
+		{
+			ar(Samples, CpuSeconds, AverageCores, PeakMemory, ReadBytes, WriteBytes);
+		}
+	} Measured;
+
+	template <class Archive> void serialize(Archive & ar, std::uint32_t const version)
 	{
+		if (version > FormatVersion)
+			throw std::runtime_error{fmt::format("unsupported format version {}, please upgrade gpujob", version)};
 		ar(Id, User, ProgramString, Comment, UsingCores, UsingGpus, Status, RunInContainer, RunNow);
+		if (version >= 2)
+			ar(Pid, PidStartTime);
+		if (version >= 3)
+			ar(FinishTime);
+		if (version >= 4)
+			ar(Array, ArrayTask);
+		if (version >= 5)
+			ar(StartTime, TimeLimit);
+		if (version >= 7)
+			ar(Priority, SuspendTime, SuspendedSeconds);
+		if (version >= 8)
+			ar(Cpus);
+		if (version >= 9)
+			ar(GpuCount);
+		if (version >= 10)
+			ar(GpuModel, GpuMinMemory);
+		if (version >= 11)
+			ar(GpuSlots);
+		if (version >= 12)
+			ar(Memory);
+		if (version >= 13)
+			ar(Measured);
+		if (version >= 14)
+			ar(ExitCode, ExitSignal);
+		if (version >= 15)
+			ar(ModulePaths, Modules);
+		if (version >= 16)
+			ar(Profile, Parameters);
 	}
 };
+CEREAL_CLASS_VERSION(Job_t, FormatVersion);
 
 struct Input_t
 // 客户端发送给服务端的信息
@@ -51,18 +154,269 @@ struct Input_t
 	}
 };
 
+struct LegacyInput_t
+// 加入格式版本号之前的客户端写入 /tmp/gpujob/in 的请求. 它的 JSON 中没有 cereal_class_version,
+// 因此不能直接读为 Input_t, 只能按照当时的成员逐个读取, 再转换为 Input_t.
+{
+	struct Job_t
+	{
+		::Job_t Value;
+		template <class Archive> void serialize(Archive & ar)
+		{
+			ar(Value.Id, Value.User, Value.ProgramString, Value.Comment, Value.UsingCores, Value.UsingGpus,
+				Value.Status, Value.RunInContainer, Value.RunNow);
+		}
+	};
+	std::vector<Job_t> NewJobs;
+	std::vector<std::pair<unsigned, std::string>> RemoveJobs;
+
+	template <class Archive> void serialize(Archive & ar)
+	{
+		ar(NewJobs, RemoveJobs);
+	}
+	operator Input_t() const
+	{
+		Input_t input;
+		for (auto& job : NewJobs)
+			input.NewJobs.push_back(job.Value);
+		input.RemoveJobs = RemoveJobs;
+		return input;
+	}
+};
+
+struct Reply_t
+// 服务端通过 unix socket 对客户端请求的回复
+{
+	std::vector<unsigned> NewJobIds;	// 依次为 NewJobs 中每个任务分配的 Id
+	std::vector<unsigned> RemovedJobs;	// 成功取消的任务
+	std::string Error;	// 非空时表示请求没有被处理
+
+	template <class Archive> void serialize(Archive & ar)
+	{
+		ar(NewJobIds, RemovedJobs, Error);
+	}
+};
+
+struct JournalEntry_t
+// journal.dat 中的一条记录: 一个任务在某次状态变化之后的完整内容.
+// Sequence 单调递增, out.dat 中记录了快照已经包含到哪一条.
+// Archive 表示任务已经被移到 archive.dat 中, 应当从当前的状态中删除, 此时 Job 中只有 Id 有意义.
+// archive.dat 也使用同样的记录格式.
+{
+	std::uint64_t Sequence;
+	enum class Type_t {Submit, Start, Finish, Cancel, Archive, Suspend, Resume} Type;
+	Job_t Job;
+
+	template <class Archive> void serialize(Archive & ar)
+	{
+		ar(Sequence, Type, Job);
+	}
+};
+
+struct Gpu_t
+// jobd 管理的一个 GPU
+{
+	unsigned Id;	// 按 PCI 总线排序的编号, 与 CUDA_DEVICE_ORDER=PCI_BUS_ID 时的编号相同
+	std::string Model;
+	std::uint64_t Memory;	// 显存 (MiB)
+
+	template <class Archive> void serialize(Archive & ar)
+	{
+		ar(Id, Model, Memory);
+	}
+};
+
+struct Usage_t
+// 一个用户最近使用的资源, 用于公平调度. 已经使用的核时和 GPU 时按照半衰期指数衰减.
+{
+	double CoreHours = 0, GpuHours = 0;	// 衰减到 Time 时的值
+	std::int64_t Time = 0;	// 上次更新的时间 (unix 时间戳)
+	unsigned RunningCores = 0, RunningGpus = 0;	// 正在运行的任务占用的资源
+
+	template <class Archive> void serialize(Archive & ar)
+	{
+		ar(CoreHours, GpuHours, Time, RunningCores, RunningGpus);
+	}
+};
+
 struct Output_t
 // 服务端发送给客户端的信息
 {
 	std::vector<Job_t> Jobs;
-	template <class Archive> void serialize(Archive & ar)
+	unsigned NextId = 0;	// 下一个任务将使用的 Id, jobd 重启后从这里继续
+	std::map<std::string, Usage_t> Usage;	// 每个用户最近使用的资源, 随快照保存
+	std::vector<Gpu_t> Gpus;	// jobd 启动时检测到的 GPU
+	std::uint64_t TotalMemory = 0;	// 可以分配给任务的内存 (MiB)
+	template <class Archive> void serialize(Archive & ar, std::uint32_t const version)
 	{
 		ar(Jobs);
+		if (version >= 2)
+			ar(NextId);
+		if (version >= 6)
+			ar(Usage);
+		if (version >= 10)
+			ar(Gpus);
+		if (version >= 12)
+			ar(TotalMemory);
 	}
 };
+CEREAL_CLASS_VERSION(Output_t, FormatVersion);
+
+inline std::filesystem::path state_directory()
+// 保存任务状态 (out.dat, journal.dat) 的目录, 需要在重启后保留.
+// 可以用环境变量 GPUJOB_STATE_DIRECTORY 指定其它目录, 以便测试.
+{
+	if (auto directory = std::getenv("GPUJOB_STATE_DIRECTORY"))
+		return directory;
+	else
+		return "/var/lib/gpujob";
+}
+
+inline std::filesystem::path runtime_directory()
+// jobd 运行时使用的目录, 其中有 jobd 监听的 socket. /run/gpujob 属于 root, 其它用户不能替换其中的文件.
+// 可以用环境变量 GPUJOB_RUNTIME_DIRECTORY 指定其它目录, 以便测试.
+{
+	if (auto directory = std::getenv("GPUJOB_RUNTIME_DIRECTORY"))
+		return directory;
+	else
+		return "/run/gpujob";
+}
+
+inline std::filesystem::path jobd_socket()
+{
+	return runtime_directory() / "jobd.sock";
+}
+
+inline void sync_path(std::filesystem::path path)
+// 把文件或目录的内容刷到磁盘上.
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		throw std::system_error{errno, std::generic_category(), fmt::format("open {}", path.string())};
+	auto result = fsync(fd);
+	close(fd);
+	if (result)
+		throw std::system_error{errno, std::generic_category(), fmt::format("fsync {}", path.string())};
+}
+
+template <class T> std::string serialize_message(const T& value)
+{
+	std::ostringstream out;
+	cereal::PortableBinaryOutputArchive{out}(value);
+	return out.str();
+}
+
+template <class T> T deserialize_message(const std::string& message)
+{
+	T value;
+	std::istringstream in{message};
+	cereal::PortableBinaryInputArchive{in}(value);
+	return value;
+}
+
+// 一条消息的最大长度, 超过时认为对方出错, 不再继续接收
+constexpr std::uint32_t MaxMessageSize = 64 * 1024 * 1024;
+
+inline std::string frame_message(const std::string& message)
+// 把消息封装为实际发送的内容: 4 字节的长度, 然后是内容.
+{
+	std::uint32_t size = message.size();
+	return std::string{reinterpret_cast<const char*>(&size), sizeof(size)} + message;
+}
+
+inline bool send_message(int fd, const std::string& message)
+// 阻塞地发送一条消息.
+{
+	auto buffer = frame_message(message);
+	for (std::size_t sent = 0; sent < buffer.size();)
+	{
+		auto n = send(fd, buffer.data() + sent, buffer.size() - sent, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0)
+			return false;
+		sent += n;
+	}
+	return true;
+}
+
+inline std::optional<std::string> take_message(std::string& buffer)
+// 如果 buffer 开头已经有一条完整的消息, 取出并返回它的内容.
+{
+	std::uint32_t size;
+	if (buffer.size() < sizeof(size))
+		return {};
+	std::memcpy(&size, buffer.data(), sizeof(size));
+	if (size > MaxMessageSize)
+		throw std::runtime_error{fmt::format("message too large: {} bytes", size)};
+	if (buffer.size() < sizeof(size) + size)
+		return {};
+	auto message = buffer.substr(sizeof(size), size);
+	buffer.erase(0, sizeof(size) + size);
+	return message;
+}
+
+inline std::optional<std::string> receive_message(int fd)
+// 阻塞地读取一条完整的消息. 对方提前关闭连接时返回 nullopt.
+{
+	std::string buffer;
+	std::array<char, 4096> chunk;
+	while (true)
+	{
+		if (auto message = take_message(buffer))
+			return message;
+		auto n = recv(fd, chunk.data(), chunk.size(), 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		else if (n <= 0)
+			return {};
+		buffer.append(chunk.data(), n);
+	}
+}
+
+inline std::optional<Reply_t> request_jobd(const Input_t& input)
+// 通过 jobd_socket() 把请求交给 jobd, 并等待它的回复.
+// 连不上 jobd (例如 jobd 是旧版本) 时返回 nullopt; 已经连上之后出错则抛出异常, 以免重复提交.
+// 对端不是以 root (或者自己的用户, 例如测试时) 运行的进程时不发送请求, 也抛出异常.
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return {};
+	sockaddr_un address{};
+	address.sun_family = AF_UNIX;
+	std::strncpy(address.sun_path, jobd_socket().c_str(), sizeof(address.sun_path) - 1);
+	if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)))
+	{
+		close(fd);
+		return {};
+	}
+	ucred credential;
+	socklen_t length = sizeof(credential);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credential, &length)
+		|| (credential.uid != 0 && credential.uid != geteuid()))
+	{
+		close(fd);
+		throw std::runtime_error{fmt::format("{} is not served by root, refuse to submit", jobd_socket().string())};
+	}
+	std::optional<std::string> reply;
+	if (send_message(fd, serialize_message(input)))
+		reply = receive_message(fd);
+	close(fd);
+	if (!reply)
+		throw std::runtime_error{"jobd closed the connection without reply"};
+	return deserialize_message<Reply_t>(*reply);
+}
 
-inline void write_in(Input_t input)
+inline std::optional<Reply_t> write_in(Input_t input)
+// 优先通过 unix socket 提交, 此时返回 jobd 的回复; 否则退回到写入 /tmp/gpujob/in 的方式, 此时返回 nullopt.
 {
+	if (auto reply = request_jobd(input))
+	{
+		if (!reply->Error.empty())
+			throw std::runtime_error{fmt::format("jobd refused the request: {}", reply->Error)};
+		return reply;
+	}
+
 	boost::interprocess::file_lock in_lock{"/tmp/gpujob/in.lock"};
 	in_lock.lock();
 	unsigned i = 0;
@@ -72,6 +426,7 @@ inline void write_in(Input_t input)
 		std::ofstream out{fmt::format("/tmp/gpujob/in/{}", i)};
 		cereal::JSONOutputArchive{out}(input);
 	}
+	return {};
 }
 
 inline std::optional<Input_t> read_in()
@@ -98,10 +453,19 @@ inline std::optional<Input_t> read_in()
 			if (p.is_regular_file())
 			{
 				Input_t input;
+				try
 				{
 					std::ifstream in{p.path()};
 					cereal::JSONInputArchive{in}(input);
 				}
+				catch (cereal::Exception&)
+				{
+					// 旧版本的客户端写入的请求没有版本号
+					LegacyInput_t legacy;
+					std::ifstream in{p.path()};
+					cereal::JSONInputArchive{in}(legacy);
+					input = legacy;
+				}
 				if (auto owner = get_owner(p.path()); owner)
 				{
 					if (!result)
@@ -135,24 +499,242 @@ inline std::optional<Input_t> read_in()
 	return result;
 }
 
-inline void write_out(Output_t output)
+inline void write_snapshot(std::filesystem::path path, const Output_t& output, std::uint64_t sequence)
+// 快照的格式: OutMagic, 然后是 portable binary 格式的版本号, 快照包含到的 journal 序号, 以及 Output_t.
+// 写完后刷到磁盘上. 调用者负责加锁, 以及通过 rename 原子地替换旧的快照.
 {
-	boost::interprocess::file_lock out_lock{"/tmp/gpujob/out.lock"};
-	out_lock.lock();
 	{
-		std::ofstream out{"/tmp/gpujob/out.dat"};
-		cereal::JSONOutputArchive{out}(output);
+		std::ofstream out{path, std::ios::binary};
+		out.write(OutMagic.data(), OutMagic.size());
+		cereal::PortableBinaryOutputArchive{out}(FormatVersion, sequence, output);
+		if (!out.flush())
+			throw std::runtime_error{fmt::format("failed to write {}", path.string())};
 	}
+	sync_path(path);
+}
+
+inline std::pair<Output_t, std::uint64_t> read_snapshot(std::filesystem::path path)
+// 读取快照, 返回其内容和它包含到的 journal 序号. 调用者负责加锁.
+{
+	std::pair<Output_t, std::uint64_t> result;
+	std::ifstream in{path, std::ios::binary};
+	std::string magic(OutMagic.size(), '\0');
+	if (!in.read(magic.data(), magic.size()) || magic != OutMagic)
+		throw std::runtime_error{fmt::format("{} is not written by a compatible jobd", path.string())};
+	cereal::PortableBinaryInputArchive archive{in};
+	std::uint32_t version;
+	archive(version);
+	if (version > FormatVersion)
+		throw std::runtime_error{fmt::format
+			("{} has format version {}, newer than {}, please upgrade gpujob", path.string(), version, FormatVersion)};
+	archive(result.second, result.first);
+	return result;
+}
+
+template <class T> std::string encode_little_endian(T value)
+// 把整数按小端序编码. 写入文件的长度等字段使用固定的字节序, 与机器无关 (portable binary 也使用小端序).
+{
+	std::string result(sizeof(T), '\0');
+	for (std::size_t i = 0; i < sizeof(T); i++)
+		result[i] = static_cast<char>(value >> (8 * i));
+	return result;
+}
+
+template <class T> T decode_little_endian(const char* data)
+{
+	T value = 0;
+	for (std::size_t i = 0; i < sizeof(T); i++)
+		value |= T{static_cast<unsigned char>(data[i])} << (8 * i);
+	return value;
+}
+
+inline std::string serialize_journal_entry(const JournalEntry_t& entry)
+// journal 中每条记录的格式: 4 字节 (小端序) 的长度, 然后是 portable binary 格式的版本号和记录.
+{
+	std::ostringstream out;
+	cereal::PortableBinaryOutputArchive{out}(FormatVersion, entry);
+	auto payload = out.str();
+	return encode_little_endian<std::uint32_t>(payload.size()) + payload;
+}
+
+inline std::optional<JournalEntry_t> read_journal_entry(std::istream& in)
+// 从 journal 或者存档中读取一条记录. 读到文件末尾或者不完整的记录 (写入时崩溃) 时返回 nullopt.
+{
+	std::array<char, sizeof(std::uint32_t)> header;
+	if (!in.read(header.data(), header.size()))
+		return {};
+	auto size = decode_little_endian<std::uint32_t>(header.data());
+	std::string payload(size, '\0');
+	if (!in.read(payload.data(), size))
+		return {};
+	std::istringstream record{payload};
+	cereal::PortableBinaryInputArchive archive{record};
+	std::uint32_t version;
+	archive(version);
+	if (version > FormatVersion)
+		throw std::runtime_error{fmt::format
+			("journal has format version {}, newer than {}, please upgrade gpujob", version, FormatVersion)};
+	JournalEntry_t entry;
+	archive(entry);
+	return entry;
+}
+
+inline std::uint64_t apply_journal(Output_t& output, std::filesystem::path path, std::uint64_t after)
+// 把 journal 中序号大于 after 的记录应用到 output 上, 返回最后一条记录的序号. 调用者负责加锁.
+{
+	std::map<unsigned, std::size_t> index;
+	for (std::size_t i = 0; i < output.Jobs.size(); i++)
+		index[output.Jobs[i].Id] = i;
+	std::ifstream in{path, std::ios::binary};
+	while (auto entry = read_journal_entry(in))
+	{
+		if (entry->Sequence <= after)
+			continue;
+		after = entry->Sequence;
+		output.NextId = std::max(output.NextId, entry->Job.Id + 1);
+		auto it = index.find(entry->Job.Id);
+		if (entry->Type == JournalEntry_t::Type_t::Archive)
+		{
+			// 用最后一个任务填补被删除的位置
+			if (it != index.end())
+			{
+				auto position = it->second;
+				index.erase(it);
+				if (position + 1 != output.Jobs.size())
+				{
+					output.Jobs[position] = std::move(output.Jobs.back());
+					index[output.Jobs[position].Id] = position;
+				}
+				output.Jobs.pop_back();
+			}
+		}
+		else if (it != index.end())
+			output.Jobs[it->second] = entry->Job;
+		else
+		{
+			index[entry->Job.Id] = output.Jobs.size();
+			output.Jobs.push_back(entry->Job);
+		}
+	}
+	return after;
+}
+
+inline void write_out(const Output_t& output)
+// 直接写入完整的快照, 并清空 journal.
+{
+	boost::interprocess::file_lock out_lock{(state_directory() / "out.lock").c_str()};
+	out_lock.lock();
+	write_snapshot(state_directory() / "out.dat", output, 0);
+	std::ofstream{state_directory() / "journal.dat", std::ios::binary | std::ios::trunc};
 }
 
 inline Output_t read_out()
+// 读取快照, 再应用 journal 中快照之后的记录, 得到当前的状态.
 {
-	boost::interprocess::file_lock out_lock{"/tmp/gpujob/out.lock"};
+	boost::interprocess::file_lock out_lock{(state_directory() / "out.lock").c_str()};
 	out_lock.lock();
-	Output_t result;
+	auto [result, sequence] = read_snapshot(state_directory() / "out.dat");
+	apply_journal(result, state_directory() / "journal.dat", sequence);
+	return result;
+}
+
+inline std::string format_memory_usage(const Output_t& output)
+// 正在运行的任务申请的内存和可以分配给任务的内存, 例如 "Memory: 4096/126976 MiB".
+// 旧版本的 jobd 不记录总量, 此时只显示已经申请的.
+{
+	std::uint64_t used = 0;
+	for (auto& job : output.Jobs)
+		if (job.Status == Job_t::Status_t::Running && !job.Array)
+			used += job.Memory;
+	if (output.TotalMemory)
+		return fmt::format("Memory: {}/{} MiB", used, output.TotalMemory);
+	else
+		return fmt::format("Memory: {} MiB", used);
+}
+
+inline std::vector<unsigned> parse_cpu_list(const std::string& list)
+// 解析 sysfs 中 "0-3,8-11" 格式的 CPU 列表, 也用于 jobd 传给任务的 GPUJOB_CPUS.
+{
+	std::vector<unsigned> cpus;
+	std::istringstream in{list};
+	for (std::string range; std::getline(in, range, ',');)
 	{
-		std::ifstream in{"/tmp/gpujob/out.dat"};
-		cereal::JSONInputArchive{in}(result);
+		if (range.find_first_not_of(" \n") == std::string::npos)
+			continue;
+		auto dash = range.find('-');
+		unsigned first = std::stoul(range.substr(0, dash));
+		unsigned last = dash == std::string::npos ? first : std::stoul(range.substr(dash + 1));
+		for (auto cpu = first; cpu <= last; cpu++)
+			cpus.push_back(cpu);
 	}
-	return result;
+	return cpus;
+}
+
+inline std::string format_cpu_list(std::vector<unsigned> cpus)
+// 把 CPU 列表写成 "0-3,8-11" 的格式, 可以直接用于 taskset -c 或者 mpirun --cpu-set.
+{
+	std::ranges::sort(cpus);
+	std::vector<std::string> ranges;
+	for (std::size_t i = 0; i < cpus.size();)
+	{
+		auto j = i;
+		while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1)
+			j++;
+		ranges.push_back(i == j ? std::to_string(cpus[i]) : fmt::format("{}-{}", cpus[i], cpus[j]));
+		i = j + 1;
+	}
+	return fmt::format("{}", fmt::join(ranges, ","));
+}
+
+// archive.idx 中每一项的长度: 4 字节的 Id 和 8 字节的位置, 都是小端序. 各项按 Id 排序
+inline constexpr std::size_t ArchiveIndexEntrySize = sizeof(std::uint32_t) + sizeof(std::uint64_t);
+
+inline std::string encode_archive_index_entry(unsigned id, std::uint64_t offset)
+{
+	return encode_little_endian<std::uint32_t>(id) + encode_little_endian(offset);
+}
+
+inline std::optional<Job_t> read_archived_job(unsigned id)
+// 在存档中查找已经移出 out.dat 的任务. archive.idx 按 Id 排序, 因此只需要二分查找索引中的几项,
+// 然后读取一条记录, 不需要读取整个索引或者整个存档.
+{
+	boost::interprocess::file_lock out_lock{(state_directory() / "out.lock").c_str()};
+	out_lock.lock();
+	auto path = state_directory() / "archive.idx";
+	if (!std::filesystem::exists(path))
+		return {};
+	std::ifstream index{path, std::ios::binary};
+	auto read_id = [&](std::uint64_t position) -> std::optional<std::pair<unsigned, std::uint64_t>>
+	{
+		std::array<char, ArchiveIndexEntrySize> entry;
+		index.seekg(position * ArchiveIndexEntrySize);
+		if (!index.read(entry.data(), entry.size()))
+			return {};
+		return std::pair
+		{
+			decode_little_endian<std::uint32_t>(entry.data()),
+			decode_little_endian<std::uint64_t>(entry.data() + sizeof(std::uint32_t))
+		};
+	};
+	std::uint64_t low = 0, high = std::filesystem::file_size(path) / ArchiveIndexEntrySize;
+	while (low < high)
+	{
+		auto middle = low + (high - low) / 2;
+		auto entry = read_id(middle);
+		if (!entry)
+			return {};
+		else if (entry->first < id)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	auto entry = read_id(low);
+	if (!entry || entry->first != id)
+		return {};
+	std::ifstream data{state_directory() / "archive.dat", std::ios::binary};
+	data.seekg(entry->second);
+	if (auto record = read_journal_entry(data))
+		return record->Job;
+	else
+		return {};
 }
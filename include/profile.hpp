@@ -0,0 +1,521 @@
+# pragma once
+# include <set>
+# include <regex>
+# include <cstdlib>
+# include <algorithm>
+# include <ranges>
+# include <job.hpp>
+
+// 程序的配置 (profile): 每种程序 (VASP, LAMMPS 等) 需要哪些参数, 占用多少核, 加载哪些模块, 运行什么命令.
+// 内置的配置在 BuiltinProfiles 中, /etc/gpujob/profiles.conf (或者环境变量 GPUJOB_PROFILES 指定的文件)
+// 中的同名配置会替换内置的配置, 其它的配置会加在后面. job, job-cli 和 jobd 都用这里的配置生成任务的命令,
+// 增加新的程序或者版本时只需要修改配置文件, 不需要重新编译. 配置文件只在第一次用到时读取并解析一次.
+//
+// 配置文件的格式:
+//	[名称]	开始一个新的配置
+//	program = vasp	提交时 --program 指定的程序, 默认与名称相同. 同一个程序可以有多个配置, 按 gpu 区分
+//	gpu = no | optional | yes	是否可以 (或者必须) 使用 GPU, 默认为 optional
+//	container = no | optional | yes	是否在容器中运行, optional 时由 --run-in-container 决定. 默认为 no
+//	parameter = 名称 类型 [默认值]	类型为 number (正整数), string, flag 或 choice.
+//		choice 的默认值位置是所有可选的值, 第一个为默认值; 可以写为 "显示的名称=展开到命令中的值".
+//		没有默认值的 number 和 string 参数必须由用户提供.
+//	cores = 名称 ...	占用的核数, 为这些参数或者数字的乘积
+//	module-path = 目录, module = 模块	运行前 module use 的目录和 module load 的模块, 可以有多行
+//	environment = 变量名 模板	运行前 export 的环境变量, 模板展开为空时不设置
+//	command = 模板	要运行的命令
+// 模板中 {名称} 替换为参数的值, {名称|q} 替换为用单引号括起来的值, {?名称:...} 只在参数有值 (不为空, 0 或 false)
+// 时展开, {!名称:...} 只在参数没有值时展开. \{, \} 和 \\ 表示这些字符本身.
+// 除了配置中的参数, 模板中还可以用 gpus (GPU 的数量), gpu-list (GPU 的编号, 由 jobd 挑选时为
+// $CUDA_VISIBLE_DEVICES), run-path, run-in-container, array-task-id (数组任务的子任务的序号) 和 user (提交任务的用户).
+// 数组任务的子任务由 jobd 用它自己读到的配置重新展开, 因此 array-task-id 只能用在内置的和 /etc/gpujob/profiles.conf
+// 中的配置里; GPUJOB_PROFILES 指定的配置只有提交任务的用户能看到, 子任务沿用提交时生成的命令,
+// 其中的 {array-task-id} 为空, 子任务的序号只能从环境变量 GPUJOB_ARRAY_TASK_ID 得到.
+inline constexpr std::string_view BuiltinProfiles = R"(
+[vasp-gpu]
+program = vasp
+gpu = yes
+container = yes
+parameter = vasp-version choice 6.3.1=631
+parameter = vasp-variant choice std gam ncl
+parameter = openmp-threads number 2
+cores = gpus openmp-threads
+module-path = /opt/intel/oneapi/modulefiles
+module-path = /opt/nvidia/hpc_sdk/modulefiles
+module = nvhpc/23.3
+module = mkl/2022.2.1
+command = ulimit -s unlimited && mpirun -np {gpus} -x OMP_NUM_THREADS={openmp-threads} -x MKL_THREADING_LAYER=INTEL -x CUDA_DEVICE_ORDER=PCI_BUS_ID -x CUDA_VISIBLE_DEVICES={gpu-list} vasp_gpu_{vasp-version}_{vasp-variant}
+
+[vasp-cpu]
+program = vasp
+gpu = no
+parameter = vasp-version choice 6.3.1=631
+parameter = vasp-variant choice std gam ncl
+parameter = mpi-threads number
+parameter = openmp-threads number
+cores = mpi-threads openmp-threads
+module-path = /opt/intel/oneapi/modulefiles
+module = compiler/2022.2.0
+module = mkl/2022.2.0
+module = mpi/2021.7.0
+module = icc/2022.2.0
+command = ulimit -s unlimited && mpirun -np {mpi-threads} -genv OMP_NUM_THREADS {openmp-threads} -genv MKL_THREADING_LAYER INTEL vasp_cpu_{vasp-version}_{vasp-variant}
+
+[lammps]
+parameter = mpi-threads number
+parameter = openmp-threads number 1
+parameter = lammps-input string lammps.in
+parameter = no-gpu-sf flag
+cores = mpi-threads openmp-threads
+command = . /etc/profile.d/lammps.sh && mpirun -n {mpi-threads} -x OMP_NUM_THREADS={openmp-threads} {?gpus:-x CUDA_DEVICE_ORDER=PCI_BUS_ID -x CUDA_VISIBLE_DEVICES={gpu-list} }lmp -in {lammps-input|q}{?gpus:{!no-gpu-sf: -sf gpu} -pk gpu {gpus}}
+
+[custom]
+container = optional
+parameter = custom-command string
+parameter = custom-command-cores number
+cores = custom-command-cores
+environment = GPUJOB_CUSTOM_COMMAND_CORES {custom-command-cores}
+environment = GPUJOB_USE_GPU {?gpus:1}
+environment = CUDA_DEVICE_ORDER {?gpus:PCI_BUS_ID}
+environment = CUDA_VISIBLE_DEVICES {?gpus:{gpu-list}}
+command = {custom-command}
+
+[farm]
+parameter = task-file string
+parameter = parallel number 1
+parameter = cores-per-task number 1
+cores = parallel cores-per-task
+environment = CUDA_DEVICE_ORDER {?gpus:PCI_BUS_ID}
+environment = CUDA_VISIBLE_DEVICES {?gpus:{gpu-list}}
+command = job-cli --action farm-worker --task-file {task-file|q} --parallel {parallel}
+)";
+
+// 不在配置中声明, 由提交任务的程序或者 jobd 提供的参数
+inline const std::set<std::string> BuiltinParameters
+	{"gpus", "gpu-list", "run-path", "run-in-container", "array-task-id", "user"};
+
+inline std::string shell_quote(std::string_view text)
+// 用单引号括起来, 其中的单引号写为 '"'"'
+{
+	std::string result = "'";
+	for (auto c : text)
+		if (c == '\'')
+			result += R"('"'"')";
+		else
+			result.push_back(c);
+	return result + "'";
+}
+
+inline bool parameter_set(const std::map<std::string, std::string>& values, const std::string& name)
+// 参数有值: 不为空, 0 或 false
+{
+	auto it = values.find(name);
+	return it != values.end() && !it->second.empty() && it->second != "0" && it->second != "false";
+}
+
+struct Template_t
+// 预先解析好的模板, 展开时只需要拼接字符串
+{
+	struct Node_t
+	{
+		enum class Type_t {Text, Value, Quoted, If, Unless} Type;
+		std::string Text;	// Text 的内容, 或者其它类型引用的参数名
+		std::vector<Node_t> Children;	// If 和 Unless 条件成立时展开的部分
+	};
+	std::vector<Node_t> Nodes;
+
+	static std::vector<Node_t> parse(std::string_view text, std::size_t& i, bool nested)
+	{
+		std::vector<Node_t> nodes;
+		auto append = [&](char c)
+		{
+			if (nodes.empty() || nodes.back().Type != Node_t::Type_t::Text)
+				nodes.push_back({Node_t::Type_t::Text, {}, {}});
+			nodes.back().Text.push_back(c);
+		};
+		while (i < text.size())
+			if (text[i] == '\\' && i + 1 < text.size() && std::string_view{"{}\\"}.contains(text[i + 1]))
+			{
+				append(text[i + 1]);
+				i += 2;
+			}
+			else if (text[i] == '}')
+			{
+				if (!nested)
+					throw std::invalid_argument{"unmatched \"}\" in template."};
+				i++;
+				return nodes;
+			}
+			else if (text[i] == '{')
+			{
+				auto end = text.find_first_of(":}", i + 1);
+				if (end == std::string_view::npos)
+					throw std::invalid_argument{"unterminated \"{\" in template."};
+				auto head = text.substr(i + 1, end - i - 1);
+				if (head.starts_with('?') || head.starts_with('!'))
+				{
+					if (text[end] != ':')
+						throw std::invalid_argument{fmt::format("missing \":\" after \"{{{}\" in template.", head)};
+					i = end + 1;
+					nodes.push_back
+					({
+						head.starts_with('?') ? Node_t::Type_t::If : Node_t::Type_t::Unless,
+						std::string{head.substr(1)}, parse(text, i, true)
+					});
+				}
+				else
+				{
+					if (text[end] != '}')
+						throw std::invalid_argument{fmt::format("unexpected \":\" after \"{{{}\" in template.", head)};
+					if (head.ends_with("|q"))
+						nodes.push_back({Node_t::Type_t::Quoted, std::string{head.substr(0, head.size() - 2)}, {}});
+					else
+						nodes.push_back({Node_t::Type_t::Value, std::string{head}, {}});
+					i = end + 1;
+				}
+			}
+			else
+				append(text[i++]);
+		if (nested)
+			throw std::invalid_argument{"unterminated \"{?\" or \"{!\" in template."};
+		return nodes;
+	}
+	static Template_t parse(std::string_view text)
+	{
+		std::size_t i = 0;
+		return {parse(text, i, false)};
+	}
+
+	// 模板中引用的所有参数名
+	static void names(const std::vector<Node_t>& nodes, std::set<std::string>& result)
+	{
+		for (auto& node : nodes)
+			if (node.Type != Node_t::Type_t::Text)
+			{
+				result.insert(node.Text);
+				names(node.Children, result);
+			}
+	}
+	std::set<std::string> names() const
+	{
+		std::set<std::string> result;
+		names(Nodes, result);
+		return result;
+	}
+
+	static void render(const std::vector<Node_t>& nodes, const std::map<std::string, std::string>& values,
+		std::string& result)
+	{
+		for (auto& node : nodes)
+			if (node.Type == Node_t::Type_t::Text)
+				result += node.Text;
+			else if (node.Type == Node_t::Type_t::Value || node.Type == Node_t::Type_t::Quoted)
+			{
+				auto it = values.find(node.Text);
+				auto value = it == values.end() ? std::string_view{} : std::string_view{it->second};
+				result += node.Type == Node_t::Type_t::Value ? std::string{value} : shell_quote(value);
+			}
+			else if (parameter_set(values, node.Text) == (node.Type == Node_t::Type_t::If))
+				render(node.Children, values, result);
+	}
+	std::string render(const std::map<std::string, std::string>& values) const
+	{
+		std::string result;
+		render(Nodes, values, result);
+		return result;
+	}
+};
+
+struct Profile_t
+{
+	enum class Need_t {No, Optional, Yes};
+	struct Parameter_t
+	{
+		std::string Name;
+		enum class Type_t {Number, String, Flag, Choice} Type;
+		std::optional<std::string> Default;
+		std::vector<std::pair<std::string, std::string>> Choices;	// 显示的名称和展开到命令中的值
+	};
+	std::string Name, Program;
+	bool System = true;	// 内置的或者 /etc/gpujob/profiles.conf 中的配置, jobd 也能读到
+	Need_t Gpu = Need_t::Optional, Container = Need_t::No;
+	std::vector<Parameter_t> Parameters;
+	std::vector<std::string> Cores;
+	std::vector<std::string> ModulePaths, Modules;
+	std::vector<std::pair<std::string, Template_t>> Environment;
+	Template_t Command;
+
+	const Parameter_t* parameter(const std::string& name) const
+	{
+		auto it = std::ranges::find(Parameters, name, &Parameter_t::Name);
+		return it == Parameters.end() ? nullptr : &*it;
+	}
+
+	std::set<std::string> names() const
+	// 命令, 环境变量和核数中用到的参数名
+	{
+		std::set<std::string> names = Command.names();
+		for (auto& [name, value] : Environment)
+			names.merge(value.names());
+		names.insert(Cores.begin(), Cores.end());
+		return names;
+	}
+
+	std::map<std::string, std::string> resolve(std::map<std::string, std::string> values) const
+	// 检查参数, 补上默认值, 把 choice 参数换成展开到命令中的值. 参数不合法时抛出异常.
+	{
+		for (auto& [name, value] : values)
+			if (!BuiltinParameters.contains(name) && !parameter(name))
+				throw std::invalid_argument{fmt::format("{} does not accept parameter {}.", Name, name)};
+		for (auto& parameter : Parameters)
+		{
+			auto& value = values[parameter.Name];
+			if (value.empty())
+			{
+				if (parameter.Default)
+					value = *parameter.Default;
+				else if (parameter.Type == Parameter_t::Type_t::Flag)
+					value = "false";
+				else
+					throw std::invalid_argument{fmt::format("{} needs parameter {}.", Name, parameter.Name)};
+			}
+			if (parameter.Type == Parameter_t::Type_t::Number)
+			{
+				if (!std::ranges::all_of(value, [](char c){return c >= '0' && c <= '9';}) || value.size() > 9
+					|| std::stoul(value) == 0)
+					throw std::invalid_argument{fmt::format("{} must be a positive integer.", parameter.Name)};
+			}
+			else if (parameter.Type == Parameter_t::Type_t::Flag)
+			{
+				if (value != "true" && value != "false")
+					throw std::invalid_argument{fmt::format("{} must be true or false.", parameter.Name)};
+			}
+			else if (parameter.Type == Parameter_t::Type_t::Choice)
+			{
+				auto choice = std::ranges::find(parameter.Choices, value, &std::pair<std::string, std::string>::first);
+				if (choice == parameter.Choices.end())
+					throw std::invalid_argument{fmt::format("invalid {}: {}.", parameter.Name, value)};
+				value = choice->second;
+			}
+		}
+		return values;
+	}
+
+	std::string render(const std::map<std::string, std::string>& resolved) const
+	// 生成任务的完整命令: 进入运行目录, 设置环境变量, 运行命令, 输出追加到 output.txt
+	{
+		std::string exports;
+		for (auto& [name, value] : Environment)
+			if (auto text = value.render(resolved); !text.empty())
+				exports += fmt::format("export {}={} && ", name, text);
+		auto run_path = resolved.find("run-path");
+		return fmt::format
+		(
+			"cd {}; "
+			"( "
+				"echo start at $(date '+%Y-%m-%d %H:%M:%S') "
+				"&& {}{} "
+				"&& echo end at $(date '+%Y-%m-%d %H:%M:%S') "
+			") 2>&1 | tee -a output.txt",
+			shell_quote(run_path == resolved.end() ? "." : run_path->second), exports, Command.render(resolved)
+		);
+	}
+
+	void apply(Job_t& job, std::map<std::string, std::string> values) const
+	// 根据参数设置任务的命令和需要的资源. values 中还需要 gpus, gpu-list 和 run-path; user 取自环境变量 USER.
+	{
+		if (Gpu == Need_t::Yes && !parameter_set(values, "gpus"))
+			throw std::invalid_argument{fmt::format("{} needs GPUs.", Name)};
+		if (Gpu == Need_t::No && parameter_set(values, "gpus"))
+			throw std::invalid_argument{fmt::format("{} can not use GPUs.", Name)};
+		job.RunInContainer = Container == Need_t::Yes
+			|| (Container == Need_t::Optional && parameter_set(values, "run-in-container"));
+		values["run-in-container"] = job.RunInContainer ? "true" : "false";
+		// 容器中把本机的 /home 挂载到 /hosthome, 不能访问其它目录
+		auto& run_path = values["run-path"];
+		if (job.RunInContainer)
+		{
+			if (run_path == "/home" || run_path.starts_with("/home/"))
+				run_path = "/hosthome" + run_path.substr(5);
+			else if (run_path != "/hosthome" && !run_path.starts_with("/hosthome/"))
+				throw std::invalid_argument{"jobs in the container can only access files in /home."};
+		}
+		values["user"] = std::getenv("USER") ? std::getenv("USER") : "";
+		static const std::regex home_path("/(?:hosthome|home)/[^/]+/(.*)");
+		std::smatch match;
+		job.Comment = fmt::format
+			("{} {}", values["user"], std::regex_match(run_path, match, home_path) ? match[1].str() : run_path);
+		auto resolved = resolve(values);
+		job.ProgramString = render(resolved);
+		job.UsingCores = 1;
+		for (auto& factor : Cores)
+			job.UsingCores *= std::stoul(resolved.contains(factor) ? resolved[factor] : factor);
+		job.ModulePaths = ModulePaths;
+		job.Modules = Modules;
+		// 只有 jobd 也能读到的配置才记录下来, 供 jobd 重新展开数组任务的子任务
+		job.Profile = System ? Name : "";
+		job.Parameters = std::move(values);
+	}
+};
+
+struct Profiles_t
+{
+	std::vector<Profile_t> Items;
+
+	static Profiles_t parse(std::istream& in, const std::string& source)
+	// 解析配置文件, 格式不对时抛出异常
+	{
+		Profiles_t profiles;
+		auto need = [](const std::string& value)
+		{
+			std::map<std::string, Profile_t::Need_t> needs
+				{{"no", Profile_t::Need_t::No}, {"optional", Profile_t::Need_t::Optional}, {"yes", Profile_t::Need_t::Yes}};
+			if (!needs.contains(value))
+				throw std::invalid_argument{fmt::format("expect no, optional or yes instead of {}.", value)};
+			return needs[value];
+		};
+		auto check = [](const Profile_t& profile)
+		{
+			for (auto& name : profile.names())
+				if (!BuiltinParameters.contains(name) && !profile.parameter(name)
+					&& !std::ranges::all_of(name, [](char c){return c >= '0' && c <= '9';}))
+					throw std::invalid_argument{fmt::format("{} uses undefined parameter {}.", profile.Name, name)};
+		};
+		std::string line;
+		unsigned line_number = 0;
+		try
+		{
+			while (std::getline(in, line))
+			{
+				line_number++;
+				auto begin = line.find_first_not_of(" \t");
+				if (begin == std::string::npos || line[begin] == '#')
+					continue;
+				line = line.substr(begin, line.find_last_not_of(" \t\r") + 1 - begin);
+				if (line.starts_with('[') && line.ends_with(']'))
+				{
+					if (!profiles.Items.empty())
+						check(profiles.Items.back());
+					auto& profile = profiles.Items.emplace_back();
+					profile.Name = profile.Program = line.substr(1, line.size() - 2);
+					continue;
+				}
+				auto equal = line.find('=');
+				if (equal == std::string::npos)
+					throw std::invalid_argument{"expect \"key = value\"."};
+				if (profiles.Items.empty())
+					throw std::invalid_argument{"expect \"[name]\" before the first setting."};
+				auto& profile = profiles.Items.back();
+				auto key = line.substr(0, line.find_last_not_of(" \t", equal - 1) + 1);
+				auto value = line.substr(std::min(line.find_first_not_of(" \t", equal + 1), line.size()));
+				std::vector<std::string> words;
+				std::istringstream word_stream{value};
+				for (std::string word; word_stream >> word;)
+					words.push_back(word);
+				if (key == "program")
+					profile.Program = value;
+				else if (key == "gpu")
+					profile.Gpu = need(value);
+				else if (key == "container")
+					profile.Container = need(value);
+				else if (key == "parameter")
+				{
+					std::map<std::string, Profile_t::Parameter_t::Type_t> types
+					{
+						{"number", Profile_t::Parameter_t::Type_t::Number},
+						{"string", Profile_t::Parameter_t::Type_t::String},
+						{"flag", Profile_t::Parameter_t::Type_t::Flag},
+						{"choice", Profile_t::Parameter_t::Type_t::Choice}
+					};
+					if (words.size() < 2 || !types.contains(words[1]))
+						throw std::invalid_argument{"expect \"parameter = name number|string|flag|choice [default]\"."};
+					auto& parameter = profile.Parameters.emplace_back(words[0], types[words[1]]);
+					if (parameter.Type == Profile_t::Parameter_t::Type_t::Choice)
+					{
+						if (words.size() < 3)
+							throw std::invalid_argument{fmt::format("choice {} has no value.", words[0])};
+						for (auto& word : words | std::views::drop(2))
+							if (auto position = word.find('='); position != std::string::npos)
+								parameter.Choices.emplace_back(word.substr(0, position), word.substr(position + 1));
+							else
+								parameter.Choices.emplace_back(word, word);
+						parameter.Default = parameter.Choices.front().first;
+					}
+					// string 的默认值可以包含空格
+					else if (words.size() > 2)
+					{
+						auto position = value.find(words[1], words[0].size()) + words[1].size();
+						parameter.Default = value.substr(value.find_first_not_of(" \t", position));
+					}
+				}
+				else if (key == "cores")
+					profile.Cores = words;
+				else if (key == "module-path")
+					profile.ModulePaths.push_back(value);
+				else if (key == "module")
+					profile.Modules.push_back(value);
+				else if (key == "environment")
+				{
+					if (words.empty())
+						throw std::invalid_argument{"expect \"environment = name template\"."};
+					auto rest = value.substr(words[0].size());
+					rest.erase(0, rest.find_first_not_of(" \t"));
+					profile.Environment.emplace_back(words[0], Template_t::parse(rest));
+				}
+				else if (key == "command")
+					profile.Command = Template_t::parse(value);
+				else
+					throw std::invalid_argument{fmt::format("unknown key {}.", key)};
+			}
+			if (!profiles.Items.empty())
+				check(profiles.Items.back());
+		}
+		catch (const std::invalid_argument& e)
+		{
+			throw std::runtime_error{fmt::format("{}:{}: {}", source, line_number, e.what())};
+		}
+		return profiles;
+	}
+
+	const Profile_t* find(const std::string& name) const
+	{
+		auto it = std::ranges::find(Items, name, &Profile_t::Name);
+		return it == Items.end() ? nullptr : &*it;
+	}
+
+	const Profile_t& select(const std::string& program, bool gpu) const
+	// 按名称, 或者按程序和是否使用 GPU 挑选配置
+	{
+		if (auto profile = find(program))
+			return *profile;
+		for (auto& profile : Items)
+			if
+			(
+				profile.Program == program
+				&& (gpu ? profile.Gpu != Profile_t::Need_t::No : profile.Gpu != Profile_t::Need_t::Yes)
+			)
+				return profile;
+		throw std::invalid_argument{fmt::format("program '{}' not recognized.", program)};
+	}
+};
+
+inline const Profiles_t& profiles()
+// 内置的配置, 加上配置文件中的配置. 只在第一次调用时读取
+{
+	static const Profiles_t profiles = []
+	{
+		std::istringstream builtin{std::string{BuiltinProfiles}};
+		auto result = Profiles_t::parse(builtin, "builtin profiles");
+		auto path = std::getenv("GPUJOB_PROFILES") ? std::getenv("GPUJOB_PROFILES") : "/etc/gpujob/profiles.conf";
+		if (std::ifstream in{path}; in)
+			for (auto& profile : Profiles_t::parse(in, path).Items)
+			{
+				profile.System = !std::getenv("GPUJOB_PROFILES");
+				if (auto it = std::ranges::find(result.Items, profile.Name, &Profile_t::Name); it != result.Items.end())
+					*it = std::move(profile);
+				else
+					result.Items.push_back(std::move(profile));
+			}
+		return result;
+	}();
+	return profiles;
+}
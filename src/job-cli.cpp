@@ -1,50 +1,388 @@
-# include <set>
+# include <chrono>
+# include <thread>
+# include <sched.h>
+# include <sys/wait.h>
 # include <job.hpp>
+# include <profile.hpp>
 # include <cxxopts.hpp>
 # include <fmt/format.h>
 # include <nameof.hpp>
 
 using namespace std::literals;
 
+std::vector<std::string> split_command_line(const std::string& line)
+// 按照 shell 的规则把一行拆分为参数. 支持单引号, 双引号和反斜杠转义, 不支持变量替换等其它功能.
+{
+	std::vector<std::string> words;
+	std::optional<std::string> word;
+	char quote = 0;
+	for (std::size_t i = 0; i < line.size(); i++)
+	{
+		char c = line[i];
+		if (quote == '\'')
+		{
+			if (c == '\'')
+				quote = 0;
+			else
+				word->push_back(c);
+		}
+		else if (quote == '"')
+		{
+			if (c == '"')
+				quote = 0;
+			else if (c == '\\' && i + 1 < line.size() && std::string_view{"\"\\$`"}.contains(line[i + 1]))
+				word->push_back(line[++i]);
+			else
+				word->push_back(c);
+		}
+		else if (c == ' ' || c == '\t')
+		{
+			if (word)
+				words.push_back(*std::exchange(word, std::nullopt));
+		}
+		else
+		{
+			if (!word)
+				word.emplace();
+			if (c == '\'' || c == '"')
+				quote = c;
+			else if (c == '\\' && i + 1 < line.size())
+				word->push_back(line[++i]);
+			else
+				word->push_back(c);
+		}
+	}
+	if (quote)
+		throw std::invalid_argument{"unterminated quote."};
+	if (word)
+		words.push_back(*word);
+	return words;
+}
+
+std::string format_status(const Job_t& job)
+// 已经结束的任务附上退出码或者杀死它的信号, 以便区分正常结束的和出错的任务
+{
+	if (job.ExitCode)
+		return fmt::format("{}(exit {})", nameof::nameof_enum(job.Status), *job.ExitCode);
+	else if (job.ExitSignal)
+		return fmt::format("{}(signal {})", nameof::nameof_enum(job.Status), *job.ExitSignal);
+	else
+		return std::string{nameof::nameof_enum(job.Status)};
+}
+
+int run_farm(const std::string& task_file, unsigned parallel)
+// 任务农场: 在一个任务占用的资源中依次运行大量的小任务, 同时最多运行 parallel 个, 省去每个小任务单独排队和启动的开销.
+// 任务文件的每一行是一个用 bash 运行的命令, 空行和以 "#" 开头的行被忽略; 运行期间可以向文件末尾追加新的任务,
+// 所有任务都结束并且文件中没有新的任务时退出. 最后一行可以没有换行符. 每个任务的输出写入 <任务文件>.logs/<行号>.txt,
+// 结束时在 <任务文件>.results 中追加一行 "行号 退出码 运行秒数" (被信号杀死时退出码为 128 加信号的编号).
+// 已经有结果的任务不再运行, 因此被取消后重新提交只会运行剩下的任务.
+// jobd 分配的 CPU (GPUJOB_CPUS) 被平均分给各个并行的位置, 每个小任务绑定在它所在位置的 CPU 上.
+{
+	std::ifstream in{task_file};
+	if (!in)
+		throw std::invalid_argument{fmt::format("can not open task file {}.", task_file)};
+	if (!parallel)
+		throw std::invalid_argument{"--parallel must be a positive integer."};
+	std::filesystem::path log_directory = task_file + ".logs", result_file = task_file + ".results";
+	std::filesystem::create_directories(log_directory);
+	std::set<unsigned> done;
+	if (std::ifstream previous{result_file}; previous)
+		for (std::string line; std::getline(previous, line);)
+		{
+			std::istringstream fields{line};
+			if (unsigned index; fields >> index)
+				done.insert(index);
+		}
+	std::ofstream results{result_file, std::ios::app};
+
+	std::vector<std::vector<unsigned>> slot_cpus;
+	if (auto cpus = parse_cpu_list(std::getenv("GPUJOB_CPUS") ? std::getenv("GPUJOB_CPUS") : ""); cpus.size() >= parallel)
+		for (unsigned slot = 0; slot < parallel; slot++)
+			slot_cpus.emplace_back
+				(cpus.begin() + slot * cpus.size() / parallel, cpus.begin() + (slot + 1) * cpus.size() / parallel);
+
+	// 读取下一个需要运行的任务. 最后一行还没有写完 (没有换行符) 时把它记在 partial 中, 等它写完后再读;
+	// accept_partial 为 true 时把它当作完整的一行
+	unsigned line_number = 0;
+	std::string partial;
+	auto next_task = [&](bool accept_partial) -> std::optional<std::pair<unsigned, std::string>>
+	{
+		std::string line;
+		partial.clear();
+		for (auto position = in.tellg(); std::getline(in, line); position = in.tellg())
+		{
+			if (in.eof())
+			{
+				in.clear();
+				if (!accept_partial)
+				{
+					in.seekg(position);
+					partial = line;
+					return {};
+				}
+			}
+			line_number++;
+			if (auto start = line.find_first_not_of(" \t"); start == std::string::npos || line[start] == '#')
+				continue;
+			if (!done.contains(line_number))
+				return std::pair{line_number, line};
+		}
+		in.clear();
+		return {};
+	};
+
+	struct Running_t
+	{
+		unsigned Index, Slot;
+		std::chrono::steady_clock::time_point Start;
+	};
+	std::map<pid_t, Running_t> running;
+	std::vector<bool> busy(parallel);
+	unsigned succeeded = 0, failed = 0;
+	bool accept_partial = false;
+	while (true)
+	{
+		while (running.size() < parallel)
+		{
+			auto task = next_task(std::exchange(accept_partial, false));
+			if (!task)
+				break;
+			auto slot = std::ranges::find(busy, false) - busy.begin();
+			auto log = (log_directory / fmt::format("{}.txt", task->first)).string();
+			auto pid = fork();
+			if (pid < 0)
+				throw std::runtime_error{fmt::format("fork failed: {}", std::strerror(errno))};
+			else if (pid == 0)
+			{
+				if (!slot_cpus.empty())
+				{
+					cpu_set_t set;
+					CPU_ZERO(&set);
+					for (auto cpu : slot_cpus[slot])
+						CPU_SET(cpu, &set);
+					sched_setaffinity(0, sizeof(set), &set);
+					setenv("GPUJOB_CPUS", fmt::format("{}", fmt::join(slot_cpus[slot], ",")).c_str(), 1);
+				}
+				setenv("GPUJOB_FARM_TASK_ID", std::to_string(task->first).c_str(), 1);
+				setenv("GPUJOB_FARM_SLOT", std::to_string(slot).c_str(), 1);
+				auto null = open("/dev/null", O_RDONLY);
+				auto fd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+				if (null < 0 || fd < 0)
+					_exit(127);
+				dup2(null, STDIN_FILENO);
+				dup2(fd, STDOUT_FILENO);
+				dup2(fd, STDERR_FILENO);
+				execl("/bin/bash", "bash", "-c", task->second.c_str(), nullptr);
+				_exit(127);
+			}
+			busy[slot] = true;
+			running[pid] = {task->first, static_cast<unsigned>(slot), std::chrono::steady_clock::now()};
+		}
+		// 没有任务在运行时, 最后一行没有换行符: 等一秒, 这期间文件没有再写入就把它当作完整的一行运行
+		if (running.empty())
+		{
+			if (partial.empty())
+				break;
+			std::error_code ec;
+			auto size = std::filesystem::file_size(task_file, ec);
+			std::this_thread::sleep_for(1s);
+			accept_partial = std::filesystem::file_size(task_file, ec) == size;
+			continue;
+		}
+		int status;
+		auto pid = waitpid(-1, &status, 0);
+		if (pid < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error{fmt::format("waitpid failed: {}", std::strerror(errno))};
+		}
+		auto it = running.find(pid);
+		if (it == running.end())
+			continue;
+		auto code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+		results << fmt::format
+		(
+			"{} {} {:.3f}\n", it->second.Index, code,
+			std::chrono::duration<double>(std::chrono::steady_clock::now() - it->second.Start).count()
+		) << std::flush;
+		(code ? failed : succeeded)++;
+		busy[it->second.Slot] = false;
+		running.erase(it);
+	}
+	std::cout << fmt::format
+		("farm finished: {} tasks succeeded, {} failed, {} skipped.\n", succeeded, failed, done.size());
+	return failed ? 1 : 0;
+}
+
+Job_t create_job(const cxxopts::ParseResult& args)
+// 根据命令行参数生成要提交的任务, 参数不合法时抛出异常.
+{
+	Job_t job;
+	job.Id = 0;
+	job.Status = Job_t::Status_t::Pending;
+	job.RunNow = args["run-now"].as<bool>();
+	job.Priority = args["priority"].as<int>();
+
+	auto gpu = args["gpu"].as<std::vector<unsigned>>();
+	auto gpu_count = args["gpus"].as<unsigned>();
+	if (gpu_count && gpu.size())
+		throw std::invalid_argument{"--gpu and --gpus can not be used together."};
+	// 由 jobd 挑选 GPU 时, 命令中用 $CUDA_VISIBLE_DEVICES 代替具体的编号
+	std::size_t gpu_number = gpu_count ? gpu_count : gpu.size();
+	auto gpu_list = gpu_count ? "$CUDA_VISIBLE_DEVICES"s : fmt::format("{}", fmt::join(gpu, ","));
+	job.GpuModel = args["gpu-model"].as<std::string>();
+	job.GpuMinMemory = args["gpu-memory"].as<unsigned>() * 1024;
+	if ((!job.GpuModel.empty() || job.GpuMinMemory) && !gpu_count)
+		throw std::invalid_argument{"--gpu-model and --gpu-memory can only be used together with --gpus."};
+	job.GpuSlots = args["gpu-share"].as<unsigned>();
+	if (job.GpuSlots && !gpu_number)
+		throw std::invalid_argument{"--gpu-share can only be used together with --gpu or --gpus."};
+	job.Memory = args["memory"].as<unsigned>() * 1024ull;
+
+	// 命令和占用的核数由程序的配置 (见 profile.hpp) 生成. 配置中的参数可以用同名的选项 (例如 --mpi-threads)
+	// 或者 --set name=value 指定
+	auto run_path = args["run-path"].as<std::string>();
+	if (run_path.empty())
+		run_path = std::filesystem::current_path();
+	auto& profile = profiles().select(args["program"].as<std::string>(), gpu_number);
+	std::map<std::string, std::string> values
+	{
+		{"gpus", std::to_string(gpu_number)}, {"gpu-list", gpu_list}, {"run-path", run_path},
+		{"run-in-container", args["run-in-container"].as<bool>() ? "true" : "false"}
+	};
+	for (auto& parameter : profile.Parameters)
+		if (args.count(parameter.Name))
+			values[parameter.Name] = parameter.Type == Profile_t::Parameter_t::Type_t::Flag
+				? "true" : args[parameter.Name].as<std::string>();
+	for (auto& item : args["set"].as<std::vector<std::string>>())
+		if (auto position = item.find('='); position != std::string::npos)
+			values[item.substr(0, position)] = item.substr(position + 1);
+		else
+			throw std::invalid_argument{fmt::format("--set expects name=value instead of {}.", item)};
+	profile.apply(job, values);
+	job.UsingGpus = gpu;
+	job.GpuCount = gpu_count;
+	if (auto limit = args["time-limit"].as<std::string>(); !limit.empty())
+	{
+		// 数字后面可以跟单位 s, m, h 或 d, 没有单位时按分钟计算
+		std::smatch match;
+		if (!std::regex_match(limit, match, std::regex(R"((\d+)([smhd]?))")))
+			throw std::invalid_argument{fmt::format("time limit '{}' not recognized.", limit)};
+		std::map<std::string, std::int64_t> units = {{"s", 1}, {"", 60}, {"m", 60}, {"h", 3600}, {"d", 86400}};
+		job.TimeLimit = std::stoll(match[1].str()) * units[match[2].str()];
+		if (!job.TimeLimit)
+			throw std::invalid_argument{"time limit must be positive."};
+	}
+	if (auto array = args["array"].as<std::string>(); !array.empty())
+	{
+		// 格式为 "first-last%max_running", "-last" 和 "%max_running" 都可以省略
+		std::smatch match;
+		if (!std::regex_match(array, match, std::regex(R"((\d+)(?:-(\d+))?(?:%(\d+))?)")))
+			throw std::invalid_argument{fmt::format("array '{}' not recognized.", array)};
+		job.Array.emplace();
+		job.Array->First = std::stoul(match[1].str());
+		job.Array->Last = match[2].matched ? std::stoul(match[2].str()) : job.Array->First;
+		job.Array->MaxRunning = match[3].matched ? std::stoul(match[3].str()) : 0;
+		if (job.Array->Last < job.Array->First)
+			throw std::invalid_argument{fmt::format("array '{}' is empty.", array)};
+		// 子任务由 jobd 用它自己读到的配置重新展开, GPUJOB_PROFILES 中的配置只能用环境变量得到序号
+		if (!profile.System && profile.names().contains("array-task-id"))
+			throw std::invalid_argument{fmt::format
+				("profile {} from GPUJOB_PROFILES can not use {{array-task-id}} in an array job, "
+					"use $GPUJOB_ARRAY_TASK_ID instead.", profile.Name)};
+	}
+	return job;
+}
+
 int main(int argc, const char** argv)
 {
 	try
 	{
 		cxxopts::Options options("job-cli", "A command line interface for the simple job scheduler.");
 		options.add_options()
-			("action", "Action to do (\"submit\", \"list\", \"query\" or \"cancel\"). "
+			("action", "Action to do (\"submit\", \"list\", \"query\", \"cancel\", \"gpus\", \"share\", \"profiles\" "
+				"or \"farm-worker\"). "
 				"Use \"list\" to print all submitted jobs, no more arguments is needed. "
 				"Use \"query\" to query detail information of a job, only job id (\"-id\", see below) is needed. "
 				"Use \"cancel\" to cancel a submitted job, only job id (\"-id\", see below) is needed. "
+				"Use \"gpus\" to print the model and memory of the GPUs managed by jobd. "
+				"Use \"share\" to print the recent usage of each user, which decides the order of fair-share scheduling. "
+				"Use \"profiles\" to print the programs that can be submitted and their parameters. "
+				"\"farm-worker\" runs the tasks of a farm job (see \"--task-file\"), it is started by jobd. "
 				"For \"submit\", all the other arguments are needed.", cxxopts::value<std::string>())
 			("id", "Job id, need to be provided only when query or cancel a job.", cxxopts::value<unsigned>())
-			("program", "Program to run (\"vasp\", \"lammps\" or \"custom\").",
-				cxxopts::value<std::string>()->default_value(""))
-			("vasp-version", "VASP version (\"6.3.1\"), need to be provided only when running VASP.",
-				cxxopts::value<std::string>()->default_value(""))
-			("vasp-variant", "VASP Variant (\"std\", \"gam\" or \"ncl\"), "
-				"need to be provided only when running VASP.",
+			("program", "Program to run (\"vasp\", \"lammps\", \"custom\" or other programs in /etc/gpujob/profiles.conf). "
+				"A profile name (for example \"vasp-gpu\") selects the profile directly.",
 				cxxopts::value<std::string>()->default_value(""))
+			("vasp-version", "VASP version (default \"6.3.1\"), used only when running VASP.",
+				cxxopts::value<std::string>())
+			("vasp-variant", "VASP Variant (\"std\", \"gam\" or \"ncl\", default \"std\"), "
+				"used only when running VASP.",
+				cxxopts::value<std::string>())
 			("gpu", "GPU id to use, separated by comma (for example, \"0,1\").",
 				cxxopts::value<std::vector<unsigned>>()->default_value(""))
+			("gpus", "Number of GPUs to use. jobd chooses free GPUs close to each other when the job starts, "
+				"so that the job does not wait for specific GPUs. Can not be used together with \"--gpu\".",
+				cxxopts::value<unsigned>()->default_value("0"))
+			("gpu-model", "Only use GPUs whose model contains this string (case insensitive, for example \"RTX 4090\"). "
+				"Need \"--gpus\".", cxxopts::value<std::string>()->default_value(""))
+			("gpu-memory", "Only use GPUs with at least this many GB of memory. Need \"--gpus\".",
+				cxxopts::value<unsigned>()->default_value("0"))
+			("gpu-share", "Share GPUs with other small jobs: use only this many slots of each GPU "
+				"(jobd splits each GPU into a fixed number of slots). Default is to use whole GPUs exclusively.",
+				cxxopts::value<unsigned>()->default_value("0"))
+			("memory", "Memory in GB the job needs. jobd starts the job only when this much memory is free, "
+				"and may kill the job if it uses more. Default is not to limit.",
+				cxxopts::value<unsigned>()->default_value("0"))
 			("mpi-threads", "Number of MPI threads to use. "
 				"Need to be provided only when running VASP on cpu or LAMMPS.",
-				cxxopts::value<unsigned>()->default_value("0"))
+				cxxopts::value<std::string>())
 			("openmp-threads", "Number of OpenMP threads to use. "
 				"Need to be provided only when running VASP on CPU. "
 				"Optional when running VASP on GPU (default to 2) or LAMMPS (default to 1).",
-				cxxopts::value<unsigned>()->default_value("0"))
-			("lammps-input", "File path of LAMMPS input script. Need to be provided only when running LAMMPS.",
-				cxxopts::value<std::string>()->default_value(""))
+				cxxopts::value<std::string>())
+			("lammps-input", "File path of LAMMPS input script (default \"lammps.in\"). Used only when running LAMMPS.",
+				cxxopts::value<std::string>())
 			("custom-command", "Custom command to run, need to be provided only when select to run custom program.",
-				cxxopts::value<std::string>()->default_value(""))
+				cxxopts::value<std::string>())
 			("custom-command-cores",
 				"Number of cores to use, need to be provided only when select to run custom program.",
-				cxxopts::value<unsigned>()->default_value("0"))
+				cxxopts::value<std::string>())
+			("task-file", "Submit many small tasks as one farm job (\"--program farm\"): each line of this file is a command, "
+				"the job runs them one after another in \"--parallel\" slots, each slot using \"--cores-per-task\" cores. "
+				"Output of each task is written to <task-file>.logs/<line>.txt, and its exit code to <task-file>.results. "
+				"Lines appended to the file while the job is running are also run.",
+				cxxopts::value<std::string>())
+			("parallel", "Number of tasks run at the same time by a farm job.",
+				cxxopts::value<std::string>()->default_value("1"))
+			("cores-per-task", "Number of cores used by each task of a farm job (default 1).",
+				cxxopts::value<std::string>())
+			("set", "Set a parameter of the program's profile, for example \"--set vasp-version=6.3.1\". "
+				"Can be given more than once. Parameters with their own option above can also be set this way.",
+				cxxopts::value<std::vector<std::string>>()->default_value(""))
 			("run-path", "Run in custom directory (default is in current directory).",
 				cxxopts::value<std::string>()->default_value(""))
 			("no-gpu-sf", "Do not append \"-sf gpu\" in LAMMPS commandline.",
 				cxxopts::value<bool>()->default_value("false"))
+			("json", "Print the result of \"list\" or \"query\" as JSON.",
+				cxxopts::value<bool>()->default_value("false"))
+			("manifest", "Submit many jobs at once. "
+				"Each line of the file describes a job with the same arguments as a single \"submit\" "
+				"(for example, \"--program custom --custom-command 'echo 1' --custom-command-cores 1\"). "
+				"Empty lines and lines starting with \"#\" are ignored.",
+				cxxopts::value<std::string>()->default_value(""))
+			("time-limit", "Maximum run time of the job, for example \"90m\", \"2h\" or \"1d\" "
+				"(a number without unit means minutes). The job is killed when it runs longer. "
+				"Jobs with a time limit may be started earlier by the backfill scheduler.",
+				cxxopts::value<std::string>()->default_value(""))
+			("array", "Submit the job as an array of tasks, for example \"0-999%16\" runs the command 1000 times "
+				"with GPUJOB_ARRAY_TASK_ID set to 0 ... 999, at most 16 of them at the same time. "
+				"Without \"%\", a --run-now array runs at most as many tasks as fit on all cores at the same time.",
+				cxxopts::value<std::string>()->default_value(""))
+			("priority", "Priority of the job. Jobs with higher priority start first, "
+				"and may suspend running jobs with lower priority if jobd allows preemption.",
+				cxxopts::value<int>()->default_value("0"))
 			("run-now", "Run the job immediately.", cxxopts::value<bool>()->default_value("false"))
 			("run-in-container", "Run the job in ubuntu-22.04 container.",
 				cxxopts::value<bool>()->default_value("false"));
@@ -53,199 +391,46 @@ int main(int argc, const char** argv)
 
 		if (args["action"].as<std::string>() == "submit")
 		{
-			Job_t job;
-			job.Id = 0;
-			job.Status = Job_t::Status_t::Pending;
-			job.RunNow = args["run-now"].as<bool>();
-
-			auto gpu = args["gpu"].as<std::vector<unsigned>>();
-
-			if (args["program"].as<std::string>() == "vasp" && gpu.size())
+			std::vector<Job_t> jobs;
+			if (auto manifest = args["manifest"].as<std::string>(); !manifest.empty())
 			{
-				auto run_path = args["run-path"].as<std::string>();
-				if (run_path.empty())
+				// 先检查所有的任务, 全部没有问题时再一次性提交
+				std::ifstream in{manifest};
+				if (!in)
+					throw std::invalid_argument{fmt::format("can not open manifest {}.", manifest)};
+				std::string line;
+				for (unsigned line_number = 1; std::getline(in, line); line_number++)
 				{
-					run_path = std::filesystem::current_path();
-					if (std::smatch match; std::regex_match(run_path, match, std::regex("/home(/.*)")))
-						run_path = "/hosthome" + match[1].str();
+					if (auto start = line.find_first_not_of(" \t"); start == std::string::npos || line[start] == '#')
+						continue;
+					try
+					{
+						auto words = split_command_line(line);
+						std::vector<const char*> line_argv{argv[0]};
+						for (auto& word : words)
+							line_argv.push_back(word.c_str());
+						jobs.push_back(create_job(options.parse(line_argv.size(), line_argv.data())));
+					}
+					catch (const std::exception& e)
+					{
+						throw std::invalid_argument{fmt::format("{}:{}: {}", manifest, line_number, e.what())};
+					}
 				}
-				auto openmp_threads = args["openmp-threads"].as<unsigned>();
-				if (!openmp_threads)
-					openmp_threads = 2;
-				std::map<std::string, std::string> vasp_version_map {{"6.3.1", "631"}};
-				auto vasp_version = args["vasp-version"].as<std::string>();
-				if (!vasp_version_map.contains(vasp_version))
-					throw std::invalid_argument{fmt::format("Invalid VASP version: {}", vasp_version)};
-				vasp_version = vasp_version_map[vasp_version];
-				std::set<std::string> vasp_variant_set {"std", "gam", "ncl"};
-				auto vasp_variant = args["vasp-variant"].as<std::string>();
-				if (!vasp_variant_set.contains(vasp_variant))
-					throw std::invalid_argument{fmt::format("Invalid VASP variant: {}", vasp_variant)};
-
-				job.Comment = fmt::format("{} {}", std::getenv("USER"), [&]
-				{
-					if (std::smatch match; std::regex_match(run_path, match, std::regex("/hosthome/[^/]+/(.*)")))
-						return match[1].str();
-					else
-						return run_path;
-				}());
-				job.ProgramString = fmt::format
-				(
-					"cd '{}'; "
-					"( "
-						"echo start at $(date '+%Y-%m-%d %H:%M:%S') "
-						"&& . /etc/profile.d/modules.sh "
-						"&& module use /opt/intel/oneapi/modulefiles /opt/nvidia/hpc_sdk/modulefiles "
-						"&& module load nvhpc/23.3 mkl/2022.2.1 "
-						"&& mpirun -np {} -x OMP_NUM_THREADS={} -x MKL_THREADING_LAYER=INTEL "
-							"-x CUDA_DEVICE_ORDER=PCI_BUS_ID -x CUDA_VISIBLE_DEVICES={} vasp_gpu_{}_{} "
-						"&& echo end at $(date '+%Y-%m-%d %H:%M:%S') "
-					") 2>&1 | tee -a output.txt",
-					std::regex_replace(run_path, std::regex("'"), R"('"'"')"),
-					gpu.size(), openmp_threads, fmt::join(gpu, ","), vasp_version, vasp_variant
-				);
-				job.UsingCores = gpu.size() * openmp_threads;
-				job.UsingGpus = gpu;
-				job.RunInContainer = true;
+				if (jobs.empty())
+					throw std::invalid_argument{fmt::format("no job found in manifest {}.", manifest)};
 			}
-			else if (args["program"].as<std::string>() == "vasp" && !gpu.size())
-			{
-				auto mpi_threads = args["mpi-threads"].as<unsigned>();
-				if (!mpi_threads)
-					throw std::invalid_argument{"MPI 线程数必须为正整数."};
-				auto openmp_threads = args["openmp-threads"].as<unsigned>();
-				if (!openmp_threads)
-					throw std::invalid_argument{"OpenMP 线程数必须为正整数."};
-				auto run_path = args["run-path"].as<std::string>();
-				if (run_path.empty())
-					run_path = std::filesystem::current_path();
-				std::map<std::string, std::string> vasp_version_map {{"6.3.1", "631"}};
-				auto vasp_version = args["vasp-version"].as<std::string>();
-				if (!vasp_version_map.contains(vasp_version))
-					throw std::invalid_argument{fmt::format("Invalid VASP version: {}", vasp_version)};
-				vasp_version = vasp_version_map[vasp_version];
-				std::set<std::string> vasp_variant_set {"std", "gam", "ncl"};
-				auto vasp_variant = args["vasp-variant"].as<std::string>();
-				if (!vasp_variant_set.contains(vasp_variant))
-					throw std::invalid_argument{fmt::format("Invalid VASP variant: {}", vasp_variant)};
-
-				job.Comment = fmt::format("{} {}", std::getenv("USER"), [&]
-				{
-					if (std::smatch match; std::regex_match(run_path, match, std::regex("/home/[^/]+/(.*)")))
-						return match[1].str();
-					else
-						return run_path;
-				}());
-				job.ProgramString = fmt::format
-				(
-					"cd '{}'; "
-					"( "
-						"echo start at $(date '+%Y-%m-%d %H:%M:%S') "
-						"&& . /etc/profile.d/modules.sh "
-						"&& module use /opt/intel/oneapi/modulefiles "
-						"&& module load compiler/2022.2.0 mkl/2022.2.0 mpi/2021.7.0 icc/2022.2.0 "
-						"&& mpirun -np {} -genv OMP_NUM_THREADS {} -genv MKL_THREADING_LAYER INTEL vasp_cpu_{}_{} "
-						"&& echo end at $(date '+%Y-%m-%d %H:%M:%S') "
-					") 2>&1 | tee -a output.txt",
-					std::regex_replace(run_path, std::regex("'"), R"('"'"')"),
-					mpi_threads, openmp_threads, vasp_version, vasp_variant
-				);
-				job.UsingCores = mpi_threads * openmp_threads;
-				job.RunInContainer = false;
-			}
-			else if (args["program"].as<std::string>() == "lammps")
-			{
-				auto mpi_threads = args["mpi-threads"].as<unsigned>();
-				if (!mpi_threads)
-					throw std::invalid_argument{"MPI 线程数必须为正整数."};
-				auto openmp_threads = args["openmp-threads"].as<unsigned>();
-				if (!openmp_threads)
-					openmp_threads = 1;
-				auto run_path = args["run-path"].as<std::string>();
-				if (run_path.empty())
-					run_path = std::filesystem::current_path();
-
-				job.Comment = fmt::format("{} {}", std::getenv("USER"), [&]
-				{
-					if (std::smatch match; std::regex_match(run_path, match, std::regex("/home/[^/]+/(.*)")))
-						return match[1].str();
-					else
-						return run_path;
-				}());
-				job.ProgramString = fmt::format
-				(
-					"cd '{}'; "
-					"( "
-						"echo start at $(date '+%Y-%m-%d %H:%M:%S') "
-						"&& . /etc/profile.d/lammps.sh "
-						"&& mpirun -n {} -x OMP_NUM_THREADS={} {}lmp -in '{}'{}"
-						"&& echo end at $(date '+%Y-%m-%d %H:%M:%S') "
-					") 2>&1 | tee -a output.txt",
-					std::regex_replace(run_path, std::regex("'"), R"('"'"')"),
-					mpi_threads, openmp_threads,
-					gpu.size() ? fmt::format("-x CUDA_DEVICE_ORDER=PCI_BUS_ID -x CUDA_VISIBLE_DEVICES={} ",
-						fmt::join(gpu, ",")) : ""s,
-					std::regex_replace(args["lammps-input"].as<std::string>(), std::regex("'"), R"('"'"')"),
-					gpu.size()
-						? fmt::format("{} -pk gpu {}", args["no-gpu-sf"].as<bool>() ? ""s
-							: " -sf gpu"s, gpu.size()) : ""s
-				);
-				job.UsingCores = mpi_threads * openmp_threads;
-				job.UsingGpus = gpu;
-				job.RunInContainer = false;
-			}
-			else if (args["program"].as<std::string>() == "custom")
-			{
-				auto cores = args["custom-command-cores"].as<unsigned>();
-				if (!cores)
-					throw std::invalid_argument{"核心数必须为正整数."};
-				auto run_path = args["run-path"].as<std::string>();
-				if (run_path.empty())
-					run_path = std::filesystem::current_path();
+			else
+				jobs.push_back(create_job(args));
 
-				job.Comment = fmt::format("{} {}", std::getenv("USER"), [&]
-				{
-					if
-					(
-						std::smatch match;
-						std::regex_match(run_path, match, std::regex("/(?:hosthome|home)/[^/]+/(.*)"))
-					)
-						return match[1].str();
-					else
-						return run_path;
-				}());
-				job.ProgramString = fmt::format
-				(
-					"cd '{}'; "
-					"( "
-						"echo start at $(date '+%Y-%m-%d %H:%M:%S') "
-						"&& export GPUJOB_CUSTOM_COMMAND_CORES={} "
-						"{}"
-						"&& {} "
-						"&& echo end at $(date '+%Y-%m-%d %H:%M:%S') "
-					") 2>&1 | tee -a output.txt",
-					std::regex_replace(run_path, std::regex("'"), R"('"'"')"),
-					std::to_string(cores),
-					gpu.size() ? fmt::format
-					(
-						"&& export GPUJOB_USE_GPU=1 "
-						"&& export CUDA_DEVICE_ORDER=PCI_BUS_ID "
-						"&& export CUDA_VISIBLE_DEVICES={} ",
-						fmt::join(gpu, ",")
-					): ""s,
-					args["custom-command"].as<std::string>()
-				);
-				job.UsingCores = cores;
-				job.UsingGpus = gpu;
-				job.RunInContainer = args["run-in-container"].as<bool>();
-			}
+			if (auto reply = write_in({jobs, {}}))
+				std::cout << fmt::format("{}\n", fmt::join(reply->NewJobIds, "\n"));
 			else
-				throw std::invalid_argument
-					{fmt::format("program '{}' not recognized.", args["program"].as<std::string>())};
+				std::cerr << "jobd is not reachable through socket, the jobs are left in the spool directory.\n";
 		}
 		else if (args["action"].as<std::string>() == "list")
 		{
-			auto [jobs] = read_out();
+			auto output = read_out();
+			auto& jobs = output.Jobs;
 			std::sort(jobs.begin(), jobs.end(), [](auto& a, auto& b)
 			{
 				if (a.Status == b.Status)
@@ -253,36 +438,148 @@ int main(int argc, const char** argv)
 				std::map<Job_t::Status_t, unsigned> order =
 				{
 					{Job_t::Status_t::Running, 0},
-					{Job_t::Status_t::Pending, 1},
-					{Job_t::Status_t::Finished, 2}
+					{Job_t::Status_t::Suspended, 1},
+					{Job_t::Status_t::Pending, 2},
+					{Job_t::Status_t::Finished, 3}
 				};
 				return order[a.Status] < order[b.Status];
 			});
-			for (auto& job : jobs)
-				std::cout << fmt::format("{} {} {}\n", job.Id, nameof::nameof_enum(job.Status), job.Comment);
+			if (args["json"].as<bool>())
+				cereal::JSONOutputArchive{std::cout}(cereal::make_nvp("Jobs", jobs));
+			else
+			{
+				std::cout << format_memory_usage(output) << "\n";
+				// 数组任务的子任务不单独列出, 只在数组任务中显示它们的数量
+				for (auto& job : jobs)
+					if (job.Array)
+						std::cout << fmt::format
+						(
+							"{} {} {} [{}-{}%{}: {} pending, {} running, {} finished]\n",
+							job.Id, nameof::nameof_enum(job.Status), job.Comment,
+							job.Array->First, job.Array->Last, job.Array->MaxRunning,
+							job.Array->Last - job.Array->First + 1 - job.Array->Dispatched,
+							job.Array->Running, job.Array->Finished
+						);
+					else if (!job.ArrayTask)
+						std::cout << fmt::format("{} {} {}\n", job.Id, format_status(job), job.Comment);
+			}
 		}
 		else if (args["action"].as<std::string>() == "query")
 		{
 			auto id = args["id"].as<unsigned>();
-			auto [jobs] = read_out();
+			auto jobs = read_out().Jobs;
 			auto it = std::find_if(jobs.begin(), jobs.end(), [&](auto& job)
 			{
 				return job.Id == id;
 			});
 			if (it == jobs.end())
-				throw std::invalid_argument{fmt::format("id {} not found.", id)};
-			std::cout << fmt::format
-			(
-				"ID: {}\nUser: {}\nProgramString: {}\nComment: {}\nUsingCores: {}\nUsingGpus: {}\nStatus: {}\n"
-					"RunInContainer: {}\nRunNow: {}\n",
-				it->Id, it->User, it->ProgramString, it->Comment, it->UsingCores, fmt::join(it->UsingGpus, ","),
-				nameof::nameof_enum(it->Status), it->RunInContainer, it->RunNow
-			);
+			{
+				// 较早结束的任务已经被移到存档中
+				if (auto archived = read_archived_job(id))
+					it = jobs.insert(jobs.end(), *archived);
+				else
+					throw std::invalid_argument{fmt::format("id {} not found.", id)};
+			}
+			if (args["json"].as<bool>())
+				cereal::JSONOutputArchive{std::cout}(cereal::make_nvp("Job", *it));
+			else
+			{
+				std::cout << fmt::format
+				(
+					"ID: {}\nUser: {}\nProgramString: {}\nComment: {}\nUsingCores: {}\nUsingGpus: {}\nStatus: {}\n"
+						"RunInContainer: {}\nRunNow: {}\nTimeLimit: {}\nStartTime: {}\nFinishTime: {}\n"
+						"Priority: {}\nSuspendedSeconds: {}\nGpuCount: {}\nGpuModel: {}\nGpuMinMemory: {}\nGpuSlots: {}\n"
+						"Memory: {}\nExitCode: {}\nExitSignal: {}\n",
+					it->Id, it->User, it->ProgramString, it->Comment, it->UsingCores, fmt::join(it->UsingGpus, ","),
+					nameof::nameof_enum(it->Status), it->RunInContainer, it->RunNow,
+					it->TimeLimit, it->StartTime, it->FinishTime, it->Priority, it->SuspendedSeconds,
+					it->GpuCount, it->GpuModel, it->GpuMinMemory, it->GpuSlots, it->Memory,
+					it->ExitCode ? std::to_string(*it->ExitCode) : "", it->ExitSignal ? std::to_string(*it->ExitSignal) : ""
+				);
+				if (it->Array)
+					std::cout << fmt::format
+					(
+						"Array: {}-{}\nArrayMaxRunning: {}\nArrayDispatched: {}\nArrayRunning: {}\nArrayFinished: {}\n",
+						it->Array->First, it->Array->Last, it->Array->MaxRunning,
+						it->Array->Dispatched, it->Array->Running, it->Array->Finished
+					);
+				if (it->ArrayTask)
+					std::cout << fmt::format("ArrayJob: {}\nArrayTaskId: {}\n", it->ArrayTask->first, it->ArrayTask->second);
+				// 申请的和实际用到的资源. 正在运行的任务的统计是 jobd 上次保存快照时的值.
+				if (auto& measured = it->Measured; measured.Samples)
+					std::cout << fmt::format
+					(
+						"UsedCpuSeconds: {:.0f}\nCores (requested/used): {}/{:.2f}\nMemory (requested/peak, MiB): {}/{}\n"
+							"ReadBytes: {}\nWriteBytes: {}\n",
+						measured.CpuSeconds, it->UsingCores, measured.AverageCores, it->Memory, measured.PeakMemory,
+						measured.ReadBytes, measured.WriteBytes
+					);
+			}
+		}
+		else if (args["action"].as<std::string>() == "share")
+		{
+			// 用量是 jobd 上次保存快照时的值, 最多落后几分钟
+			auto usage = read_out().Usage;
+			if (args["json"].as<bool>())
+				cereal::JSONOutputArchive{std::cout}(cereal::make_nvp("Usage", usage));
+			else
+			{
+				double core_hours = 0, gpu_hours = 0;
+				for (auto& [user, item] : usage)
+				{
+					core_hours += item.CoreHours;
+					gpu_hours += item.GpuHours;
+				}
+				auto share = [](double part, double total){return total > 0 ? part / total * 100 : 0;};
+				std::cout << "User CoreHours CoreShare GpuHours GpuShare RunningCores RunningGpus\n";
+				for (auto& [user, item] : usage)
+					std::cout << fmt::format
+					(
+						"{} {:.1f} {:.1f}% {:.1f} {:.1f}% {} {}\n", user,
+						item.CoreHours, share(item.CoreHours, core_hours), item.GpuHours, share(item.GpuHours, gpu_hours),
+						item.RunningCores, item.RunningGpus
+					);
+			}
+		}
+		else if (args["action"].as<std::string>() == "gpus")
+		{
+			auto gpus = read_out().Gpus;
+			if (args["json"].as<bool>())
+				cereal::JSONOutputArchive{std::cout}(cereal::make_nvp("Gpus", gpus));
+			else
+				for (auto& gpu : gpus)
+					std::cout << fmt::format("{} {} {} MiB\n", gpu.Id, gpu.Model, gpu.Memory);
+		}
+		else if (args["action"].as<std::string>() == "farm-worker")
+			return run_farm(args["task-file"].as<std::string>(), std::stoul(args["parallel"].as<std::string>()));
+		else if (args["action"].as<std::string>() == "profiles")
+		{
+			// 参数后面是默认值, 没有默认值的参数必须提供
+			for (auto& profile : profiles().Items)
+			{
+				std::vector<std::string> parameters;
+				for (auto& parameter : profile.Parameters)
+					if (parameter.Type == Profile_t::Parameter_t::Type_t::Choice)
+					{
+						std::vector<std::string> choices;
+						for (auto& choice : parameter.Choices)
+							choices.push_back(choice.first);
+						parameters.push_back(fmt::format("{}={}", parameter.Name, fmt::join(choices, "|")));
+					}
+					else
+						parameters.push_back(fmt::format("{}={}", parameter.Name, parameter.Default.value_or("")));
+				std::cout << fmt::format
+				(
+					"{} (program {}, gpu {}, container {}): {}\n", profile.Name, profile.Program,
+					nameof::nameof_enum(profile.Gpu), nameof::nameof_enum(profile.Container), fmt::join(parameters, " ")
+				);
+			}
 		}
 		else if (args["action"].as<std::string>() == "cancel")
 		{
 			auto id = args["id"].as<unsigned>();
-			write_in({{}, {{id, ""}}});
+			if (auto reply = write_in({{}, {{id, ""}}}); reply && reply->RemovedJobs.empty())
+				throw std::invalid_argument{fmt::format("can not cancel job {}.", id)};
 		}
 		else
 			throw std::invalid_argument{fmt::format("action {} not recognized.", args["action"].as<std::string>())};
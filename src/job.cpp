@@ -17,11 +17,11 @@
 # include <ftxui/screen/screen.hpp>
 # include <ftxui/screen/string.hpp>
 # include <boost/interprocess/sync/file_lock.hpp>
-# include <boost/process.hpp>
 # include <fmt/format.h>
 # include <cereal/archives/json.hpp>
 # include <nameof.hpp>
 # include <job.hpp>
+# include <profile.hpp>
 
 using namespace std::literals;
 
@@ -37,29 +37,11 @@ void print_help()
 }
 
 std::map<unsigned, std::string> detect_gpu_devices()
-// source nvhpc, 然后使用 pgaccelinfo -l 列出所有的 GPU 设备.
-// 并不是所有的 GPU 都会列出. 只有 NVIDIA GeForce RTX 开头的会被列出.
+// 列出 jobd 检测到的所有 GPU.
 {
 	std::map<unsigned, std::string> devices;
-	boost::process::ipstream command_output;
-	boost::process::child command
-    {
-		boost::process::search_path("bash"), "-c",
-		". /usr/share/Modules/init/bash && module use /opt/nvidia/hpc_sdk/modulefiles "
-			"&& module load nvhpc/22.11 && CUDA_DEVICE_ORDER=PCI_BUS_ID pgaccelinfo | grep 'Device Name'",
-		boost::process::std_out > command_output
-	};
-	std::string a_single_line;
-    unsigned i = 0;
-	while (command.running() && std::getline(command_output, a_single_line) && !a_single_line.empty())
-	{
-		std::regex re{"Device Name:\\s+(.+)"};
-		std::smatch match;
-		if (std::regex_search(a_single_line, match, re))
-			devices[i] = match[1];
-        i++;
-	}
-	command.wait();
+	for (auto& gpu : read_out().Gpus)
+		devices[gpu.Id] = gpu.Memory ? fmt::format("{} {}GB", gpu.Model, gpu.Memory / 1024) : gpu.Model;
 	return devices;
 }
 
@@ -73,13 +55,25 @@ std::optional<Job_t> request_new_job_detail_from_user()
 	std::vector<std::string> program_names {"VASP", "LAMMPS", "Custom Command"};
 	std::vector<std::string> program_internal_names {"vasp", "lammps", "custom"};
 	int program_selected = 0;
-	std::vector<std::string> vasp_version_names {"6.3.1"};
-	std::vector<std::string> vasp_version_internal_names {"631"};
+	// VASP 的版本和变体从配置中读取
+	auto vasp_choices = [](const std::string& parameter_name)
+	{
+		std::vector<std::string> names;
+		if (auto parameter = profiles().select("vasp", false).parameter(parameter_name))
+			for (auto& [name, value] : parameter->Choices)
+				names.push_back(name);
+		return names;
+	};
+	std::vector<std::string> vasp_version_names = vasp_choices("vasp-version");
+	std::vector<std::string> vasp_variant_names = vasp_choices("vasp-variant");
 	int vasp_version_selected = 0;
-	std::vector<std::string> vasp_variant_names {"std", "gam", "ncl"};
 	int vasp_variant_selected = 0;
 	bool gpu_device_use_checked = false;
 	std::vector<std::tuple<std::string, bool, unsigned>> gpu_device_checked;	// 稍后填充
+	bool gpu_auto_checked = false;	// 只指定 GPU 的数量, 由 jobd 挑选
+	std::string gpu_count_text = "1";
+	std::string gpu_model_text;
+	std::string gpu_memory_text = "0";
 	std::string mpi_threads_text = "4";
 	std::string openmp_threads_text = "4";
 	std::string lammps_input_text = "lammps.in";
@@ -93,12 +87,16 @@ std::optional<Job_t> request_new_job_detail_from_user()
 	std::string custom_openmp_threads_text = "2";
 	bool no_gpu_sf_checked = false;
 	bool run_now_checked = false;
+	bool memory_checked = false;
+	std::string memory_text = "16";
 	bool run_in_container_checked = false;
+	std::string memory_usage;
 
 	// 初始化 GPU 相关信息
 	{
 		auto gpu_devices = detect_gpu_devices();
 		auto jobd_output = read_out();
+		memory_usage = format_memory_usage(jobd_output);
 		std::map<unsigned, unsigned> gpu_running, gpu_pending;
 		for (auto& gpu : gpu_devices)
 		{
@@ -113,7 +111,7 @@ std::optional<Job_t> request_new_job_detail_from_user()
 					if (gpu_running.contains(gpu))
 						gpu_running[gpu]++;
 			}
-			else if (job.Status == Job_t::Status_t::Pending)
+			else if (job.Status == Job_t::Status_t::Pending || job.Status == Job_t::Status_t::Suspended)
 				for (auto& gpu : job.UsingGpus)
 					if (gpu_pending.contains(gpu))
 						gpu_pending[gpu]++;
@@ -136,13 +134,14 @@ std::optional<Job_t> request_new_job_detail_from_user()
 	std::string mpi_threads_help_text_lammps = "LAMMPS usually only uses MPI-level parallelism, i.e. the value set here is the actual number of CPU cores occupied. If you really need to use OpenMP-level parallelism, you can check \"Use OpenMP parallel\" in the advanced settings.";
 	std::string lammps_input_help_text = "Specify the input file for LAMMPS here.";
 	std::string custom_command_help_text = "Input the custom command here. The content entered here will be exported as the GPUJOB_CUSTOM_COMMAND environment variable, and will be parsed and executed by bash (\"bash -c $GPUJOB_CUSTOM_COMMAND\").";
-	std::string custom_command_cores_help_text = "Input the number of CPU cores to be occupied here. The content entered here will be exported as the GPUJOB_CUSTOM_COMMAND_CORES environment variable, and will be parsed and queued according to it; but the queue system will not actually limit the use of resources.";
+	std::string custom_command_cores_help_text = "Input the number of CPU cores to be occupied here. The content entered here will be exported as the GPUJOB_CUSTOM_COMMAND_CORES environment variable, and will be parsed and queued according to it. When the scheduler runs the task in its own cgroup, the task can not use more CPU time than this many cores.";
 	std::string custom_path_help_text = "Specify the starting directory of the custom program. The default is the current directory. Note that the GPU version of VASP will run in a ubuntu 22.04 container. In the container, the host's /home is mounted to /hosthome, and cannot access other directories on the host.";
 	std::string custom_openmp_threads_help_text_lammps = "I will export OMP_NUM_THREADS environment variable, but will not add \"-sf omp\" to the command line, you need to add \"/omp\" to the pair_style command in the input file.";
 	std::string custom_openmp_threads_help_text_vasp_gpu = "VASP supports two levels of parallelism, one called MPI, the other called OpenMP. The GPU version of VASP requires one MPI thread to correspond to one GPU, so the actual number of CPU cores occupied is the product of the OpenMP thread number and the number of GPUs selected. Although there is no limit in principle, in practice I found that the performance is slightly better when the OpenMP thread number is 2 than it is 1, and when the OpenMP thread number is 3 or more, it will be much slower. Therefore, if there is no special need, do not modify the default value.";
 	std::string no_gpu_sf_help_text = "Check this option to not add \"-sf gpu\" to the command line. You need to manually add \"/gpu\" to some pair_style commands in the input file.";
 	std::string run_now_help_text = "Run the task immediately without queuing. Sometimes there are some big tasks in front of you, and this task is very small, you can check this option, let it run immediately, without waiting.";
 	std::string run_in_container_help_text = "Run the task in a container. The GPU version of VASP will run in a ubuntu 22.04 container. In the container, the host's /home is mounted to /hosthome, and cannot access other directories on the host.";
+	std::string memory_help_text = "Tell the scheduler how much memory (in GB) the task needs. The task will wait until this much memory is free, and may be killed if it uses more than that. By default the memory is not limited.";
 	auto set_help_text = [&](std::experimental::observer_ptr<const std::string> content)
 	{
 		static std::map<std::experimental::observer_ptr<const std::string>, unsigned> enabled_help;
@@ -205,10 +204,30 @@ std::optional<Job_t> request_new_job_detail_from_user()
 			result->Id = 0;
 			result->Status = Job_t::Status_t::Pending;
 			result->RunNow = run_now_checked;
+			if (memory_checked)
+			{
+				auto memory = try_to_convert_to_positive_integer(memory_text);
+				if (!memory)
+					return "Memory must be a positive integer.";
+				result->Memory = *memory * 1024ull;
+			}
 
 			// 提取选定的 gpu 的信息, 这些信息无论任务类型都是用得到的
 			std::vector<unsigned> selected_gpus;
-			if (gpu_device_use_checked)
+			unsigned gpu_count = 0;
+			if (gpu_device_use_checked && gpu_auto_checked)
+			{
+				auto count = try_to_convert_to_positive_integer(gpu_count_text);
+				if (!count)
+					return "Number of GPUs must be a positive integer.";
+				gpu_count = *count;
+				auto memory = try_to_convert_to_positive_integer(gpu_memory_text);
+				if (gpu_memory_text != "0" && !memory)
+					return "Minimum GPU memory must be a non-negative integer.";
+				result->GpuModel = gpu_model_text;
+				result->GpuMinMemory = memory.value_or(0) * 1024;
+			}
+			else if (gpu_device_use_checked)
 			{
 				for (auto& [name, checked, index] : gpu_device_checked)
 					if (checked)
@@ -216,207 +235,57 @@ std::optional<Job_t> request_new_job_detail_from_user()
 				if (selected_gpus.empty())
 					return "Select at least one GPU.";
 			}
+			// 由 jobd 挑选 GPU 时, 命令中用 $CUDA_VISIBLE_DEVICES 代替具体的编号
+			std::size_t gpu_number = gpu_count ? gpu_count : selected_gpus.size();
+			auto gpu_list = gpu_count ? "$CUDA_VISIBLE_DEVICES"s : fmt::format("{}", fmt::join(selected_gpus, ","));
 
-			// 分任务类别来设置: vasp cpu, vasp gpu, lammps, custom
-			if (program_internal_names[program_selected] == "vasp" && gpu_device_use_checked)
+			// 命令和占用的核数由程序的配置 (见 profile.hpp) 生成, 参数是否合法也由它检查
+			std::map<std::string, std::string> values
 			{
-				// 获取 openmp 线程数
-				std::optional<unsigned> openmp_threads;
-				if (custom_openmp_threads_checked)
-				{
-					auto openmp_threads = try_to_convert_to_positive_integer(openmp_threads_text);
-					if (!openmp_threads)
-						return "Custom OpenMP threads must be a positive integer.";
-				}
-
-				// 获取任务的执行路径
-				std::string run_path;
-				if (custom_path_checked)
-					run_path = custom_path_text;
-				else
-				{
-					run_path = std::filesystem::current_path().string();
-					if (std::smatch match; std::regex_match(run_path, match, std::regex("/home(/.*)?")))
-						run_path = fmt::format("/hosthome{}", match[1].str());
-					else
-						return "GPU version of vasp can only be run in a container, and the container cannot access files on the host except for files in /home.";
-				}
-
-				result->Comment = fmt::format("{} {}", std::getenv("USER"), [&]
-				{
-					if (std::smatch match; std::regex_match(run_path, match, std::regex("/hosthome/[^/]+/(.*)")))
-						return match[1].str();
-					else
-						return run_path;
-				}());
-				result->ProgramString = fmt::format
-				(
-					"cd '{}'; "
-					"( "
-						"echo start at $(date '+%Y-%m-%d %H:%M:%S') "
-						"&& . /etc/profile.d/modules.sh "
-						"&& module use /opt/intel/oneapi/modulefiles /opt/nvidia/hpc_sdk/modulefiles "
-						"&& module load nvhpc/23.3 mkl"
-						"&& ulimit -s unlimited "
-						"&& mpirun -np {} -x OMP_NUM_THREADS={} -x MKL_THREADING_LAYER=INTEL "
-							"-x CUDA_DEVICE_ORDER=PCI_BUS_ID -x CUDA_VISIBLE_DEVICES={} vasp_gpu_{}_{} "
-						"&& echo end at $(date '+%Y-%m-%d %H:%M:%S') "
-					") 2>&1 | tee -a output.txt",
-					std::regex_replace(run_path, std::regex("'"), R"('"'"')"),
-					selected_gpus.size(), *openmp_threads, fmt::join(selected_gpus, ","), 
-					vasp_version_internal_names[vasp_version_selected], vasp_variant_names[vasp_variant_selected]
-				);
-				result->UsingCores = selected_gpus.size() * *openmp_threads;
-				result->UsingGpus = selected_gpus;
-				result->RunInContainer = true;
-			}
-			else if (program_internal_names[program_selected] == "vasp" && !gpu_device_use_checked)
+				{"gpus", std::to_string(gpu_number)}, {"gpu-list", gpu_list},
+				{"run-path", custom_path_checked ? custom_path_text : std::filesystem::current_path().string()},
+				{"run-in-container", run_in_container_checked ? "true" : "false"}
+			};
+			auto program = program_internal_names[program_selected];
+			if (program == "vasp")
 			{
-				// 获取 mpi 和 openmp 线程数
-				auto mpi_threads = try_to_convert_to_positive_integer(mpi_threads_text);
-				if (!mpi_threads)
-					return "MPI threads number must be a positive integer.";
-				auto openmp_threads = try_to_convert_to_positive_integer(openmp_threads_text);
-				if (!openmp_threads)
-					return "OpenMP threads number must be a positive integer.";
-
-				// 获取任务的执行路径
-				std::string run_path;
-				if (custom_path_checked)
-					run_path = custom_path_text;
-				else
-					run_path = std::filesystem::current_path().string();
-
-				result->Comment = fmt::format("{} {}", std::getenv("USER"), [&]
+				if (!vasp_version_names.empty())
+					values["vasp-version"] = vasp_version_names[vasp_version_selected];
+				if (!vasp_variant_names.empty())
+					values["vasp-variant"] = vasp_variant_names[vasp_variant_selected];
+				if (!gpu_device_use_checked)
 				{
-					if (std::smatch match; std::regex_match(run_path, match, std::regex("/home/[^/]+/(.*)")))
-						return match[1].str();
-					else
-						return run_path;
-				}());
-				result->ProgramString = fmt::format
-				(
-					"cd '{}'; "
-					"( "
-						"echo start at $(date '+%Y-%m-%d %H:%M:%S') "
-						"&& . /etc/profile.d/modules.sh "
-						"&& module use /opt/intel/oneapi/modulefiles "
-						"&& module load compiler mkl mpi icc "
-						"&& ulimit -s unlimited "
-						"&& mpirun -np {} -genv OMP_NUM_THREADS {} -genv MKL_THREADING_LAYER INTEL vasp_cpu_{}_{} "
-						"&& echo end at $(date '+%Y-%m-%d %H:%M:%S') "
-					") 2>&1 | tee -a output.txt",
-					std::regex_replace(run_path, std::regex("'"), R"('"'"')"),
-					*mpi_threads, *openmp_threads,
-					vasp_version_internal_names[vasp_version_selected], vasp_variant_names[vasp_variant_selected]
-				);
-				result->UsingCores = *mpi_threads * *openmp_threads;
-				result->RunInContainer = false;
+					values["mpi-threads"] = mpi_threads_text;
+					values["openmp-threads"] = openmp_threads_text;
+				}
+				else if (custom_openmp_threads_checked)
+					values["openmp-threads"] = custom_openmp_threads_text;
 			}
-			else if (program_internal_names[program_selected] == "lammps")
+			else if (program == "lammps")
 			{
-				// 获取 mpi 和 openmp 线程数
-				auto mpi_threads = try_to_convert_to_positive_integer(mpi_threads_text);
-				if (!mpi_threads)
-					return "MPI threads number must be a positive integer.";
-				std::optional<unsigned> openmp_threads = 1;
+				values["mpi-threads"] = mpi_threads_text;
 				if (custom_openmp_threads_checked)
-				{
-					openmp_threads = try_to_convert_to_positive_integer(openmp_threads_text);
-					if (!openmp_threads)
-						return "OpenMP threads number must be a positive integer.";
-				}
-
-				// 获取任务的执行路径
-				std::string run_path;
-				if (custom_path_checked)
-					run_path = custom_path_text;
-				else
-					run_path = std::filesystem::current_path().string();
-
-				result->Comment = fmt::format("{} {}", std::getenv("USER"), [&]
-				{
-					if (std::smatch match; std::regex_match(run_path, match, std::regex("/home/[^/]+/(.*)")))
-						return match[1].str();
-					else
-						return run_path;
-				}());
-				result->ProgramString = fmt::format
-				(
-					"cd '{}'; "
-					"( "
-						"echo start at $(date '+%Y-%m-%d %H:%M:%S') "
-						"&& . /etc/profile.d/lammps.sh "
-						"&& mpirun -n {} -genv OMP_NUM_THREADS={} {}lmp -in '{}'{}"
-						"&& echo end at $(date '+%Y-%m-%d %H:%M:%S') "
-					") 2>&1 | tee -a output.txt",
-					std::regex_replace(run_path, std::regex("'"), R"('"'"')"),
-					*mpi_threads, *openmp_threads,
-					gpu_device_use_checked
-						? fmt::format("-genv CUDA_DEVICE_ORDER=PCI_BUS_ID -genv CUDA_VISIBLE_DEVICES={} ",
-							fmt::join(selected_gpus, ","))
-						: ""s,
-					std::regex_replace(lammps_input_text, std::regex("'"), R"('"'"')"),
-					gpu_device_use_checked
-						? fmt::format("{} -pk gpu {}", no_gpu_sf_checked ? ""s : " -sf gpu"s, selected_gpus.size())
-						: ""s
-				);
-				result->UsingCores = *mpi_threads * *openmp_threads;
-				result->UsingGpus = selected_gpus;
-				result->RunInContainer = false;
+					values["openmp-threads"] = custom_openmp_threads_text;
+				values["lammps-input"] = lammps_input_text;
+				values["no-gpu-sf"] = no_gpu_sf_checked ? "true" : "false";
 			}
-			else if (program_internal_names[program_selected] == "custom")
+			else if (program == "custom")
 			{
-				// 获取占用的 CPU 核数
-				auto cores = try_to_convert_to_positive_integer(custom_command_cores_text);
-				if (!cores)
-					return "Occupied CPU cores number must be a positive integer.";
-
-				// 获取任务的执行路径
-				std::string run_path;
-				if (custom_path_checked)
-					run_path = custom_path_text;
-				else
-					run_path = std::filesystem::current_path().string();
-
-				result->Comment = fmt::format("{} {}", std::getenv("USER"), [&]
-				{
-					if
-					(
-						std::smatch match;
-						std::regex_match(run_path, match, std::regex("/(?:hosthome|home)/[^/]+/(.*)"))
-					)
-						return match[1].str();
-					else
-						return run_path;
-				}());
-				result->ProgramString = fmt::format
-				(
-					"cd '{}'; "
-					"( "
-						"echo start at $(date '+%Y-%m-%d %H:%M:%S') "
-						"&& export GPUJOB_CUSTOM_COMMAND_CORES={} "
-						"{}"
-						"&& {} "
-						"&& echo end at $(date '+%Y-%m-%d %H:%M:%S') "
-					") 2>&1 | tee -a output.txt",
-					std::regex_replace(run_path, std::regex("'"), R"('"'"')"),
-					std::to_string(*cores),
-					gpu_device_use_checked ? fmt::format
-					(
-						"&& export GPUJOB_USE_GPU=1 "
-						"&& export CUDA_DEVICE_ORDER=PCI_BUS_ID "
-						"&& export CUDA_VISIBLE_DEVICES={} ",
-						fmt::join(selected_gpus, ",")
-					): ""s,
-					custom_command_text
-				);
-				result->UsingCores = *cores;
-				result->UsingGpus = selected_gpus;
-				result->RunInContainer = run_in_container_checked;
+				values["custom-command"] = custom_command_text;
+				values["custom-command-cores"] = custom_command_cores_text;
 			}
 			else
 				std::unreachable();
+			try
+			{
+				profiles().select(program, gpu_device_use_checked).apply(*result, values);
+			}
+			catch (const std::exception& e)
+			{
+				return e.what();
+			}
+			result->UsingGpus = selected_gpus;
+			result->GpuCount = gpu_count;
 			return {};
 		};
 		if (auto message = check_and_set_result())
@@ -485,8 +354,34 @@ std::optional<Job_t> request_new_job_detail_from_user()
 					[&]
 					{
 						auto gpus = ftxui::Container::Vertical({});
+						gpus->Add(ftxui::Container::Horizontal
+						({
+							ftxui::Checkbox("Let the scheduler choose this many GPUs: ", &gpu_auto_checked, checkbox_option),
+							ftxui::Input(&gpu_count_text, "") | ftxui::underlined
+								| ftxui::size(ftxui::WIDTH, ftxui::GREATER_THAN, 3)
+								| ftxui::flex_shrink | ftxui::Maybe([&]{return gpu_auto_checked;})
+						}) | ftxui::Renderer([&](ftxui::Element inner)
+							{return ftxui::hbox(ftxui::text("  "), inner, ftxui::filler());}));
+						gpus->Add(ftxui::Container::Vertical
+						({
+							ftxui::Container::Horizontal
+							({
+								ftxui::Renderer([]{return ftxui::text("GPU model contains: ");}),
+								ftxui::Input(&gpu_model_text, "any") | ftxui::underlined
+									| ftxui::size(ftxui::WIDTH, ftxui::GREATER_THAN, 10) | ftxui::flex_shrink
+							}),
+							ftxui::Container::Horizontal
+							({
+								ftxui::Renderer([]{return ftxui::text("Minimum GPU memory (GB): ");}),
+								ftxui::Input(&gpu_memory_text, "") | ftxui::underlined
+									| ftxui::size(ftxui::WIDTH, ftxui::GREATER_THAN, 3) | ftxui::flex_shrink
+							})
+						}) | ftxui::Renderer([&](ftxui::Element inner)
+							{return ftxui::hbox(ftxui::text("      "), inner, ftxui::filler());})
+							| ftxui::Maybe([&]{return gpu_auto_checked;}));
 						for (auto& [name, checked, index] : gpu_device_checked)
 							gpus->Add(ftxui::Checkbox(name, &checked, checkbox_option)
+								| ftxui::Maybe([&]{return !gpu_auto_checked;})
 								| ftxui::Renderer([&](ftxui::Element inner)
 									{return ftxui::hbox(ftxui::text("  "), inner);})
 								| ftxui::Hoverable([&](bool set_or_unset)
@@ -608,6 +503,14 @@ std::optional<Job_t> request_new_job_detail_from_user()
 					| ftxui::Renderer([&](ftxui::Element inner){return ftxui::hbox(inner, ftxui::filler());})
 					| ftxui::Maybe([&]
 						{return program_internal_names[program_selected] == "lammps" && gpu_device_use_checked;}),
+				ftxui::Container::Horizontal
+				({
+					ftxui::Checkbox("Limit memory (GB): ", &memory_checked, checkbox_option),
+					ftxui::Input(&memory_text, "") | ftxui::underlined
+						| ftxui::size(ftxui::WIDTH, ftxui::GREATER_THAN, 3)
+						| ftxui::flex_shrink | ftxui::Maybe([&]{return memory_checked;})
+				}) | ftxui::Hoverable(set_help_text(std::experimental::make_observer(&memory_help_text)))
+					| ftxui::Renderer([&](ftxui::Element inner){return ftxui::hbox(inner, ftxui::filler());}),
 				ftxui::Checkbox("Run immeditally", &run_now_checked, checkbox_option)
 					| ftxui::Hoverable(set_help_text(std::experimental::make_observer(&run_now_help_text)))
 					| ftxui::Renderer([&](ftxui::Element inner){return ftxui::hbox(inner, ftxui::filler());}),
@@ -624,7 +527,8 @@ std::optional<Job_t> request_new_job_detail_from_user()
 				ftxui::Button("Cancel", screen.ExitLoopClosure())
 			})
 				| ftxui::Renderer([&](ftxui::Element inner){return ftxui::hbox(inner, ftxui::filler());})
-		}) | ftxui::Renderer([&](ftxui::Element inner){return ftxui::window(ftxui::text("Submit new job"), inner);}),
+		}) | ftxui::Renderer([&](ftxui::Element inner)
+			{return ftxui::window(ftxui::text(fmt::format("Submit new job ({})", memory_usage)), inner);}),
 		ftxui::Renderer([&]{return ftxui::window(ftxui::text("Help text"), ftxui::paragraph(help_text));})
 	}) | ftxui::Renderer([&](ftxui::Element inner){return ftxui::vbox(inner, ftxui::filler(), ftxui::hbox
 		(
@@ -667,7 +571,11 @@ std::vector<unsigned> request_cancel_job_from_user()
 	{
 		please_refresh = false;
 
-		auto [jobs] = read_out();
+		auto output = read_out();
+		auto jobs = output.Jobs;
+		auto memory_usage = format_memory_usage(output);
+		// 数组任务的子任务随数组任务一起取消, 不单独列出
+		std::erase_if(jobs, [](auto& job){return job.ArrayTask.has_value();});
 		std::deque<bool> selected;
 		selected.resize(jobs.size(), false);
 		auto detail = ftxui::emptyElement();
@@ -682,8 +590,9 @@ std::vector<unsigned> request_cancel_job_from_user()
 			std::map<Job_t::Status_t, unsigned> order =
 			{
 				{Job_t::Status_t::Running, 0},
-				{Job_t::Status_t::Pending, 1},
-				{Job_t::Status_t::Finished, 2}
+				{Job_t::Status_t::Suspended, 1},
+				{Job_t::Status_t::Pending, 2},
+				{Job_t::Status_t::Finished, 3}
 			};
 			return order[a.Status] < order[b.Status];
 		});
@@ -747,7 +656,8 @@ std::vector<unsigned> request_cancel_job_from_user()
 					}));
 				return ftxui::Container::Vertical(columns);
 			}() | ftxui::vscroll_indicator | ftxui::frame | ftxui::size(ftxui::HEIGHT, ftxui::EQUAL, 10)
-				| ftxui::Renderer([&](ftxui::Element inner){return ftxui::window(ftxui::text("Job list"), inner);}),
+				| ftxui::Renderer([&](ftxui::Element inner)
+					{return ftxui::window(ftxui::text(fmt::format("Job list ({})", memory_usage)), inner);}),
 			ftxui::Container::Horizontal
 			({
 				ftxui::Button("Refresh", [&]
@@ -797,7 +707,8 @@ int main(int argc, const char** argv)
 		{
 			auto result = request_new_job_detail_from_user();
 			if (result)
-				write_in({{*result}, {}});
+				if (auto reply = write_in({{*result}, {}}))
+					std::cout << fmt::format("submitted job {}\n", fmt::join(reply->NewJobIds, " "));
 		}
 		else if (action == "l" || action == "list")
 		{
@@ -1,8 +1,32 @@
 # include <set>
+# include <limits>
+# include <queue>
+# include <cmath>
+# include <numbers>
 # include <regex>
+# include <array>
+# include <functional>
+# include <system_error>
+# include <thread>
 # include <job.hpp>
+# include <profile.hpp>
 # include <boost/process.hpp>
+# include <boost/interprocess/sync/scoped_lock.hpp>
 # include <nameof.hpp>
+# include <cxxopts.hpp>
+# include <sys/epoll.h>
+# include <sys/inotify.h>
+# include <sys/timerfd.h>
+# include <sys/eventfd.h>
+# include <sys/syscall.h>
+# include <sys/signalfd.h>
+# include <sys/wait.h>
+# include <sys/prctl.h>
+# include <poll.h>
+# include <unistd.h>
+# include <fcntl.h>
+# include <sched.h>
+# include <csignal>
 
 using namespace std::literals;
 
@@ -30,170 +54,3038 @@ inline void create_files()
 			std::filesystem::perms::others_read | std::filesystem::perms::others_write
 		);
 	}
-	if (!std::filesystem::exists("/tmp/gpujob/out.lock"))
+	if (!std::filesystem::exists(state_directory()))
 	{
-		std::ofstream("/tmp/gpujob/out.lock");
+		std::filesystem::create_directories(state_directory());
 		std::filesystem::permissions
 		(
-			"/tmp/gpujob/out.lock",
+			state_directory(),
+			std::filesystem::perms::owner_all |
+			std::filesystem::perms::group_read | std::filesystem::perms::group_exec |
+			std::filesystem::perms::others_read | std::filesystem::perms::others_exec
+		);
+	}
+	if (!std::filesystem::exists(state_directory() / "out.lock"))
+	{
+		std::ofstream(state_directory() / "out.lock");
+		std::filesystem::permissions
+		(
+			state_directory() / "out.lock",
 			std::filesystem::perms::owner_read | std::filesystem::perms::owner_write |
 			std::filesystem::perms::group_read | std::filesystem::perms::group_write |
 			std::filesystem::perms::others_read | std::filesystem::perms::others_write
 		);
 	}
-	if (!std::filesystem::exists("/tmp/gpujob/out.dat"))
+}
+
+inline std::optional<std::uint64_t> get_process_start_time(pid_t pid)
+// 读取 /proc/<pid>/stat 中进程的启动时间 (开机后的时钟滴答数), 它与 pid 一起唯一地确定一个进程.
+// 进程不存在时返回 nullopt.
+{
+	std::ifstream in{fmt::format("/proc/{}/stat", pid)};
+	std::string content;
+	if (!std::getline(in, content))
+		return {};
+	// 第二项是用括号括起来的进程名, 其中可能有空格, 因此从最后一个右括号之后开始数
+	auto position = content.rfind(')');
+	if (position == std::string::npos)
+		return {};
+	std::istringstream fields{content.substr(position + 1)};
+	std::string field;
+	for (unsigned i = 3; i <= 22; i++)
+		if (!(fields >> field))
+			return {};
+	return std::stoull(field);
+}
+
+inline std::vector<pid_t> get_process_tree(pid_t root)
+// 通过 /proc 找出 root 和它所有的后代进程, 父进程在前.
+{
+	std::multimap<pid_t, pid_t> children;
+	std::error_code ec;
+	for (auto& entry : std::filesystem::directory_iterator{"/proc", ec})
+	{
+		auto name = entry.path().filename().string();
+		if (!std::ranges::all_of(name, [](char c){return std::isdigit(c);}))
+			continue;
+		std::ifstream in{entry.path() / "stat"};
+		std::string content;
+		if (!std::getline(in, content))
+			continue;
+		// 同 get_process_start_time, 从最后一个右括号之后开始数, 第四项是父进程
+		auto position = content.rfind(')');
+		if (position == std::string::npos)
+			continue;
+		std::istringstream fields{content.substr(position + 1)};
+		std::string state;
+		pid_t parent;
+		if (fields >> state >> parent)
+			children.emplace(parent, std::stoi(name));
+	}
+	std::vector<pid_t> tree{root};
+	for (std::size_t i = 0; i < tree.size(); i++)
+		for (auto [it, end] = children.equal_range(tree[i]); it != end; it++)
+			tree.push_back(it->second);
+	return tree;
+}
+
+inline void signal_process_tree(pid_t root, int signal)
+// 给 root 和它所有的后代进程发送信号.
+{
+	for (auto pid : get_process_tree(root))
+		kill(pid, signal);
+}
+
+inline std::uint64_t get_total_memory()
+// 读取 /proc/meminfo 中的物理内存总量 (MiB).
+{
+	std::ifstream in{"/proc/meminfo"};
+	for (std::string line; std::getline(in, line);)
+		if (std::smatch match; std::regex_match(line, match, std::regex(R"(MemTotal:\s+(\d+) kB)")))
+			return std::stoull(match[1].str()) / 1024;
+	throw std::runtime_error{"can not read MemTotal from /proc/meminfo"};
+}
+
+inline std::uint64_t get_process_tree_memory(pid_t root)
+// 统计 root 和它所有的后代进程占用的物理内存 (RSS, MiB).
+{
+	std::uint64_t pages = 0;
+	for (auto pid : get_process_tree(root))
+	{
+		std::ifstream in{fmt::format("/proc/{}/statm", pid)};
+		std::uint64_t size, resident;
+		if (in >> size >> resident)
+			pages += resident;
+	}
+	return pages * sysconf(_SC_PAGESIZE) / 1024 / 1024;
+}
+
+inline std::pair<Output_t, std::uint64_t> recover_state()
+// 读取上次退出时留下的快照和 journal, 返回其中的状态和最后一条记录的序号.
+// 第一次启动时返回空的状态. 文件损坏时把它们改名保留下来, 然后从空的状态开始.
+{
+	boost::interprocess::file_lock out_lock{(state_directory() / "out.lock").c_str()};
+	out_lock.lock();
+	std::pair<Output_t, std::uint64_t> result;
+	if (!std::filesystem::exists(state_directory() / "out.dat"))
+		return result;
+	try
+	{
+		result = read_snapshot(state_directory() / "out.dat");
+		result.second = apply_journal(result.first, state_directory() / "journal.dat", result.second);
+		for (auto& job : result.first.Jobs)
+			result.first.NextId = std::max(result.first.NextId, job.Id + 1);
+	}
+	catch (std::exception& e)
+	{
+		std::clog << fmt::format("can not recover state, start from empty: {}\n", e.what());
+		for (auto name : {"out.dat", "journal.dat"})
+			if (std::filesystem::exists(state_directory() / name))
+				std::filesystem::rename(state_directory() / name, state_directory() / fmt::format("{}.corrupt", name));
+		result = {};
+	}
+	return result;
+}
+
+struct EventLoop_t
+// 基于 epoll 的事件循环. 每个文件描述符注册一个回调, 在它可读 (或者按要求, 可写) 时调用.
+// 没有事件发生时阻塞在 epoll_wait 上, 不会定时空转.
+{
+	int EpollFd;
+	std::map<int, std::function<void()>> Handlers;
+
+	EventLoop_t() : EpollFd{epoll_create1(EPOLL_CLOEXEC)}
+	{
+		if (EpollFd < 0)
+			throw std::system_error{errno, std::generic_category(), "epoll_create1"};
+	}
+	EventLoop_t(const EventLoop_t&) = delete;
+	~EventLoop_t() {close(EpollFd);}
+
+	void add(int fd, std::function<void()> handler, std::uint32_t events = EPOLLIN)
+	{
+		epoll_event event{};
+		event.events = events;
+		event.data.fd = fd;
+		if (epoll_ctl(EpollFd, EPOLL_CTL_ADD, fd, &event))
+			throw std::system_error{errno, std::generic_category(), "epoll_ctl"};
+		Handlers[fd] = std::move(handler);
+	}
+	void modify(int fd, std::uint32_t events)
+	// 修改关心的事件, 例如从等待可读改为等待可写.
+	{
+		epoll_event event{};
+		event.events = events;
+		event.data.fd = fd;
+		if (epoll_ctl(EpollFd, EPOLL_CTL_MOD, fd, &event))
+			throw std::system_error{errno, std::generic_category(), "epoll_ctl"};
+	}
+	void remove(int fd)
+	{
+		epoll_ctl(EpollFd, EPOLL_CTL_DEL, fd, nullptr);
+		Handlers.erase(fd);
+	}
+	void run_once()
+	// 等待至少一个事件, 然后依次调用对应的回调.
+	// 回调中可能会注销其它的文件描述符, 因此每次调用前都重新查找.
+	{
+		std::array<epoll_event, 64> events;
+		int n = epoll_wait(EpollFd, events.data(), events.size(), -1);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				return;
+			throw std::system_error{errno, std::generic_category(), "epoll_wait"};
+		}
+		for (int i = 0; i < n; i++)
+			if (auto it = Handlers.find(events[i].data.fd); it != Handlers.end())
+			{
+				auto handler = it->second;
+				handler();
+			}
+	}
+};
+
+inline int watch_directory(std::string path)
+// 用 inotify 监听目录中新写入的文件, 返回 inotify 的文件描述符.
+{
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0)
+		throw std::system_error{errno, std::generic_category(), "inotify_init1"};
+	if (inotify_add_watch(fd, path.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+		throw std::system_error{errno, std::generic_category(), "inotify_add_watch"};
+	return fd;
+}
+
+inline void set_periodic_timer(int fd, std::chrono::seconds interval)
+// 让 timerfd 每隔 interval 触发一次, 覆盖之前的设置. interval 为 0 时不再触发.
+{
+	itimerspec spec{};
+	spec.it_interval.tv_sec = spec.it_value.tv_sec = interval.count();
+	if (timerfd_settime(fd, 0, &spec, nullptr))
+		throw std::system_error{errno, std::generic_category(), "timerfd_settime"};
+}
+
+inline int make_timer(std::chrono::seconds interval)
+// 创建一个周期性触发的 timerfd.
+{
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0)
+		throw std::system_error{errno, std::generic_category(), "timerfd_create"};
+	set_periodic_timer(fd, interval);
+	return fd;
+}
+
+inline void set_timer(int fd, std::chrono::seconds delay)
+// 让 timerfd 在 delay 之后触发一次, 覆盖之前的设置. delay 为 0 时不再触发.
+{
+	itimerspec spec{};
+	spec.it_value.tv_sec = delay.count();
+	if (timerfd_settime(fd, 0, &spec, nullptr))
+		throw std::system_error{errno, std::generic_category(), "timerfd_settime"};
+}
+
+inline void drain(int fd)
+// 读空一个非阻塞的文件描述符 (inotify 或者 timerfd), 内容不关心.
+{
+	std::array<char, 4096> buffer;
+	while (read(fd, buffer.data(), buffer.size()) > 0);
+}
+
+inline int open_pidfd(pid_t pid)
+// 获取进程的 pidfd, 进程退出时它会变为可读. 内核不支持时返回 -1, 此时只能依靠定时检查.
+{
+	return syscall(SYS_pidfd_open, pid, 0);
+}
+
+inline pid_t spawn(const std::vector<std::string>& args, const std::function<void()>& setup)
+// 在子进程中运行 args (在 PATH 中查找程序), exec 之前在子进程中调用 setup. 子进程的输出写到 jobd 的 stderr.
+// 子进程在自己的会话中运行, 它是进程组的组长, 可以通过进程组给它的所有后代发送信号.
+// 子进程由 jobd 通过 SIGCHLD 回收. exec 失败时子进程以 127 退出.
+{
+	std::vector<char*> argv;
+	for (auto& arg : args)
+		argv.push_back(const_cast<char*>(arg.c_str()));
+	argv.push_back(nullptr);
+	auto pid = fork();
+	if (pid < 0)
+		throw std::system_error{errno, std::generic_category(), "fork"};
+	else if (pid == 0)
+	{
+		// jobd 屏蔽了 SIGCHLD 并忽略 SIGPIPE, 这些设置会被继承, 需要恢复
+		sigset_t signals;
+		sigemptyset(&signals);
+		sigprocmask(SIG_SETMASK, &signals, nullptr);
+		std::signal(SIGPIPE, SIG_DFL);
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+		setsid();
+		setup();
+		execvp(argv[0], argv.data());
+		_exit(127);
+	}
+	return pid;
+}
+
+inline std::optional<std::string> read_command_output(const std::vector<std::string>& args, std::chrono::seconds timeout)
+// 运行 args 并读取它的标准输出, 标准错误丢弃. 超过 timeout 还没有结束时杀死它 (和它的后代) 并返回 nullopt;
+// 程序不存在或者以非零状态退出时也返回 nullopt.
+{
+	int pipes[2];
+	if (pipe2(pipes, O_CLOEXEC))
+		throw std::system_error{errno, std::generic_category(), "pipe2"};
+	auto pid = spawn(args, [&]
+	{
+		dup2(pipes[1], STDOUT_FILENO);
+		if (int null = ::open("/dev/null", O_WRONLY); null >= 0)
+			dup2(null, STDERR_FILENO);
+	});
+	close(pipes[1]);
+	auto deadline = std::chrono::steady_clock::now() + timeout;
+	auto remaining = [&]
+	{
+		return std::max(0l, long(std::chrono::duration_cast<std::chrono::milliseconds>
+			(deadline - std::chrono::steady_clock::now()).count()));
+	};
+	std::string output;
+	for (bool closed = false; !closed && remaining();)
+	{
+		pollfd fd{pipes[0], POLLIN, 0};
+		if (poll(&fd, 1, remaining()) <= 0)
+			continue;
+		std::array<char, 4096> buffer;
+		auto n = read(pipes[0], buffer.data(), buffer.size());
+		if (n > 0)
+			output.append(buffer.data(), n);
+		else if (n == 0 || errno != EINTR)
+			closed = true;
+	}
+	close(pipes[0]);
+	// 关闭了输出之后也可能不退出, 同样最多等到 timeout
+	int status = 0;
+	pid_t exited;
+	while ((exited = waitpid(pid, &status, WNOHANG)) == 0 && remaining())
+		std::this_thread::sleep_for(10ms);
+	if (exited == 0)
+	{
+		kill(-pid, SIGKILL);
+		waitpid(pid, &status, 0);
+		return {};
+	}
+	else if (exited < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+		return {};
+	return output;
+}
+
+inline void enter_job_context(const std::string& procs, const std::vector<unsigned>& cpus)
+// 在任务的进程 exec 之前调用: 进入任务的 cgroup (procs 为它的 cgroup.procs, 空表示没有), 绑定到分配给它的 CPU.
+{
+	// 写入 0 表示把写入的进程自己移进去
+	if (!procs.empty())
+		if (int fd = ::open(procs.c_str(), O_WRONLY | O_CLOEXEC); fd >= 0)
+		{
+			::write(fd, "0", 1);
+			close(fd);
+		}
+	if (cpus.empty())
+		return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (auto cpu : cpus)
+		CPU_SET(cpu, &set);
+	sched_setaffinity(0, sizeof(set), &set);
+}
+
+struct Helper_t
+// 预先 fork 出来的启动器 (--launcher helper). jobd 占用的内存多, 还有后台线程, 每次从 jobd 直接 fork 再 exec runuser
+// 较慢; 启动器在 jobd 刚启动时 fork 出来, 很小, 启动一个任务只需要交换一条消息. 它自己切换到任务的用户, 不经过 runuser.
+// 任务的进程是启动器的子进程, 退出时由启动器回收, 退出状态通过 ExitFd 发回 jobd.
+// 启动器意外退出后, 任务的进程交给 jobd (subreaper) 回收.
+{
+	struct Request_t
+	{
+		std::vector<std::string> Args;	// 以任务的用户运行的命令
+		std::string User;
+		std::vector<unsigned> Cpus;
+		std::string CgroupProcs;
+
+		template <class Archive> void serialize(Archive & ar)
+		{
+			ar(Args, User, Cpus, CgroupProcs);
+		}
+	};
+	pid_t Pid = -1;
+	int RequestFd = -1;	// 发送请求并接收回复 (任务的进程号, 0 表示失败)
+	int ExitFd = -1;	// 接收退出的进程: 每次两个 int, 进程号和 waitpid 得到的状态
+	bool Closed = false;	// 启动器已经退出 (ExitFd 读到了末尾)
+
+	static Helper_t start()
+	// 需要在屏蔽 SIGCHLD 之后, 启动任何线程之前调用
+	{
+		int requests[2], exits[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, requests) || pipe2(exits, O_CLOEXEC))
+			throw std::system_error{errno, std::generic_category(), "socketpair"};
+		auto pid = fork();
+		if (pid < 0)
+			throw std::system_error{errno, std::generic_category(), "fork"};
+		else if (pid == 0)
+		{
+			close(requests[0]);
+			close(exits[0]);
+			run(requests[1], exits[1]);
+		}
+		close(requests[1]);
+		close(exits[1]);
+		fcntl(exits[0], F_SETFL, O_NONBLOCK);
+		return {pid, requests[0], exits[0]};
+	}
+
+	[[noreturn]] static void run(int request_fd, int exit_fd)
+	{
+		sigset_t child_signal;
+		sigemptyset(&child_signal);
+		sigaddset(&child_signal, SIGCHLD);
+		int signal_fd = signalfd(-1, &child_signal, SFD_NONBLOCK | SFD_CLOEXEC);
+		std::array<pollfd, 2> fds{{{request_fd, POLLIN, 0}, {signal_fd, POLLIN, 0}}};
+		while (true)
+		{
+			if (poll(fds.data(), fds.size(), -1) < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				_exit(1);
+			}
+			if (fds[1].revents)
+			{
+				signalfd_siginfo info;
+				while (read(signal_fd, &info, sizeof(info)) > 0);
+				std::array<int, 2> exited;
+				for (pid_t pid; (pid = waitpid(-1, &exited[1], WNOHANG)) > 0;)
+				{
+					exited[0] = pid;
+					::write(exit_fd, exited.data(), sizeof(exited));
+				}
+			}
+			if (fds[0].revents)
+			{
+				auto message = receive_message(request_fd);
+				// jobd 已经退出. 正在运行的任务不受影响, jobd 重启后会重新接管它们
+				if (!message)
+					_exit(0);
+				pid_t pid = 0;
+				try
+				{
+					auto request = deserialize_message<Request_t>(*message);
+					if (auto passwd = getpwnam(request.User.c_str()))
+						pid = spawn(request.Args, [&]
+						{
+							// 先进入 cgroup (需要 root 权限), 再切换用户, 并像 runuser 一样设置这几个环境变量
+							enter_job_context(request.CgroupProcs, request.Cpus);
+							if (initgroups(passwd->pw_name, passwd->pw_gid) || setgid(passwd->pw_gid) || setuid(passwd->pw_uid))
+								_exit(126);
+							setenv("HOME", passwd->pw_dir, 1);
+							setenv("SHELL", passwd->pw_shell, 1);
+							setenv("USER", passwd->pw_name, 1);
+							setenv("LOGNAME", passwd->pw_name, 1);
+						});
+				}
+				catch (const std::exception& e)
+				{
+					std::clog << fmt::format("launcher helper: {}\n", e.what());
+				}
+				send_message(request_fd, serialize_message(pid));
+			}
+		}
+	}
+
+	pid_t launch(const Request_t& request)
+	{
+		if (!send_message(RequestFd, serialize_message(request)))
+			throw std::runtime_error{"launcher helper is gone"};
+		auto reply = receive_message(RequestFd);
+		if (!reply)
+			throw std::runtime_error{"launcher helper is gone"};
+		auto pid = deserialize_message<pid_t>(*reply);
+		if (!pid)
+			throw std::runtime_error{fmt::format("launcher helper can not start {}", request.Args)};
+		return pid;
+	}
+
+	std::vector<std::pair<pid_t, int>> exited()
+	// 读出已经退出的进程, 不阻塞. 读到末尾时设置 Closed
+	{
+		std::vector<std::pair<pid_t, int>> result;
+		std::array<int, 2> message;
+		ssize_t size;
+		while ((size = read(ExitFd, message.data(), sizeof(message))) == sizeof(message))
+			result.emplace_back(message[0], message[1]);
+		if (size == 0)
+			Closed = true;
+		return result;
+	}
+};
+
+struct SshMasters_t
+// 容器中的任务通过 ssh 启动. 每个用户保持一个常驻的主连接 (ControlMaster), 任务的 ssh 复用它, 不需要每次重新握手.
+// 主连接由 jobd 启动, 不属于任何任务, 因此不在任务的 cgroup 和进程组中, 不会随任务一起被杀死.
+// 主连接不存在时 (刚启动或者意外退出), 任务的 ssh 自己建立连接, 同时 jobd 在后台重新启动主连接.
+{
+	std::filesystem::path Root = "/run/gpujob/ssh";	// /run/gpujob 由 systemd 创建 (RuntimeDirectory), 属于 root
+	std::map<std::string, std::int64_t> LastTry;
+
+	std::filesystem::path path(const std::string& user) const
+		{return Root / user / "master";}
+
+	std::vector<std::string> args(const std::string& user, const std::string& command)
+	// 在容器中运行命令的 ssh 的参数
+	{
+		ensure(user);
+		return
+		{
+			"ssh", "-o", "ControlMaster=no", "-o", fmt::format("ControlPath={}", path(user).string()),
+			"-p", "1022", "127.0.0.1", command
+		};
+	}
+
+	void ensure(const std::string& user)
+	// 主连接不存在时启动它, 每分钟最多尝试一次. 不等待它建立.
+	{
+		auto now = std::time(nullptr);
+		if (std::filesystem::exists(path(user)) || (LastTry.contains(user) && now - LastTry[user] < 60))
+			return;
+		LastTry[user] = now;
+		auto passwd = getpwnam(user.c_str());
+		if (!passwd)
+			return;
+		if (!prepare(*passwd))
+		{
+			std::clog << fmt::format("can not prepare {} for ssh master connection\n", (Root / user).string());
+			return;
+		}
+		std::clog << fmt::format("start ssh master connection for {}\n", user);
+		spawn
+		({
+			"runuser", "-u", user, "--", "ssh", "-o", "ControlMaster=yes", "-o", "ControlPersist=yes",
+			"-o", fmt::format("ControlPath={}", path(user).string()), "-o", "BatchMode=yes",
+			"-N", "-f", "-p", "1022", "127.0.0.1"
+		}, []{});
+	}
+
+	bool prepare(const passwd& passwd) const
+	// socket 放在只有用户自己可以写的目录中, 以免其它用户放置伪造的 socket. 从 / 开始逐级打开 (不存在时创建) 每一级目录,
+	// 不跟随符号链接, 并且要求除最后一级以外都属于 jobd 的用户, 其它用户不能写; 属主和权限通过打开的目录修改,
+	// 不会被中途替换的路径影响.
+	{
+		int fd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		std::vector<std::filesystem::path> names(std::next(Root.begin()), Root.end());
+		names.push_back(passwd.pw_name);
+		for (auto& name : names)
+		{
+			struct stat parent;
+			if (fd < 0 || fstat(fd, &parent) || parent.st_uid != geteuid() || (parent.st_mode & (S_IWGRP | S_IWOTH))
+				|| (mkdirat(fd, name.c_str(), 0755) && errno != EEXIST))
+			{
+				if (fd >= 0)
+					close(fd);
+				return false;
+			}
+			int child = openat(fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			close(fd);
+			fd = child;
+		}
+		if (fd < 0)
+			return false;
+		bool result = !fchown(fd, passwd.pw_uid, passwd.pw_gid) && !fchmod(fd, 0700);
+		close(fd);
+		return result;
+	}
+};
+
+inline const Profile_t* find_system_profile(const std::string& name, const Profiles_t* items = nullptr)
+// jobd 信任的配置 (内置的和 /etc/gpujob/profiles.conf 中的), 默认在 profiles() 中查找.
+// 配置文件有错误时 (启动时已经报告) 认为找不到.
+{
+	try
+	{
+		auto profile = (items ? *items : profiles()).find(name);
+		return profile && profile->System ? profile : nullptr;
+	}
+	catch (const std::exception&)
+	{
+		return nullptr;
+	}
+}
+
+struct ModuleCache_t
+// 任务需要的环境模块 (Job_t::Modules). 每个任务都执行 module load 要花几秒钟解释 Tcl 脚本, 因此 jobd 对每一组
+// 不同的模块只加载一次: 在后台用 Init 脚本初始化 module 命令并加载这些模块, 比较加载前后的环境变量,
+// 把变化记为一组 export 语句, 之后的任务直接执行这些语句. 加载的模块文件 (_LMFILES_) 或者 module use 的目录
+// 被修改后, 缓存自动失效. 还没有缓存 (正在后台加载) 或者加载失败时, 任务自己加载模块, 与以前相同.
+// 容器中的模块与本机不同, 总是由任务自己加载.
+// 加载的目录和模块只取自任务的系统配置 (Job_t::Profile), 不使用客户端发来的 Job_t::ModulePaths 和 Modules:
+// 后台加载以任务的用户运行, 但缓存的语句会被之后的任务执行, 不能让用户指定任意的模块目录. 缓存也按用户区分.
+// Init 可以指定为一个定义了 module 函数的脚本, 以便在没有安装环境模块的机器上测试.
+{
+	struct Key_t
+	{
+		std::string User;	// 以这个用户加载
+		std::vector<std::string> Paths, Modules;	// module use 的目录, module load 的模块
+		auto operator<=>(const Key_t&) const = default;
+	};
+	struct Entry_t
+	{
+		std::string Exports;	// 设置环境变量的语句, 为空表示加载失败
+		std::map<std::string, std::int64_t> Files;	// 模块文件和目录的修改时间 (纳秒), -1 表示不存在
+	};
+	struct Resolving_t
+	{
+		int Fd;
+		std::string Output;
+	};
+	std::string Init;
+	EventLoop_t* Loop;
+	const Profiles_t* Profiles = nullptr;	// 测试时指定其它的配置, 否则使用 profiles()
+	std::map<Key_t, Entry_t> Entries;
+	std::map<Key_t, Resolving_t> Resolving;
+
+	static std::string quote(const std::string& text)
+		{return fmt::format("'{}'", std::regex_replace(text, std::regex("'"), R"('"'"')"));}
+
+	static std::int64_t mtime(const std::string& path)
+	{
+		struct stat buffer;
+		if (stat(path.c_str(), &buffer))
+			return -1;
+		return std::int64_t{buffer.st_mtim.tv_sec} * 1000000000 + buffer.st_mtim.tv_nsec;
+	}
+
+	static std::string load_command(const std::string& init, const Key_t& key)
+	{
+		std::vector<std::string> paths, modules;
+		std::ranges::transform(key.Paths, std::back_inserter(paths), quote);
+		std::ranges::transform(key.Modules, std::back_inserter(modules), quote);
+		return fmt::format
+		(
+			". {}{} && module load {}", quote(init),
+			paths.empty() ? ""s : fmt::format(" && module use {}", fmt::join(paths, " ")), fmt::join(modules, " ")
+		);
+	}
+
+	std::optional<Key_t> key_of(const Job_t& job) const
+	// 任务需要加载的模块, 由它的系统配置决定
+	{
+		auto profile = find_system_profile(job.Profile, Profiles);
+		if (!profile || profile->Modules.empty())
+			return {};
+		return Key_t{job.User, profile->ModulePaths, profile->Modules};
+	}
+
+	std::string wrap(const Job_t& job, const std::string& command)
+	// 在 command 之前加上设置模块环境的语句
+	{
+		auto found = key_of(job);
+		if (!found)
+			return command;
+		auto& key = *found;
+		if (job.RunInContainer)
+			return fmt::format("{} && {{ {}; }}", load_command("/etc/profile.d/modules.sh", key), command);
+		if (auto it = Entries.find(key); it != Entries.end())
+		{
+			if (std::ranges::all_of(it->second.Files, [](auto& file){return mtime(file.first) == file.second;}))
+			{
+				if (!it->second.Exports.empty())
+					return it->second.Exports + command;
+				else
+					return fmt::format("{} && {{ {}; }}", load_command(Init, key), command);
+			}
+			std::clog << fmt::format("modules {} changed, load them again\n", key.Modules);
+			Entries.erase(it);
+		}
+		resolve(key);
+		return fmt::format("{} && {{ {}; }}", load_command(Init, key), command);
+	}
+
+	void resolve(const Key_t& key)
+	// 在后台以任务的用户加载模块, 输出加载前后的环境变量 (env -0), 中间以 GPUJOB_MODULE_MARK= 分隔.
+	// module 命令自己的输出转到 stderr, 即 jobd 的日志中. jobd 不是 root 时 (测试) 本来就没有特权, 直接运行.
+	{
+		if (Resolving.contains(key))
+			return;
+		int fds[2];
+		if (pipe2(fds, O_CLOEXEC))
+		{
+			std::clog << fmt::format("can not load modules {}: pipe2 failed\n", key.Modules);
+			return;
+		}
+		std::vector<std::string> args
+		{
+			"env", "-i", "HOME=/", "PATH=/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin:/sbin:/bin",
+			"bash", "--noprofile", "--norc", "-c",
+			fmt::format("env -0 && printf 'GPUJOB_MODULE_MARK=\\0' && {{ {}; }} >&2 && env -0", load_command(Init, key))
+		};
+		if (geteuid() == 0)
+			args.insert(args.begin(), {"runuser", "-u", key.User, "--"});
+		spawn(args, [fd = fds[1]]{dup2(fd, STDOUT_FILENO);});
+		close(fds[1]);
+		fcntl(fds[0], F_SETFL, O_NONBLOCK);
+		Resolving[key] = {fds[0], {}};
+		Loop->add(fds[0], [this, key]{receive(key);});
+	}
+
+	void receive(const Key_t& key)
+	{
+		auto& resolving = Resolving.at(key);
+		std::array<char, 65536> buffer;
+		ssize_t n;
+		while ((n = read(resolving.Fd, buffer.data(), buffer.size())) > 0)
+			resolving.Output.append(buffer.data(), n);
+		if (n < 0 && errno == EAGAIN)
+			return;
+		Loop->remove(resolving.Fd);
+		close(resolving.Fd);
+		Entries[key] = parse(key, resolving.Output);
+		Resolving.erase(key);
+	}
+
+	static Entry_t parse(const Key_t& key, const std::string& output)
+	// 把加载前后环境变量的变化转为 export 语句. 以 PATH 结尾的变量 (PATH, LD_LIBRARY_PATH 等) 是目录列表,
+	// 只把模块加在前面或者后面的部分加到任务自己的值上, 而不是覆盖它.
+	{
+		std::vector<std::map<std::string, std::string>> environments(1);
+		std::istringstream in{output};
+		for (std::string item; std::getline(in, item, '\0');)
+			if (item == "GPUJOB_MODULE_MARK=")
+				environments.emplace_back();
+			else if (auto position = item.find('='); position != std::string::npos)
+				environments.back()[item.substr(0, position)] = item.substr(position + 1);
+		Entry_t entry;
+		for (auto& path : key.Paths)
+			entry.Files[path] = mtime(path);
+		if (environments.size() != 2 || environments[1].empty())
+		{
+			std::clog << fmt::format("failed to load modules {}, jobs will load them by themselves\n", key.Modules);
+			return entry;
+		}
+		auto& before = environments[0], & after = environments[1];
+		auto ignored = [](const std::string& name)
+		{
+			return name == "_" || name == "SHLVL" || name == "PWD" || name == "OLDPWD"
+				|| !std::regex_match(name, std::regex("[A-Za-z_][A-Za-z0-9_]*"));
+		};
+		std::string exports;
+		for (auto& [name, value] : after)
+		{
+			auto old = before.find(name);
+			if (ignored(name) || (old != before.end() && old->second == value))
+				continue;
+			else if (old != before.end() && !old->second.empty() && value.ends_with(old->second))
+				exports += fmt::format
+					("export {0}={1}\"${0}\"; ", name, quote(value.substr(0, value.size() - old->second.size())));
+			else if (old != before.end() && !old->second.empty() && value.starts_with(old->second))
+				exports += fmt::format("export {0}=\"${0}\"{1}; ", name, quote(value.substr(old->second.size())));
+			else if (old == before.end() && name.ends_with("PATH"))
+				exports += fmt::format("export {0}={1}\"${{{0}:+:${0}}}\"; ", name, quote(value));
+			else
+				exports += fmt::format("export {}={}; ", name, quote(value));
+		}
+		for (auto& [name, value] : before)
+			if (!after.contains(name) && !ignored(name))
+				exports += fmt::format("unset {}; ", name);
+		if (auto files = after.find("_LMFILES_"); files != after.end())
+		{
+			std::istringstream list{files->second};
+			for (std::string file; std::getline(list, file, ':');)
+				if (!file.empty())
+					entry.Files[file] = mtime(file);
+		}
+		entry.Exports = exports.empty() ? ": ; " : exports;
+		std::clog << fmt::format("loaded modules {}, {} files watched\n", key.Modules, entry.Files.size());
+		return entry;
+	}
+};
+
+inline std::string render_array_task(const Job_t& job, unsigned task_id)
+// 数组任务的子任务的命令. 由 jobd 也能读到的配置 (见 profile.hpp) 生成的任务按子任务的序号重新展开模板,
+// 模板中可以用 {array-task-id}; 配置已经不存在或者展开失败时沿用提交时生成的命令.
+// 模板已经预先解析, 每个子任务只需要拼接字符串.
+{
+	auto command = job.ProgramString;
+	if (!job.Profile.empty())
+		try
+		{
+			if (auto profile = profiles().find(job.Profile))
+			{
+				auto values = job.Parameters;
+				values["array-task-id"] = std::to_string(task_id);
+				values["user"] = job.User;
+				command = profile->render(profile->resolve(values));
+			}
+			else
+				std::clog << fmt::format("profile {} of job {} not found, use its original command\n", job.Profile, job.Id);
+		}
+		catch (const std::exception& e)
+		{
+			std::clog << fmt::format("can not render job {} with profile {}: {}\n", job.Id, job.Profile, e.what());
+		}
+	return fmt::format("export GPUJOB_ARRAY_TASK_ID={}; {}", task_id, command);
+}
+
+struct Journal_t
+// 把任务状态的变化追加写入 journal.dat, 每次变化只写入一条记录, 而不是重写整个 out.dat.
+// 记录多了之后, 在后台线程中把完整的状态写为新的快照, 写完后 DoneFd 变为可读,
+// 此时在主线程中调用 finish_compaction, 换上新的快照并丢弃已经被它包含的记录.
+// 所有对 out.dat 和 journal.dat 的替换都在主线程中进行, 后台线程只写临时文件.
+// 序号在 jobd 重启后继续增长, 因此意外残留的旧记录总是会被新的快照覆盖.
+{
+	boost::interprocess::file_lock OutLock{(state_directory() / "out.lock").c_str()};
+	int Fd = -1;
+	bool Dirty = false;
+	std::uint64_t Sequence, Entries = 0, Bytes = 0;	// 当前的 journal.dat 中的记录数和字节数
+	static constexpr std::uint64_t MaxEntries = 4096, MaxBytes = 16 << 20;	// 超过任何一个时生成新的快照
+	std::optional<std::uint64_t> SnapshotSequence;	// 正在后台生成的快照包含到的序号
+	std::vector<std::string> Tail;	// 后台生成快照期间追加的记录, 它们将构成新的 journal
+	std::map<unsigned, std::uint64_t> ArchiveIndex;	// archive.idx 的内容, 启动时读取, 之后随存档更新
+	int DoneFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	std::thread Worker;
+	bool WorkerSucceeded = false;
+
+	explicit Journal_t(std::uint64_t sequence) : Sequence{sequence} {}
+	Journal_t(const Journal_t&) = delete;
+	~Journal_t()
+	{
+		if (Worker.joinable())
+			Worker.join();
+		close(DoneFd);
+		if (Fd >= 0)
+			close(Fd);
+	}
+
+	void reopen(bool truncate)
+	{
+		if (Fd >= 0)
+			close(Fd);
+		Fd = open
+		(
+			(state_directory() / "journal.dat").c_str(),
+			O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644
+		);
+		if (Fd < 0)
+			throw std::system_error{errno, std::generic_category(), "open journal.dat"};
+	}
+	void reset(const Output_t& output)
+	// 同步地写入完整的快照并清空 journal.
+	{
+		boost::interprocess::scoped_lock lock{OutLock};
+		write_snapshot(state_directory() / "out.dat.tmp", output, Sequence);
+		std::filesystem::rename(state_directory() / "out.dat.tmp", state_directory() / "out.dat");
+		reopen(true);
+		sync_path(state_directory());
+		Entries = Bytes = 0;
+	}
+	void append(JournalEntry_t::Type_t type, const Job_t& job)
+	{
+		auto record = serialize_journal_entry({++Sequence, type, job});
+		{
+			boost::interprocess::scoped_lock lock{OutLock};
+			for (std::size_t written = 0; written < record.size();)
+			{
+				auto n = write(Fd, record.data() + written, record.size() - written);
+				if (n < 0 && errno == EINTR)
+					continue;
+				else if (n < 0)
+					throw std::system_error{errno, std::generic_category(), "write journal.dat"};
+				written += n;
+			}
+		}
+		Dirty = true;
+		Entries++;
+		Bytes += record.size();
+		if (SnapshotSequence)
+			Tail.push_back(std::move(record));
+	}
+	void sync()
+	// 把追加的记录刷到磁盘上. 每轮事件处理结束时调用一次, 这一轮中的多条记录共用一次 fdatasync.
+	{
+		if (Dirty)
+		{
+			if (fdatasync(Fd))
+				throw std::system_error{errno, std::generic_category(), "fdatasync journal.dat"};
+			Dirty = false;
+		}
+	}
+	void write_archive_index()
+	// 按 Id 的顺序重写整个 archive.idx. 调用者负责加锁.
+	{
+		auto path = state_directory() / "archive.idx", temporary = state_directory() / "archive.idx.tmp";
+		{
+			std::ofstream index{temporary, std::ios::binary};
+			for (auto [id, offset] : ArchiveIndex)
+			{
+				auto entry = encode_archive_index_entry(id, offset);
+				index.write(entry.data(), entry.size());
+			}
+			if (!index.flush())
+				throw std::runtime_error{"failed to write archive index"};
+		}
+		sync_path(temporary);
+		std::filesystem::rename(temporary, path);
+		sync_path(state_directory());
+	}
+	void load_archive_index()
+	// 启动时读取 archive.idx. 旧版本的 jobd 按存档的顺序而不是按 Id 写入, 此时重写一次, 以便客户端二分查找.
+	{
+		boost::interprocess::scoped_lock lock{OutLock};
+		ArchiveIndex.clear();
+		bool sorted = true;
+		std::ifstream index{state_directory() / "archive.idx", std::ios::binary};
+		for (std::array<char, ArchiveIndexEntrySize> entry; index.read(entry.data(), entry.size());)
+		{
+			unsigned id = decode_little_endian<std::uint32_t>(entry.data());
+			sorted = sorted && (ArchiveIndex.empty() || id > ArchiveIndex.rbegin()->first);
+			ArchiveIndex[id] = decode_little_endian<std::uint64_t>(entry.data() + sizeof(std::uint32_t));
+		}
+		if (!sorted)
+			write_archive_index();
+	}
+	void archive(const std::vector<Job_t>& jobs)
+	// 把已经结束的任务追加到 archive.dat 中, 并在 archive.idx 中记录每个任务的位置,
+	// 刷到磁盘上之后, 再在 journal 中记录它们已经从当前的状态中删除.
+	// 新的任务的 Id 都比索引中已有的大时 (通常如此) 直接追加到索引的末尾, 否则按 Id 的顺序重写整个索引.
+	{
+		if (jobs.empty())
+			return;
+		{
+			boost::interprocess::scoped_lock lock{OutLock};
+			std::vector<std::pair<unsigned, std::uint64_t>> added;
+			{
+				std::ofstream data{state_directory() / "archive.dat", std::ios::binary | std::ios::app};
+				std::uint64_t offset = std::filesystem::file_size(state_directory() / "archive.dat");
+				for (auto& job : jobs)
+				{
+					auto record = serialize_journal_entry({0, JournalEntry_t::Type_t::Archive, job});
+					data.write(record.data(), record.size());
+					added.emplace_back(job.Id, offset);
+					offset += record.size();
+				}
+				if (!data.flush())
+					throw std::runtime_error{"failed to write archive"};
+			}
+			sync_path(state_directory() / "archive.dat");
+			std::ranges::sort(added);
+			bool in_order = ArchiveIndex.empty() || added.front().first > ArchiveIndex.rbegin()->first;
+			for (auto [id, offset] : added)
+				ArchiveIndex[id] = offset;
+			if (in_order)
+			{
+				std::ofstream index{state_directory() / "archive.idx", std::ios::binary | std::ios::app};
+				for (auto [id, offset] : added)
+				{
+					auto entry = encode_archive_index_entry(id, offset);
+					index.write(entry.data(), entry.size());
+				}
+				if (!index.flush())
+					throw std::runtime_error{"failed to write archive index"};
+				index.close();
+				sync_path(state_directory() / "archive.idx");
+			}
+			else
+				write_archive_index();
+		}
+		for (auto& job : jobs)
+		{
+			Job_t removed{};
+			removed.Id = job.Id;
+			append(JournalEntry_t::Type_t::Archive, removed);
+		}
+	}
+	bool compacting() const
+	{
+		return SnapshotSequence.has_value();
+	}
+	bool needs_compaction() const
+	// 上次快照之后的记录足够多, 并且没有正在生成的快照
+	{
+		return !compacting() && (Entries >= MaxEntries || Bytes >= MaxBytes);
+	}
+	void compact(Output_t output)
+	{
+		SnapshotSequence = Sequence;
+		Worker = std::thread{[this, output = std::move(output), sequence = Sequence]
+		{
+			try
+			{
+				write_snapshot(state_directory() / "out.dat.tmp", output, sequence);
+				WorkerSucceeded = true;
+			}
+			catch (std::exception& e)
+			{
+				std::clog << fmt::format("error in compaction: {}\n", e.what());
+				WorkerSucceeded = false;
+			}
+			std::uint64_t one = 1;
+			write(DoneFd, &one, sizeof(one));
+		}};
+	}
+	void finish_compaction()
+	{
+		drain(DoneFd);
+		if (!Worker.joinable())
+			return;
+		Worker.join();
+		if (WorkerSucceeded)
+		{
+			boost::interprocess::scoped_lock lock{OutLock};
+			{
+				std::ofstream tail{state_directory() / "journal.dat.tmp", std::ios::binary};
+				for (auto& record : Tail)
+					tail.write(record.data(), record.size());
+			}
+			sync_path(state_directory() / "journal.dat.tmp");
+			std::filesystem::rename(state_directory() / "out.dat.tmp", state_directory() / "out.dat");
+			std::filesystem::rename(state_directory() / "journal.dat.tmp", state_directory() / "journal.dat");
+			sync_path(state_directory());
+			reopen(false);
+			Dirty = false;
+			Entries = Tail.size();
+			Bytes = 0;
+			for (auto& record : Tail)
+				Bytes += record.size();
+		}
+		Tail.clear();
+		SnapshotSequence.reset();
+	}
+};
+
+struct JobStore_t
+// 所有的任务, 按 Id 索引. 另外单独记录等待中和正在运行的任务的 Id,
+// 调度时只需要看这两部分, 与已经结束的历史任务的数量无关.
+{
+	std::map<unsigned, Job_t> Jobs;
+	std::set<unsigned> Pending, Running, Suspended;
+	std::set<std::pair<std::int64_t, unsigned>> Finished;	// 按结束时间排序, 用于决定把哪些任务移到存档中
+	std::set<unsigned> FinishedArrayTasks;	// 已经结束的数组任务的子任务, 它们不受保留数量和时间的限制, 尽快移到存档中
+	// 等待中的任务按照 (-优先级, Id) 排序, 即优先级高的在前, 同优先级的按提交顺序
+	using Queue_t = std::set<std::pair<int, unsigned>>;
+	Queue_t Queue;
+	std::map<std::string, Queue_t> QueueOf;	// 每个用户等待中的任务, 用于公平调度
+
+	Job_t* find(unsigned id)
+	{
+		auto it = Jobs.find(id);
+		return it == Jobs.end() ? nullptr : &it->second;
+	}
+	std::set<unsigned>* index_of(Job_t::Status_t status)
+	{
+		if (status == Job_t::Status_t::Pending)
+			return &Pending;
+		else if (status == Job_t::Status_t::Running)
+			return &Running;
+		else if (status == Job_t::Status_t::Suspended)
+			return &Suspended;
+		else
+			return nullptr;
+	}
+	void link(const Job_t& job)
+	{
+		if (auto index = index_of(job.Status))
+			index->insert(job.Id);
+		else if (job.ArrayTask)
+			FinishedArrayTasks.insert(job.Id);
+		else
+			Finished.emplace(job.FinishTime, job.Id);
+		if (job.Status == Job_t::Status_t::Pending)
+		{
+			Queue.emplace(-job.Priority, job.Id);
+			QueueOf[job.User].emplace(-job.Priority, job.Id);
+		}
+	}
+	void unlink(const Job_t& job)
+	{
+		if (auto index = index_of(job.Status))
+			index->erase(job.Id);
+		else if (job.ArrayTask)
+			FinishedArrayTasks.erase(job.Id);
+		else
+			Finished.erase({job.FinishTime, job.Id});
+		if (job.Status == Job_t::Status_t::Pending)
+		{
+			Queue.erase({-job.Priority, job.Id});
+			QueueOf[job.User].erase({-job.Priority, job.Id});
+		}
+	}
+	Job_t& add(Job_t job)
+	{
+		auto& added = Jobs[job.Id] = std::move(job);
+		link(added);
+		return added;
+	}
+	void set_status(Job_t& job, Job_t::Status_t status)
+	// 修改任务的状态. 任务结束时记录结束的时间.
+	{
+		unlink(job);
+		job.Status = status;
+		if (job.Status == Job_t::Status_t::Finished)
+			job.FinishTime = std::time(nullptr);
+		link(job);
+	}
+	Job_t* finish_array_task(const Job_t& task)
+	// 子任务结束后更新它所属的数组任务, 所有子任务都结束后数组任务也随之结束.
+	// 返回被更新的数组任务, 调用者负责记录它的变化.
+	{
+		if (!task.ArrayTask)
+			return nullptr;
+		auto parent = find(task.ArrayTask->first);
+		if (!parent || !parent->Array)
+			return nullptr;
+		parent->Array->Running--;
+		parent->Array->Finished++;
+		if (parent->Status != Job_t::Status_t::Finished
+			&& parent->Array->Finished == parent->Array->Last - parent->Array->First + 1)
+			set_status(*parent, Job_t::Status_t::Finished);
+		return parent;
+	}
+	void remove(unsigned id)
+	{
+		unlink(Jobs.at(id));
+		Jobs.erase(id);
+	}
+	std::vector<Job_t> all() const
+	{
+		std::vector<Job_t> result;
+		result.reserve(Jobs.size());
+		for (auto& [id, job] : Jobs)
+			result.push_back(job);
+		return result;
+	}
+};
+
+struct Topology_t
+// 从 sysfs 读取的 CPU 和 GPU 的拓扑. 根目录可以指定为其它目录, 以便用伪造的 sysfs 在任何机器上测试.
+{
+	struct Cpu_t
+	{
+		unsigned Id, Node;
+		std::pair<unsigned, unsigned> Core;	// (socket, core_id), 同一个物理核上的 SMT 线程相同
+	};
+	std::vector<Cpu_t> Cpus;
+	// 按 PCI 总线顺序 (即 CUDA_DEVICE_ORDER=PCI_BUS_ID 的顺序) 排列的 GPU 所在的 NUMA 节点 (-1 表示未知),
+	// 以及它们在 /sys/devices 下的路径, 路径中包含了 GPU 到 PCIe 根之间的所有桥 (交换芯片)
+	std::vector<int> GpuNodes;
+	std::vector<std::filesystem::path> GpuPaths;
+
+	unsigned gpu_distance(unsigned a, unsigned b) const
+	// 两个 GPU 之间的距离: 它们各自到共同的上级 PCIe 桥要经过几级. 挂在同一个交换芯片上的 GPU 距离最小,
+	// 不在同一个 PCIe 根 (通常也不在同一个 NUMA 节点) 上的距离最大.
+	{
+		auto& pa = GpuPaths[a];
+		auto& pb = GpuPaths[b];
+		auto [ia, ib] = std::mismatch(pa.begin(), pa.end(), pb.begin(), pb.end());
+		auto distance = unsigned(std::distance(ia, pa.end()) + std::distance(ib, pb.end()));
+		if (GpuNodes[a] != GpuNodes[b])
+			distance += 100;
+		return distance;
+	}
+
+	static Topology_t read(const std::filesystem::path& root)
+	{
+		auto read_file = [](const std::filesystem::path& path) -> std::optional<std::string>
+		{
+			std::ifstream in{path};
+			std::string content;
+			if (std::getline(in, content))
+				return content;
+			else
+				return {};
+		};
+		Topology_t topology;
+		std::error_code ec;
+
+		std::map<unsigned, unsigned> nodes;
+		for (auto& entry : std::filesystem::directory_iterator{root / "devices/system/node", ec})
+		{
+			auto name = entry.path().filename().string();
+			if (std::smatch match; std::regex_match(name, match, std::regex("node([0-9]+)")))
+				if (auto list = read_file(entry.path() / "cpulist"))
+					for (auto cpu : parse_cpu_list(*list))
+						nodes[cpu] = std::stoul(match[1].str());
+		}
+
+		auto cpu_root = root / "devices/system/cpu";
+		if (auto online = read_file(cpu_root / "online"))
+			for (auto cpu : parse_cpu_list(*online))
+			{
+				auto topology_root = cpu_root / fmt::format("cpu{}", cpu) / "topology";
+				auto package = read_file(topology_root / "physical_package_id");
+				auto core = read_file(topology_root / "core_id");
+				topology.Cpus.push_back
+				({
+					cpu, nodes.contains(cpu) ? nodes[cpu] : 0,
+					{package ? std::stoul(*package) : 0, core ? std::stoul(*core) : cpu}
+				});
+			}
+		// 读不到 sysfs 时, 认为每个 CPU 都是单独的物理核, 都在同一个节点上
+		if (topology.Cpus.empty())
+			for (unsigned cpu = 0; cpu < std::thread::hardware_concurrency(); cpu++)
+				topology.Cpus.push_back({cpu, 0, {0, cpu}});
+
+		// NVIDIA 的显示控制器和 3D 控制器
+		std::vector<std::tuple<std::string, int, std::filesystem::path>> gpus;
+		for (auto& entry : std::filesystem::directory_iterator{root / "bus/pci/devices", ec})
+			if
+			(
+				read_file(entry.path() / "vendor") == "0x10de"
+				&& read_file(entry.path() / "class").value_or("").starts_with("0x03")
+			)
+			{
+				auto node = read_file(entry.path() / "numa_node");
+				auto path = std::filesystem::canonical(entry.path(), ec);
+				gpus.emplace_back
+				(
+					entry.path().filename().string(), node ? std::stoi(*node) : -1,
+					ec ? entry.path() : std::filesystem::relative(path, std::filesystem::canonical(root))
+				);
+			}
+		std::ranges::sort(gpus);
+		for (auto& [address, node, path] : gpus)
+		{
+			topology.GpuNodes.push_back(node);
+			topology.GpuPaths.push_back(path);
+		}
+		return topology;
+	}
+};
+
+struct GpuInventory_t
+// jobd 管理的 GPU 的型号和显存. 默认由 nvidia-smi 检测, 也可以从文件读取以便测试;
+// 文件的格式与 nvidia-smi --query-gpu=index,name,memory.total --format=csv,noheader,nounits 的输出相同.
+{
+	std::vector<Gpu_t> Gpus;
+	// 每种 (型号, 最小显存) 约束匹配的 GPU. 约束的种类很少, 缓存后每次调度只需要查表
+	std::map<std::pair<std::string, std::uint64_t>, std::vector<unsigned>> Matches;
+
+	static GpuInventory_t read(const std::string& source)
+	{
+		std::stringstream content;
+		if (source == "nvidia-smi")
+		{
+			// 驱动出问题时 nvidia-smi 可能一直卡住, 最多等待 10 秒, 以免 jobd 无法启动
+			if (auto output = read_command_output
+				({"nvidia-smi", "--query-gpu=index,name,memory.total", "--format=csv,noheader,nounits"}, 10s))
+				content << *output;
+			else
+				std::clog << "can not run nvidia-smi, or it did not finish in 10 seconds\n";
+		}
+		else if (std::ifstream in{source}; in)
+			content << in.rdbuf();
+		else
+			throw std::runtime_error{fmt::format("can not open gpu inventory {}", source)};
+
+		GpuInventory_t inventory;
+		for (std::string line; std::getline(content, line);)
+		{
+			std::smatch match;
+			if (std::regex_match(line, match, std::regex(R"(\s*(\d+)\s*,\s*(.*?)\s*,\s*(\d+)\s*)")))
+				inventory.Gpus.push_back({unsigned(std::stoul(match[1].str())), match[2].str(), std::stoull(match[3].str())});
+		}
+		std::ranges::sort(inventory.Gpus, {}, &Gpu_t::Id);
+		return inventory;
+	}
+	const std::vector<unsigned>& match(const Job_t& job)
+	// 满足任务的约束的 GPU
+	{
+		auto [it, inserted] = Matches.try_emplace({job.GpuModel, job.GpuMinMemory});
+		if (inserted)
+		{
+			auto lower = [](std::string text)
+			{
+				std::ranges::transform(text, text.begin(), [](unsigned char c){return std::tolower(c);});
+				return text;
+			};
+			auto model = lower(job.GpuModel);
+			for (auto& gpu : Gpus)
+				if (lower(gpu.Model).contains(model) && gpu.Memory >= job.GpuMinMemory)
+					it->second.push_back(gpu.Id);
+		}
+		return it->second;
+	}
+};
+
+inline void pin_process_tree(pid_t root, const std::vector<unsigned>& cpus)
+// 把 root 和它所有的后代进程的所有线程绑定到 cpus 上.
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (auto cpu : cpus)
+		CPU_SET(cpu, &set);
+	std::error_code ec;
+	for (auto pid : get_process_tree(root))
+		for (auto& entry : std::filesystem::directory_iterator{fmt::format("/proc/{}/task", pid), ec})
+			sched_setaffinity(std::stoi(entry.path().filename().string()), sizeof(set), &set);
+}
+
+struct Cgroup_t
+// 每个任务放在 Root 下自己的 cgroup (v2) 中, 用 cpu.max, cpuset.cpus 和 memory.max 限制它实际使用的资源.
+// 任务的所有后代进程都留在这个 cgroup 中, 结束任务时通过 cgroup.kill 一起杀死, 不会有进程逃出.
+// Root 可以指定为委派给普通用户的 cgroup, 以便不用 root 权限测试.
+{
+	std::filesystem::path Root;
+
+	static bool write(const std::filesystem::path& file, const std::string& value)
+	{
+		std::ofstream out{file};
+		out << value << std::flush;
+		if (!out)
+			std::clog << fmt::format("can not write {} to {}\n", value, file.string());
+		return bool(out);
+	}
+
+	static std::optional<Cgroup_t> open(std::filesystem::path root)
+	// 创建 Root 并打开它的子 cgroup 需要的控制器. 不可用 (例如没有挂载 cgroup v2) 时返回空.
+	{
+		std::error_code ec;
+		std::filesystem::create_directories(root, ec);
+		if (ec || !std::filesystem::exists(root / "cgroup.procs"))
+		{
+			std::clog << fmt::format("cgroup {} is not available, jobs are not contained\n", root.string());
+			return std::nullopt;
+		}
+		// 上级 cgroup 可能已经打开了这些控制器, 也可能不允许打开, 失败时只是少了对应的限制
+		std::ifstream in{root / "cgroup.controllers"};
+		std::set<std::string> controllers{std::istream_iterator<std::string>{in}, {}};
+		for (auto controller : {"cpu", "cpuset", "memory", "io"})
+			if (controllers.contains(controller))
+				write(root / "cgroup.subtree_control", fmt::format("+{}", controller));
+			else
+				std::clog << fmt::format("cgroup controller {} is not available in {}\n", controller, root.string());
+		return Cgroup_t{root};
+	}
+
+	std::filesystem::path path(unsigned id) const
+		{return Root / fmt::format("job-{}", id);}
+
+	bool create(const Job_t& job) const
+	// 创建任务的 cgroup 并按照它申请的资源设定限制. 任务的进程在 exec 之前把自己写入 cgroup.procs.
+	{
+		std::error_code ec;
+		std::filesystem::create_directory(path(job.Id), ec);
+		if (ec)
+		{
+			std::clog << fmt::format("can not create cgroup for job {}: {}\n", job.Id, ec.message());
+			return false;
+		}
+		limit(job);
+		return true;
+	}
+
+	void limit(const Job_t& job) const
+	// 任务暂停后重新挑选了 CPU 时也要更新
+	{
+		auto cgroup = path(job.Id);
+		if (std::filesystem::exists(cgroup / "cpu.max"))
+			write(cgroup / "cpu.max", job.UsingCores ? fmt::format("{} 100000", job.UsingCores * 100000) : "max");
+		if (std::filesystem::exists(cgroup / "cpuset.cpus"))
+			write(cgroup / "cpuset.cpus", format_cpu_list(job.Cpus));
+		if (std::filesystem::exists(cgroup / "memory.max"))
+			write(cgroup / "memory.max", job.Memory ? std::to_string(job.Memory * 1024 * 1024) : "max");
+	}
+
+	void signal(unsigned id, int signal) const
+	// 给 cgroup 中所有的进程发送信号
+	{
+		std::ifstream in{path(id) / "cgroup.procs"};
+		for (pid_t pid; in >> pid;)
+			::kill(pid, signal);
+	}
+
+	void kill(unsigned id) const
+	// 杀死 cgroup 中所有的进程. 较旧的内核没有 cgroup.kill, 只能逐个杀死.
+	{
+		auto cgroup = path(id);
+		if (!std::filesystem::exists(cgroup))
+			return;
+		if (std::filesystem::exists(cgroup / "cgroup.kill"))
+			write(cgroup / "cgroup.kill", "1");
+		else
+			signal(id, SIGKILL);
+	}
+
+	bool populated(unsigned id) const
+	// cgroup 中是否还有进程
+	{
+		std::ifstream in{path(id) / "cgroup.events"};
+		std::string key;
+		for (int value; in >> key >> value;)
+			if (key == "populated")
+				return value;
+		return false;
+	}
+
+	bool oom_killed(unsigned id) const
+	// 任务中是否有进程因为超出 memory.max 被杀死
+	{
+		std::ifstream in{path(id) / "memory.events"};
+		std::string key;
+		for (std::uint64_t value; in >> key >> value;)
+			if (key == "oom_kill")
+				return value > 0;
+		return false;
+	}
+
+	void cleanup(const std::set<unsigned>& alive) const
+	// 删除不属于 alive 中任何任务的 cgroup. 其中还有进程时先杀死它们, 下次再删除.
+	{
+		std::error_code ec;
+		for (auto& entry : std::filesystem::directory_iterator{Root, ec})
+		{
+			auto name = entry.path().filename().string();
+			std::smatch match;
+			if (!entry.is_directory() || !std::regex_match(name, match, std::regex(R"(job-(\d+))")))
+				continue;
+			if (unsigned id = std::stoul(match[1].str()); !alive.contains(id) && rmdir(entry.path().c_str()) != 0)
+				kill(id);
+		}
+	}
+};
+
+struct Sampler_t
+// 定期统计正在运行的任务实际使用的资源, 写入 Job_t::Measured.
+// 任务有自己的 cgroup 时, 直接读取 cgroup 中的累计值, 每个任务只需要读几个文件;
+// 否则每次只扫描一遍 /proc/<pid>/stat, 同时得到所有任务的进程树, 再只读取这些进程的 io.
+// 后一种情况下, 两次统计之间结束的进程在最后一次统计之后用到的资源会被漏掉.
+{
+	struct Process_t
+	{
+		std::uint64_t CpuTicks = 0, ReadBytes = 0, WriteBytes = 0;
+	};
+	const Cgroup_t* Cgroup = nullptr;
+	// 每个任务的进程 (pid, 启动时间) 上次统计到的累计用量, 用于计算增量
+	std::map<unsigned, std::map<std::pair<pid_t, std::uint64_t>, Process_t>> Processes;
+
+	bool sample_cgroup(Job_t& job) const
+	// 从 cgroup 中读取任务的累计用量. 任务没有 cgroup 时返回 false.
+	{
+		if (!Cgroup)
+			return false;
+		auto cgroup = Cgroup->path(job.Id);
+		std::ifstream cpu{cgroup / "cpu.stat"};
+		std::string key;
+		std::uint64_t value;
+		bool found = false;
+		while (!found && cpu >> key >> value)
+			if (key == "usage_usec")
+			{
+				job.Measured.CpuSeconds = value / 1e6;
+				found = true;
+			}
+		if (!found)
+			return false;
+		// 较旧的内核没有 memory.peak, 只能用每次统计时的 memory.current 估计
+		for (auto file : {"memory.peak", "memory.current"})
+			if (std::ifstream in{cgroup / file}; in >> value)
+			{
+				job.Measured.PeakMemory = std::max(job.Measured.PeakMemory, value / 1024 / 1024);
+				break;
+			}
+		// 每行是一个设备, 例如 "8:0 rbytes=1024 wbytes=0 rios=1 wios=0 dbytes=0 dios=0"
+		std::ifstream io{cgroup / "io.stat"};
+		job.Measured.ReadBytes = job.Measured.WriteBytes = 0;
+		for (std::string field; io >> field;)
+			if (field.starts_with("rbytes="))
+				job.Measured.ReadBytes += std::stoull(field.substr(7));
+			else if (field.starts_with("wbytes="))
+				job.Measured.WriteBytes += std::stoull(field.substr(7));
+		return true;
+	}
+
+	void sample_processes(const std::vector<Job_t*>& jobs)
+	{
+		struct Stat_t
+		{
+			std::uint64_t StartTime, CpuTicks, Rss;
+		};
+		std::map<pid_t, Stat_t> stats;
+		std::multimap<pid_t, pid_t> children;
+		std::error_code ec;
+		for (auto& entry : std::filesystem::directory_iterator{"/proc", ec})
+		{
+			auto name = entry.path().filename().string();
+			if (!std::ranges::all_of(name, [](char c){return std::isdigit(c);}))
+				continue;
+			std::ifstream in{entry.path() / "stat"};
+			std::string content;
+			if (!std::getline(in, content))
+				continue;
+			// 同 get_process_start_time, 从最后一个右括号之后开始数:
+			// 第 4 项是父进程, 第 14, 15 项是用户态和内核态的时间, 第 22 项是启动时间, 第 24 项是 RSS (页数)
+			auto position = content.rfind(')');
+			if (position == std::string::npos)
+				continue;
+			std::istringstream in_fields{content.substr(position + 1)};
+			std::vector<std::string> fields{std::istream_iterator<std::string>{in_fields}, {}};
+			if (fields.size() < 22)
+				continue;
+			pid_t pid = std::stoi(name);
+			children.emplace(std::stoi(fields[1]), pid);
+			stats[pid] =
+			{
+				std::stoull(fields[19]), std::stoull(fields[11]) + std::stoull(fields[12]), std::stoull(fields[21])
+			};
+		}
+		static const auto ticks = sysconf(_SC_CLK_TCK);
+		static const auto page = sysconf(_SC_PAGESIZE);
+		for (auto job : jobs)
+		{
+			if (!stats.contains(job->Pid) || stats[job->Pid].StartTime != job->PidStartTime)
+				continue;
+			// jobd 重启后第一次统计时, 此前的用量已经计入, 只记下当前的累计值
+			bool adopted = !Processes.contains(job->Id) && job->Measured.Samples;
+			auto& last = Processes[job->Id];
+			std::map<std::pair<pid_t, std::uint64_t>, Process_t> current;
+			std::uint64_t rss = 0;
+			std::vector<pid_t> tree{job->Pid};
+			for (std::size_t i = 0; i < tree.size(); i++)
+				for (auto [it, end] = children.equal_range(tree[i]); it != end; it++)
+					tree.push_back(it->second);
+			for (auto pid : tree)
+			{
+				auto& stat = stats[pid];
+				Process_t process{stat.CpuTicks};
+				std::ifstream io{fmt::format("/proc/{}/io", pid)};
+				std::string key;
+				for (std::uint64_t value; io >> key >> value;)
+					if (key == "read_bytes:")
+						process.ReadBytes = value;
+					else if (key == "write_bytes:")
+						process.WriteBytes = value;
+				rss += stat.Rss;
+				Process_t previous;
+				if (auto it = last.find({pid, stat.StartTime}); it != last.end())
+					previous = it->second;
+				if (!adopted)
+				{
+					job->Measured.CpuSeconds += double(process.CpuTicks - previous.CpuTicks) / ticks;
+					job->Measured.ReadBytes += process.ReadBytes - previous.ReadBytes;
+					job->Measured.WriteBytes += process.WriteBytes - previous.WriteBytes;
+				}
+				current[{pid, stat.StartTime}] = process;
+			}
+			last = std::move(current);
+			job->Measured.PeakMemory = std::max<std::uint64_t>(job->Measured.PeakMemory, rss * page / 1024 / 1024);
+		}
+	}
+
+	void sample(const std::vector<Job_t*>& jobs, std::int64_t now)
+	{
+		std::vector<Job_t*> others;
+		for (auto job : jobs)
+			if (!sample_cgroup(*job))
+				others.push_back(job);
+		if (!others.empty())
+			sample_processes(others);
+		for (auto job : jobs)
+		{
+			job->Measured.Samples++;
+			average(*job, now);
+		}
+	}
+
+	static void average(Job_t& job, std::int64_t now)
+	{
+		if (auto seconds = now - job.StartTime - job.SuspendedSeconds; seconds > 0)
+			job.Measured.AverageCores = job.Measured.CpuSeconds / seconds;
+	}
+
+	void finish(Job_t& job, std::int64_t now)
+	// 任务结束时, 最后一次统计. 进程已经退出, 只有 cgroup 中还留有累计值.
+	{
+		if (sample_cgroup(job))
+		{
+			job.Measured.Samples++;
+			average(job, now);
+		}
+		Processes.erase(job.Id);
+	}
+};
+
+struct Ledger_t
+// 正在运行的任务占用的资源. 任务开始和结束时增量地更新, 不需要每次从头统计.
+// 每个 GPU 分为 SlotsPerGpu 份, 独占 GPU 的任务占用全部的份数, 因此不会与其它任务共用.
+// RunNow 的任务可能使占用的份数超过总数.
+{
+	std::vector<unsigned> GpuUsedSlots;
+	std::vector<unsigned> CpuHolders;	// 每个逻辑 CPU 被几个任务绑定
+	unsigned UsedCores = 0;
+	unsigned TotalCores = std::thread::hardware_concurrency();
+	std::uint64_t UsedMemory = 0, TotalMemory = std::numeric_limits<std::uint64_t>::max();	// MiB
+	unsigned SlotsPerGpu = 1;
+	GpuInventory_t* Inventory = nullptr;	// 可以由 jobd 挑选的 GPU
+
+	unsigned slots(const Job_t& job) const
+	// 任务在每个 GPU 上占用的份数
+	{
+		return job.GpuSlots && job.GpuSlots < SlotsPerGpu ? job.GpuSlots : SlotsPerGpu;
+	}
+	unsigned used_slots(unsigned gpu) const
+	{
+		return gpu < GpuUsedSlots.size() ? GpuUsedSlots[gpu] : 0;
+	}
+	bool gpu_room(unsigned gpu, unsigned slots) const
+	{
+		return used_slots(gpu) + slots <= SlotsPerGpu;
+	}
+	unsigned free_gpus(const Job_t& job) const
+	// 满足任务的约束, 并且还能放下这个任务的 GPU 的数量
+	{
+		unsigned count = 0;
+		for (auto gpu : Inventory->match(job))
+			count += gpu_room(gpu, slots(job));
+		return count;
+	}
+	bool fits(const Job_t& job) const
+	{
+		// 还没有挑选 GPU 的任务只需要有足够多的满足约束的空闲 GPU
+		if (job.GpuCount && job.UsingGpus.empty() && free_gpus(job) < job.GpuCount)
+			return false;
+		return std::ranges::all_of(job.UsingGpus, [&](auto gpu){return gpu_room(gpu, slots(job));})
+			&& UsedCores + job.UsingCores <= TotalCores && UsedMemory + job.Memory <= TotalMemory;
+	}
+	std::vector<unsigned> pick_gpus(const Topology_t& topology, const Job_t& job) const
+	// 为任务在满足约束的 GPU 中挑选. 空闲的 GPU 足够时, 从每个空闲的 GPU 出发依次加入离已选的 GPU 最近的空闲 GPU,
+	// 取两两距离之和最小的一组, 即尽量在同一个 PCIe 交换芯片或者同一个 NUMA 节点内.
+	// 只占用一部分的任务尽量挤在已经被占用了一部分的 GPU 上, 把完整的 GPU 留给独占的任务.
+	// 空闲的不够时 (RunNow 的任务), 选被占用得最少的.
+	{
+		std::vector<unsigned> free, all;
+		for (auto gpu : Inventory->match(job))
+		{
+			all.push_back(gpu);
+			if (gpu_room(gpu, slots(job)))
+				free.push_back(gpu);
+		}
+		if (free.size() < job.GpuCount)
+		{
+			std::ranges::stable_sort(all, {}, [&](auto gpu){return used_slots(gpu);});
+			all.resize(std::min<std::size_t>(job.GpuCount, all.size()));
+			return all;
+		}
+		if (slots(job) < SlotsPerGpu)
+		{
+			std::ranges::stable_sort(free, std::greater{}, [&](auto gpu){return used_slots(gpu);});
+			free.resize(job.GpuCount);
+			std::ranges::sort(free);
+			return free;
+		}
+		auto distance = [&](unsigned a, unsigned b)
+			{return a < topology.GpuPaths.size() && b < topology.GpuPaths.size() ? topology.gpu_distance(a, b) : 0;};
+		std::optional<std::pair<unsigned, std::vector<unsigned>>> best;
+		for (auto seed : free)
+		{
+			std::vector<unsigned> chosen{seed};
+			unsigned total = 0;
+			while (chosen.size() < job.GpuCount)
+			{
+				std::optional<std::pair<unsigned, unsigned>> next;
+				for (auto gpu : free)
+				{
+					if (std::ranges::find(chosen, gpu) != chosen.end())
+						continue;
+					unsigned sum = 0;
+					for (auto other : chosen)
+						sum += distance(gpu, other);
+					if (!next || sum < next->first)
+						next = {sum, gpu};
+				}
+				chosen.push_back(next->second);
+				total += next->first;
+			}
+			if (!best || total < best->first)
+				best = {total, chosen};
+		}
+		std::ranges::sort(best->second);
+		return best->second;
+	}
+	void acquire(const Job_t& job)
+	{
+		for (auto gpu : job.UsingGpus)
+		{
+			if (gpu >= GpuUsedSlots.size())
+				GpuUsedSlots.resize(gpu + 1);
+			GpuUsedSlots[gpu] += slots(job);
+		}
+		for (auto cpu : job.Cpus)
+		{
+			if (cpu >= CpuHolders.size())
+				CpuHolders.resize(cpu + 1);
+			CpuHolders[cpu]++;
+		}
+		UsedCores += job.UsingCores;
+		UsedMemory += job.Memory;
+	}
+	void release(const Job_t& job)
+	{
+		for (auto gpu : job.UsingGpus)
+			GpuUsedSlots[gpu] -= slots(job);
+		for (auto cpu : job.Cpus)
+			CpuHolders[cpu]--;
+		UsedCores -= job.UsingCores;
+		UsedMemory -= job.Memory;
+	}
+	std::vector<unsigned> pick_cpus(const Topology_t& topology, const Job_t& job) const
+	// 为任务挑选要绑定的 CPU. 尽量放在一个 NUMA 节点内, 优先使用任务的 GPU 所在的节点;
+	// 节点内尽量占用完整的物理核, 使不同的任务不共用一个物理核. 空闲的 CPU 不够时返回空, 即不绑定.
+	{
+		using Core_t = std::pair<unsigned, unsigned>;
+		std::map<unsigned, std::map<Core_t, std::vector<unsigned>>> free;	// 节点 -> 物理核 -> 空闲的 CPU
+		std::map<unsigned, unsigned> free_count;
+		std::map<Core_t, unsigned> core_size;
+		for (auto& cpu : topology.Cpus)
+		{
+			core_size[cpu.Core]++;
+			if (cpu.Id >= CpuHolders.size() || !CpuHolders[cpu.Id])
+			{
+				free[cpu.Node][cpu.Core].push_back(cpu.Id);
+				free_count[cpu.Node]++;
+			}
+		}
+		unsigned total = 0;
+		for (auto& [node, count] : free_count)
+			total += count;
+		if (!job.UsingCores || total < job.UsingCores)
+			return {};
+
+		std::set<unsigned> preferred;
+		for (auto gpu : job.UsingGpus)
+			if (gpu < topology.GpuNodes.size() && topology.GpuNodes[gpu] >= 0)
+				preferred.insert(topology.GpuNodes[gpu]);
+		// 能放下整个任务的节点在前, 其中靠近 GPU 的优先, 再其次是空闲 CPU 最少的 (以免把大的空闲节点拆散);
+		// 都放不下时, 从空闲 CPU 最多的节点开始依次填充
+		std::vector<unsigned> nodes;
+		for (auto& [node, count] : free_count)
+			nodes.push_back(node);
+		std::ranges::sort(nodes, {}, [&](unsigned node)
+		{
+			bool fits = free_count[node] >= job.UsingCores;
+			return std::tuple{!fits, !preferred.contains(node), fits ? int(free_count[node]) : -int(free_count[node])};
+		});
+
+		std::vector<unsigned> result;
+		for (auto node : nodes)
+		{
+			std::vector<std::vector<unsigned>*> whole, partial;
+			for (auto& [core, cpus] : free[node])
+				(cpus.size() == core_size[core] ? whole : partial).push_back(&cpus);
+			auto take = [&](std::vector<unsigned>& cpus, std::size_t count)
+			{
+				for (std::size_t i = 0; i < count && !cpus.empty(); i++)
+				{
+					result.push_back(cpus.front());
+					cpus.erase(cpus.begin());
+				}
+			};
+			// 先取完整的空闲物理核, 剩下的零头优先填补已经被占用了一部分的物理核
+			for (auto cpus : whole)
+				if (job.UsingCores - result.size() >= cpus->size())
+					take(*cpus, cpus->size());
+			for (auto cpus : partial)
+				take(*cpus, job.UsingCores - result.size());
+			for (auto cpus : whole)
+				take(*cpus, job.UsingCores - result.size());
+			if (result.size() == job.UsingCores)
+				break;
+		}
+		return result;
+	}
+};
+
+struct FairShare_t
+// 按用户统计最近使用的资源, 决定不同用户的任务的先后顺序, 并限制每个用户同时占用的资源.
+// 占用的资源在每次变化时按经过的时间计入, 同时按半衰期衰减, 因此只需要在任务开始和结束时更新.
+{
+	std::map<std::string, Usage_t> Users;
+	double HalfLife;	// 秒
+	unsigned TotalCores, TotalGpus;
+	unsigned MaxCores = 0, MaxGpus = 0;	// 每个用户同时占用的资源的上限, 0 表示不限制
+
+	void charge(Usage_t& usage, std::int64_t now)
+	// 把 usage.Time 到 now 之间的使用量计入. 这段时间内占用的资源不变, 衰减后的积分有解析解.
+	{
+		if (now <= usage.Time)
+			return;
+		auto decay = std::exp2((usage.Time - now) / HalfLife);
+		auto hours = HalfLife / std::numbers::ln2 * (1 - decay) / 3600;
+		usage.CoreHours = usage.CoreHours * decay + usage.RunningCores * hours;
+		usage.GpuHours = usage.GpuHours * decay + usage.RunningGpus * hours;
+		usage.Time = now;
+	}
+	void update(std::int64_t now)
 	{
-		std::ofstream("/tmp/gpujob/out.dat");
-		std::filesystem::permissions
+		for (auto& [user, usage] : Users)
+			charge(usage, now);
+	}
+	double load(const std::string& user, std::int64_t now)
+	// 用户的负载, 越小越优先. 最近使用的资源和正在占用的资源都按占整台机器的比例计算,
+	// 正在占用的资源换算为一直占用下去时最终会累积的用量 (半衰期 / ln 2).
+	{
+		auto& usage = Users[user];
+		charge(usage, now);
+		auto steady = HalfLife / std::numbers::ln2 / 3600;
+		return (usage.CoreHours + usage.RunningCores * steady) / TotalCores
+			+ (usage.GpuHours + usage.RunningGpus * steady) / TotalGpus;
+	}
+	bool allows(const Job_t& job) const
+	{
+		auto it = Users.find(job.User);
+		unsigned cores = it == Users.end() ? 0 : it->second.RunningCores;
+		unsigned gpus = it == Users.end() ? 0 : it->second.RunningGpus;
+		return (!MaxCores || cores + job.UsingCores <= MaxCores)
+			&& (!MaxGpus || gpus + std::max<std::size_t>(job.UsingGpus.size(), job.GpuCount) <= MaxGpus);
+	}
+	void acquire(const Job_t& job, std::int64_t now)
+	{
+		auto& usage = Users[job.User];
+		charge(usage, now);
+		usage.RunningCores += job.UsingCores;
+		usage.RunningGpus += job.UsingGpus.size();
+	}
+	void release(const Job_t& job, std::int64_t now)
+	{
+		auto& usage = Users[job.User];
+		charge(usage, now);
+		usage.RunningCores -= job.UsingCores;
+		usage.RunningGpus -= job.UsingGpus.size();
+	}
+};
+
+struct Reservation_t
+// 回填调度中为队首任务预留的资源. 预计在 Time 时队首任务可以开始运行,
+// Spare 记录此时扣除队首任务后仍然会空闲的资源.
+{
+	std::int64_t Time;	// std::numeric_limits<std::int64_t>::max() 表示无法预计
+	Ledger_t Spare;
+
+	bool admit(const Job_t& job, std::int64_t now)
+	// 判断一个任务现在开始运行是否会推迟队首任务: 它在 Time 之前一定会结束, 或者只占用到时仍然空闲的资源.
+	{
+		if (job.TimeLimit && now + job.TimeLimit <= Time)
+			return true;
+		if (!Spare.fits(job))
+			return false;
+		Spare.acquire(job);
+		return true;
+	}
+};
+
+inline std::optional<Reservation_t> reserve
+	(const JobStore_t& store, const Ledger_t& ledger, const Topology_t& topology, const Job_t& head, std::int64_t now)
+// 按照正在运行的任务的预计结束时间依次释放资源, 找出队首任务最早可以开始的时间.
+// 没有时间限制的任务视为永远不会结束. 即使所有任务都结束队首任务也无法运行时, 返回空.
+{
+	std::vector<std::pair<std::int64_t, const Job_t*>> ends;
+	for (auto id : store.Running)
+	{
+		auto& job = store.Jobs.at(id);
+		if (job.Array)
+			continue;
+		ends.emplace_back
 		(
-			"/tmp/gpujob/out.dat",
-			std::filesystem::perms::owner_read | std::filesystem::perms::owner_write |
-			std::filesystem::perms::group_read | std::filesystem::perms::group_write |
-			std::filesystem::perms::others_read | std::filesystem::perms::others_write
+			job.TimeLimit ? std::max(job.StartTime + job.SuspendedSeconds + job.TimeLimit, now)
+				: std::numeric_limits<std::int64_t>::max(),
+			&job
 		);
-		Output_t out;
-		write_out(out);
+	}
+	std::ranges::sort(ends, {}, [](auto& end){return end.first;});
+	Reservation_t reservation{now, ledger};
+	for (auto& [end, job] : ends)
+	{
+		if (reservation.Spare.fits(head))
+			break;
+		reservation.Spare.release(*job);
+		reservation.Time = end;
+	}
+	if (!reservation.Spare.fits(head))
+		return {};
+	// 还没有挑选 GPU 的任务, 按照到时会为它挑选的 GPU 预留, 否则回填的任务仍然可以占用这些 GPU
+	auto reserved = head;
+	if (head.GpuCount && head.UsingGpus.empty())
+		reserved.UsingGpus = reservation.Spare.pick_gpus(topology, head);
+	reservation.Spare.acquire(reserved);
+	return reservation;
+}
+
+inline int listen_socket(std::string path)
+// 在 path 上创建 unix socket 并开始监听. 所有用户都可以连接, 身份由 SO_PEERCRED 确定.
+// 所在的目录不存在时 (不是由 systemd 启动) 创建它, 只有 jobd 的用户可以写.
+{
+	auto directory = std::filesystem::path{path}.parent_path();
+	if (mkdir(directory.c_str(), 0755) && errno != EEXIST)
+		throw std::system_error{errno, std::generic_category(), fmt::format("mkdir {}", directory.string())};
+	std::filesystem::remove(path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		throw std::system_error{errno, std::generic_category(), "socket"};
+	sockaddr_un address{};
+	address.sun_family = AF_UNIX;
+	std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+	if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)))
+		throw std::system_error{errno, std::generic_category(), "bind"};
+	std::filesystem::permissions
+	(
+		path,
+		std::filesystem::perms::owner_read | std::filesystem::perms::owner_write |
+		std::filesystem::perms::group_read | std::filesystem::perms::group_write |
+		std::filesystem::perms::others_read | std::filesystem::perms::others_write
+	);
+	if (listen(fd, SOMAXCONN))
+		throw std::system_error{errno, std::generic_category(), "listen"};
+	return fd;
+}
+
+inline std::optional<std::string> get_peer_user(int fd)
+// 获取 unix socket 对端进程的用户名.
+{
+	ucred credential;
+	socklen_t length = sizeof(credential);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credential, &length))
+		return {};
+	struct passwd *pw = getpwuid(credential.uid);
+	if (pw)
+		return pw->pw_name;
+	else
+		return {};
+}
+
+// 时间限制的上限 (100 年), 避免计算截止时间时溢出
+constexpr std::int64_t MaxTimeLimit = 100ll * 365 * 24 * 3600;
+
+inline void reset_server_fields(Job_t& job)
+// 清除新提交的任务中应当由 jobd 填写的字段. 客户端可以发送任意的 Job_t, 例如伪造 ArrayTask 指向其他用户的
+// 数组任务, 使得它结束时改变那个数组任务的计数. 只指定了 GPU 数量的任务, UsingGpus 也由 jobd 挑选;
+// 否则 UsingGpus 是用户指定的 GPU, 保留. SuspendedSeconds 会从运行时间中扣除, 不清除的话可以绕过时间限制.
+{
+	job.Id = 0;
+	job.Pid = 0;
+	job.PidStartTime = 0;
+	job.StartTime = job.FinishTime = job.SuspendTime = job.SuspendedSeconds = 0;
+	job.Cpus.clear();
+	if (job.GpuCount)
+		job.UsingGpus.clear();
+	job.ExitCode.reset();
+	job.ExitSignal.reset();
+	job.Measured = {};
+	job.ArrayTask.reset();
+	if (job.Array)
+		job.Array->Dispatched = job.Array->Running = job.Array->Finished = 0;
+	// 加载的模块只由系统配置决定 (见 ModuleCache_t), 记录下来的也与之一致
+	job.ModulePaths.clear();
+	job.Modules.clear();
+	if (auto profile = find_system_profile(job.Profile))
+	{
+		job.ModulePaths = profile->ModulePaths;
+		job.Modules = profile->Modules;
 	}
 }
 
-int main()
+struct Task_t
+// 一个正在运行的任务的进程, 以及用来监听它退出的 pidfd.
+// jobd 重启后重新接管的任务不是 jobd 的子进程, 无法得到它的退出状态, 只能通过 Pid 和启动时间判断它是否还在运行.
+{
+	pid_t Pid = 0;
+	std::uint64_t StartTime = 0;
+	int PidFd = -1;
+	bool Adopted = false;
+	bool Helper = false;	// 通过启动器启动, 退出由启动器告知 (启动器退出后由 jobd 回收), 不需要 pidfd
+	std::optional<int> ExitStatus;	// jobd 回收子进程时由 waitpid 得到
+
+	bool running() const
+	{
+		if (Adopted)
+			return get_process_start_time(Pid) == StartTime;
+		else
+			return !ExitStatus;
+	}
+
+	static std::optional<Task_t> adopt(const Job_t& job)
+	// jobd 重启后接管上次启动的任务. 进程号相同但启动时间不同时, 是进程号被其它进程重用了, 任务已经不在
+	{
+		if (!job.Pid || get_process_start_time(job.Pid) != job.PidStartTime)
+			return {};
+		return Task_t{job.Pid, job.PidStartTime, -1, true};
+	}
+};
+
+// 测试 (test) 和性能测试 (bench) 中直接包含这个文件, 并定义 GPUJOB_NO_MAIN 以使用自己的 main
+# ifndef GPUJOB_NO_MAIN
+int main(int argc, const char** argv)
 {
 	try
 	{
-		std::vector<Job_t> jobs;
-		std::map<unsigned, std::unique_ptr<boost::process::child>> tasks;
-		unsigned next_id = 0;
+		cxxopts::Options options("jobd", "The daemon of the simple job scheduler.");
+		options.add_options()
+			("keep-finished", "Number of finished jobs always kept in out.dat, older ones may be moved to the archive.",
+				cxxopts::value<unsigned>()->default_value("1000"))
+			("keep-hours", "Finished jobs are kept in out.dat for at least this many hours before archived.",
+				cxxopts::value<unsigned>()->default_value("24"))
+			("policy", "Scheduling policy. \"fifo\" starts every pending job that fits, in submission order. "
+				"\"backfill\" reserves resources for the first job that does not fit, "
+				"and starts later jobs only if they do not delay it.",
+				cxxopts::value<std::string>()->default_value("fifo"))
+			("preempt", "Allow a job that does not fit to suspend running jobs with lower priority. "
+				"Suspended jobs are resumed when the resources are free again.",
+				cxxopts::value<bool>()->default_value("false"))
+			("sysfs-root", "Where sysfs is mounted. The CPU and GPU topology is read from here.",
+				cxxopts::value<std::string>()->default_value("/sys"))
+			("cgroup-root", "Put each job in its own cgroup (v2) under this directory, and limit its CPU and memory "
+				"as requested. It may be a cgroup delegated to a normal user. Empty to disable.",
+				cxxopts::value<std::string>()->default_value("/sys/fs/cgroup/gpujob.slice"))
+			("sample-interval", "Seconds between two samples of the resources actually used by running jobs, "
+				"0 to disable.", cxxopts::value<unsigned>()->default_value("60"))
+			("launcher", "How to start jobs. \"runuser\" forks runuser from jobd for every job. \"helper\" sends jobs "
+				"to a small helper process forked when jobd starts, which switches to the user of the job by itself.",
+				cxxopts::value<std::string>()->default_value("runuser"))
+			("module-init", "Script that defines the \"module\" command. jobd loads the modules needed by jobs with it "
+				"once, and caches the resulting environment.",
+				cxxopts::value<std::string>()->default_value("/etc/profile.d/modules.sh"))
+			("kill-grace", "Seconds to wait after sending SIGTERM to a cancelled job before sending SIGKILL.",
+				cxxopts::value<unsigned>()->default_value("30"))
+			("memory-reserve", "Memory in GB kept for the system, the rest of the physical memory can be used by jobs.",
+				cxxopts::value<unsigned>()->default_value("4"))
+			("enforce-memory", "Kill jobs that use more memory than they requested. "
+				"Only needed when the memory of jobs can not be limited through cgroup.",
+				cxxopts::value<bool>()->default_value("false"))
+			("gpu-slots", "Split each GPU into this many slots. Jobs may ask for some slots instead of whole GPUs, "
+				"and share a GPU with other such jobs. Jobs asking for whole GPUs never share them.",
+				cxxopts::value<unsigned>()->default_value("1"))
+			("gpu-inventory", "Where to get the model and memory of the GPUs: \"nvidia-smi\", or a file in the format of "
+				"\"nvidia-smi --query-gpu=index,name,memory.total --format=csv,noheader,nounits\".",
+				cxxopts::value<std::string>()->default_value("nvidia-smi"))
+			("fair-share", "Order pending jobs of different users by their recent usage, "
+				"instead of by submission order.", cxxopts::value<bool>()->default_value("false"))
+			("half-life", "Half-life in hours of the recorded usage used by fair-share scheduling.",
+				cxxopts::value<double>()->default_value("168"))
+			("user-max-cores", "Maximum number of cores used by one user at the same time, 0 means no limit.",
+				cxxopts::value<unsigned>()->default_value("0"))
+			("user-max-gpus", "Maximum number of GPUs used by one user at the same time, 0 means no limit.",
+				cxxopts::value<unsigned>()->default_value("0"));
+		auto args = options.parse(argc, argv);
+		auto keep_finished = args["keep-finished"].as<unsigned>();
+		auto keep_seconds = std::int64_t{args["keep-hours"].as<unsigned>()} * 3600;
+		auto policy = args["policy"].as<std::string>();
+		if (policy != "fifo" && policy != "backfill")
+			throw std::invalid_argument{fmt::format("policy {} not recognized.", policy)};
+		auto fair_share_order = args["fair-share"].as<bool>();
+		auto preemption = args["preempt"].as<bool>();
+		if (args["half-life"].as<double>() <= 0)
+			throw std::invalid_argument{"half-life must be positive."};
 
-		auto notify = [](std::string comment){boost::process::child
+		create_files();
+		std::signal(SIGPIPE, SIG_IGN);
+		// 子进程退出时, 在事件循环中通过 signalfd 得知. 在启动任何线程之前屏蔽, 以免信号被其它线程收到.
+		sigset_t child_signal;
+		sigemptyset(&child_signal);
+		sigaddset(&child_signal, SIGCHLD);
+		sigprocmask(SIG_BLOCK, &child_signal, nullptr);
+		// 任务的进程退出后, 它留下的后代进程交给 jobd 回收, 这样才能确认整个进程组都已经退出
+		prctl(PR_SET_CHILD_SUBREAPER, 1);
+		auto launcher = args["launcher"].as<std::string>();
+		if (launcher != "runuser" && launcher != "helper")
+			throw std::invalid_argument{fmt::format("launcher {} not recognized.", launcher)};
+		std::optional<Helper_t> helper;
+		if (launcher == "helper")
+			helper = Helper_t::start();
+		SshMasters_t ssh_masters;
+		// 启动时读取程序的配置, 配置文件有错误时尽早报告
+		try
 		{
-			"/usr/local/bin/notify", comment,
-			boost::process::std_out > boost::process::null, boost::process::std_err > boost::process::null
-		}.detach();};
+			std::clog << fmt::format("{} profiles loaded\n", profiles().Items.size());
+		}
+		catch (const std::exception& e)
+		{
+			std::clog << fmt::format("can not load profiles: {}\n", e.what());
+		}
+		EventLoop_t loop;
+		ModuleCache_t modules{args["module-init"].as<std::string>(), &loop};
 
-		create_files();
+		// 恢复上次退出时的状态: 等待中的任务继续等待, 仍在运行的任务稍后重新接管, 已经不在的任务标记为结束
+		auto [recovered, sequence] = recover_state();
+		JobStore_t store;
+		auto topology = Topology_t::read(args["sysfs-root"].as<std::string>());
+		Ledger_t ledger;
+		ledger.TotalCores = topology.Cpus.size();
+		auto inventory = GpuInventory_t::read(args["gpu-inventory"].as<std::string>());
+		// 检测不到型号时, 至少可以按照 sysfs 中的 GPU 数量挑选
+		if (inventory.Gpus.empty())
+			for (unsigned gpu = 0; gpu < topology.GpuNodes.size(); gpu++)
+				inventory.Gpus.push_back({gpu, "", 0});
+		for (auto& gpu : inventory.Gpus)
+			std::clog << fmt::format("gpu {}: {} {} MiB\n", gpu.Id, gpu.Model, gpu.Memory);
+		ledger.Inventory = &inventory;
+		ledger.SlotsPerGpu = std::max(args["gpu-slots"].as<unsigned>(), 1u);
+		ledger.TotalMemory = get_total_memory();
+		ledger.TotalMemory -= std::min<std::uint64_t>(ledger.TotalMemory, args["memory-reserve"].as<unsigned>() * 1024ull);
+		std::clog << fmt::format("{} cores, {} MiB memory for jobs\n", ledger.TotalCores, ledger.TotalMemory);
+		std::optional<Cgroup_t> cgroup;
+		if (auto root = args["cgroup-root"].as<std::string>(); !root.empty())
+			cgroup = Cgroup_t::open(root);
+		Sampler_t sampler{cgroup ? &*cgroup : nullptr};
+		std::map<unsigned, Task_t> tasks;
+		unsigned next_id = recovered.NextId;
+		FairShare_t fair_share
+		{
+			std::move(recovered.Usage), args["half-life"].as<double>() * 3600, ledger.TotalCores,
+			std::max<unsigned>(inventory.Gpus.size(), 1),
+			args["user-max-cores"].as<unsigned>(), args["user-max-gpus"].as<unsigned>()
+		};
+		// 快照只在 journal 增长后才重写, 其中记录的用量可能已经是很久以前的. 假设当时正在占用的资源一直占用到现在,
+		// 计入这段时间的用量; 之后正在占用的资源在接管任务时重新统计
+		fair_share.update(std::time(nullptr));
+		for (auto& [user, usage] : fair_share.Users)
+			usage.RunningCores = usage.RunningGpus = 0;
+		for (auto& job : recovered.Jobs)
+			store.add(std::move(job));
+		auto started = store.Running;
+		started.insert(store.Suspended.begin(), store.Suspended.end());
+		for (auto id : started)
+		{
+			auto& job = store.Jobs.at(id);
+			if (job.Array)
+				continue;
+			else if (auto task = Task_t::adopt(job))
+			{
+				tasks[job.Id] = *task;
+				// 暂停的任务不占用资源, 仍然保持暂停, 等资源空闲时再继续
+				if (job.Status == Job_t::Status_t::Running)
+				{
+					ledger.acquire(job);
+					fair_share.acquire(job, std::time(nullptr));
+				}
+				std::clog << fmt::format("adopt {} job {} (pid {})\n", nameof::nameof_enum(job.Status), job.Id, job.Pid);
+			}
+			else
+			{
+				store.set_status(job, Job_t::Status_t::Finished);
+				store.finish_array_task(job);
+				std::clog << fmt::format("running job {} is lost\n", job.Id);
+			}
+		}
+		std::clog << fmt::format("recovered {} jobs, next id {}\n", store.Jobs.size(), next_id);
+		// 通知只是附带的, 通知程序不存在或者启动失败时不能影响任务的提交和运行:
+		// 否则 handle_input 在任务已经写入 journal 之后抛出异常, 客户端以为提交失败而重复提交
+		auto notify = [](std::string comment)
+		{
+			try
+			{
+				boost::process::child
+				{
+					"/usr/local/bin/notify", comment,
+					boost::process::std_out > boost::process::null, boost::process::std_err > boost::process::null
+				}.detach();
+			}
+			catch (const std::exception& e)
+			{
+				std::clog << fmt::format("can not notify {}: {}\n", comment, e.what());
+			}
+		};
 
-		while (true)
+
+		// 启动时总是重写一次 out.dat, 以免留下旧版本 jobd 写的格式
+		Journal_t journal{sequence};
+		journal.reset({store.all(), next_id, fair_share.Users, inventory.Gpus, ledger.TotalMemory});
+		journal.load_archive_index();
+
+		// 启动后先处理一次恢复出的任务: 分配等待中的任务, 检查接管的任务的时间限制
+		bool jobs_changed = true;
+
+		// 不再监听一个任务的进程
+		auto forget_task = [&](unsigned id)
+		{
+			if (auto it = tasks.find(id); it != tasks.end())
+			{
+				if (it->second.PidFd >= 0)
+				{
+					loop.remove(it->second.PidFd);
+					close(it->second.PidFd);
+				}
+				tasks.erase(it);
+			}
+		};
+
+		// 正在结束的任务: 已经向它的进程发送了 SIGTERM, 等待它们全部退出. 在此之前不释放它占用的资源,
+		// 以免新的任务与还没有退出的进程争抢. 超过 --kill-grace 仍未退出时发送 SIGKILL.
+		// 这些都不阻塞事件循环, 由 dying_timer 每秒检查一次.
+		struct Dying_t
+		{
+			Job_t Job;	// 开始结束时的副本, 用来释放资源
+			bool Group;	// 进程是否在以 Job.Pid 为组长的进程组中. jobd 重启前启动的任务可能不是
+			bool HoldsResources;	// 暂停的任务已经让出了资源
+			std::int64_t Deadline;
+			bool Killed = false;
+		};
+		std::map<unsigned, Dying_t> dying;
+		auto kill_grace = std::int64_t{args["kill-grace"].as<unsigned>()};
+		int dying_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (dying_timer < 0)
+			throw std::system_error{errno, std::generic_category(), "timerfd_create"};
+		auto signal_dying = [&](const Dying_t& dead, int signal)
+		{
+			if (dead.Group)
+				::kill(-dead.Job.Pid, signal);
+			else
+				signal_process_tree(dead.Job.Pid, signal);
+			if (cgroup)
+				cgroup->signal(dead.Job.Id, signal);
+		};
+
+		// 删除已经结束的任务留下的 cgroup, 启动时删除上次退出后结束的任务留下的.
+		// 正在结束的任务的进程可能还没有全部退出, 要保留它的 cgroup, check_dying 据此判断并杀死剩下的进程
+		auto cleanup_cgroups = [&]
+		{
+			if (!cgroup)
+				return;
+			std::set<unsigned> alive;
+			for (auto& [id, task] : tasks)
+				alive.insert(id);
+			for (auto& [id, dead] : dying)
+				alive.insert(id);
+			cgroup->cleanup(alive);
+		};
+		cleanup_cgroups();
+
+		// 任务结束 (正常结束或者被取消) 后的处理: 释放资源, 记录状态, 更新它所属的数组任务
+		auto finish_job = [&](Job_t& job, JournalEntry_t::Type_t type)
+		{
+			if (job.Status == Job_t::Status_t::Running && !job.Array && !job.RunInContainer)
+				sampler.finish(job, std::time(nullptr));
+			// 被杀死的任务的资源等它的进程全部退出后才释放
+			if (job.Status == Job_t::Status_t::Running && !job.Array && !dying.contains(job.Id))
+			{
+				ledger.release(job);
+				fair_share.release(job, std::time(nullptr));
+			}
+			store.set_status(job, Job_t::Status_t::Finished);
+			journal.append(type, job);
+			if (auto parent = store.finish_array_task(job))
+				journal.append(JournalEntry_t::Type_t::Finish, *parent);
+			jobs_changed = true;
+		};
+
+		// 开始结束一个正在运行或者暂停的任务的进程. 不等待它们退出, 之后由 check_dying 处理.
+		auto kill_job = [&](Job_t& job)
+		{
+			auto pid = tasks[job.Id].Pid;
+			// 自己启动的任务一定是进程组的组长 (子进程可能还没来得及调用 setsid)
+			bool group = !tasks[job.Id].Adopted || getpgid(pid) == pid;
+			forget_task(job.Id);
+			std::clog << fmt::format("kill job: {} {}\n", job.Id, pid);
+			auto& dead = dying[job.Id] = Dying_t
+				{job, group, job.Status == Job_t::Status_t::Running, std::time(nullptr) + kill_grace};
+			signal_dying(dead, SIGTERM);
+			// 暂停的进程要继续运行才能处理 SIGTERM
+			if (job.Status == Job_t::Status_t::Suspended)
+				signal_dying(dead, SIGCONT);
+			set_timer(dying_timer, 1s);
+		};
+
+		// 检查正在结束的任务的进程是否都已经退出, 释放它们的资源; 超时的发送 SIGKILL
+		auto check_dying = [&]
 		{
-			std::this_thread::sleep_for(1s);
+			auto now = std::time(nullptr);
+			for (auto it = dying.begin(); it != dying.end();)
+			{
+				auto& dead = it->second;
+				bool alive = (dead.Group ? ::kill(-dead.Job.Pid, 0) == 0
+						: get_process_start_time(dead.Job.Pid) == dead.Job.PidStartTime)
+					|| (cgroup && cgroup->populated(dead.Job.Id));
+				if (!alive)
+				{
+					if (dead.HoldsResources)
+					{
+						ledger.release(dead.Job);
+						fair_share.release(dead.Job, now);
+					}
+					std::clog << fmt::format("processes of job {} are gone\n", dead.Job.Id);
+					jobs_changed = true;
+					it = dying.erase(it);
+					continue;
+				}
+				else if (!dead.Killed && now >= dead.Deadline)
+				{
+					std::clog << fmt::format("job {} did not exit in {} seconds, send SIGKILL\n", dead.Job.Id, kill_grace);
+					signal_dying(dead, SIGKILL);
+					if (cgroup)
+						cgroup->kill(dead.Job.Id);
+					dead.Killed = true;
+				}
+				it++;
+			}
+			if (!dying.empty())
+				set_timer(dying_timer, 1s);
+		};
+		loop.add(dying_timer, [&]{drain(dying_timer); check_dying();});
+
+		// 取消任务. 取消数组任务时, 正在运行的子任务也一起取消, 尚未开始的子任务不再生成.
+		auto cancel_job = [&](Job_t& job)
+		{
+			if (job.Array)
+				for (auto id : std::set<unsigned>{store.Running})
+					if (auto& task = store.Jobs.at(id); task.ArrayTask && task.ArrayTask->first == job.Id)
+					{
+						kill_job(task);
+						finish_job(task, JournalEntry_t::Type_t::Cancel);
+					}
+			if (job.Array)
+				for (auto id : std::set<unsigned>{store.Suspended})
+					if (auto& task = store.Jobs.at(id); task.ArrayTask && task.ArrayTask->first == job.Id)
+					{
+						kill_job(task);
+						finish_job(task, JournalEntry_t::Type_t::Cancel);
+					}
+			if ((job.Status == Job_t::Status_t::Running || job.Status == Job_t::Status_t::Suspended) && !job.Array)
+				kill_job(job);
+			finish_job(job, JournalEntry_t::Type_t::Cancel);
+		};
 
-			bool jobs_changed = false;
+		// 处理客户端的请求. 请求中的用户名已经根据文件的所有者或者 socket 的对端填好.
+		auto handle_input = [&](Input_t& input) -> Reply_t
+		{
+			for (auto& job : input.NewJobs)
+				if (job.TimeLimit < 0 || job.TimeLimit > MaxTimeLimit)
+					throw std::invalid_argument{fmt::format("invalid time limit {}s", job.TimeLimit)};
+				else if (job.Array && job.Array->Last < job.Array->First)
+					throw std::invalid_argument{fmt::format("invalid array {}-{}", job.Array->First, job.Array->Last)};
+				else if (job.Memory > ledger.TotalMemory)
+					throw std::invalid_argument{fmt::format
+						("{} MiB memory requested, but only {} MiB can be used", job.Memory, ledger.TotalMemory)};
+				else if (job.GpuSlots > ledger.SlotsPerGpu)
+					throw std::invalid_argument{fmt::format
+						("{} gpu slots requested, but each gpu has only {}", job.GpuSlots, ledger.SlotsPerGpu)};
+				else if (job.GpuCount && inventory.match(job).size() < job.GpuCount)
+					throw std::invalid_argument{fmt::format
+					(
+						"only {} gpus match model \"{}\" and memory {} MiB, but {} requested",
+						inventory.match(job).size(), job.GpuModel, job.GpuMinMemory, job.GpuCount
+					)};
+			Reply_t reply;
+			for (auto& job : input.NewJobs)
+			{
+				reset_server_fields(job);
+				job.Id = next_id++;
+				store.add(job);
+				journal.append(JournalEntry_t::Type_t::Submit, job);
+				reply.NewJobIds.push_back(job.Id);
+				std::clog << fmt::format
+				(
+					"new job: {} {} {} {} {} {} {} {} {}\n",
+					job.Id, job.User, job.ProgramString, job.Comment, job.UsingCores,
+					job.UsingGpus, nameof::nameof_enum(job.Status), job.RunInContainer, job.RunNow
+				);
+				notify(fmt::format("new job: {} {}", job.Id, job.Comment));
+			}
+			for (auto& job : input.RemoveJobs)
+			{
+				if (auto it = store.find(job.first))
+				{
+					if (it->User == job.second && it->Status != Job_t::Status_t::Finished)
+					{
+						cancel_job(*it);
+						reply.RemovedJobs.push_back(it->Id);
+						std::clog << fmt::format("remove job {} success\n", job);
+						notify(fmt::format("remove job: {} {}", it->Id, it->Comment));
+					}
+				}
+				else
+					std::clog << fmt::format("remove job {} not found\n", job);
+			}
+			jobs_changed = true;
+			return reply;
+		};
 
-			// read new jobs
+		// read new jobs from /tmp/gpujob/in, 这是为旧版本客户端保留的方式
+		auto read_new_jobs = [&]
+		{
 			if (auto input = read_in())
+				try
+				{
+					handle_input(*input);
+				}
+				catch (std::exception& e)
+				{
+					std::clog << fmt::format("error in read_new_jobs: {}\n", e.what());
+				}
+		};
+
+		// 处理 unix socket 上的一个连接: 读完一条请求, 处理后回复, 然后关闭连接.
+		// 连接是非阻塞的: 回复一次写不完时等到可写再继续, 读得慢的客户端不会卡住事件循环.
+		struct Connection_t
+		{
+			std::string Input, Output;
+			std::size_t Sent = 0;
+			std::chrono::steady_clock::time_point Deadline;
+		};
+		std::map<int, Connection_t> connections;
+		auto close_connection = [&](int fd)
+		{
+			loop.remove(fd);
+			close(fd);
+			connections.erase(fd);
+		};
+		auto write_connection = [&](int fd)
+		{
+			auto& connection = connections.at(fd);
+			while (connection.Sent < connection.Output.size())
+			{
+				auto n = send(fd, connection.Output.data() + connection.Sent,
+					connection.Output.size() - connection.Sent, MSG_NOSIGNAL);
+				if (n < 0 && errno == EINTR)
+					continue;
+				else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+					return;
+				else if (n < 0)
+					break;
+				connection.Sent += n;
+			}
+			close_connection(fd);
+		};
+		auto read_connection = [&](int fd)
+		{
+			auto& connection = connections.at(fd);
+			std::array<char, 65536> buffer;
+			auto n = recv(fd, buffer.data(), buffer.size(), 0);
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+				return;
+			else if (n <= 0)
+			{
+				close_connection(fd);
+				return;
+			}
+			connection.Input.append(buffer.data(), n);
+			if (connection.Input.size() > sizeof(std::uint32_t) + MaxMessageSize)
+			{
+				std::clog << fmt::format("closing connection {}: request larger than {} bytes\n", fd, MaxMessageSize);
+				close_connection(fd);
+				return;
+			}
+			Reply_t reply;
+			try
+			{
+				auto message = take_message(connection.Input);
+				if (!message)
+					return;
+				auto user = get_peer_user(fd);
+				if (!user)
+					throw std::runtime_error{"can not identify the user"};
+				auto input = deserialize_message<Input_t>(*message);
+				for (auto& job : input.NewJobs)
+				{
+					job.User = *user;
+					job.Status = Job_t::Status_t::Pending;
+				}
+				for (auto& job : input.RemoveJobs)
+					job.second = *user;
+				reply = handle_input(input);
+			}
+			catch (std::exception& e)
+			{
+				std::clog << fmt::format("error in read_connection: {}\n", e.what());
+				reply = {};
+				reply.Error = e.what();
+			}
+			// 回复之前先把这一次请求写入的记录刷到磁盘上, 客户端收到回复时任务一定不会因为 jobd 崩溃而丢失
+			journal.sync();
+			connection.Output = frame_message(serialize_message(reply));
+			loop.modify(fd, EPOLLOUT);
+			write_connection(fd);
+		};
+
+		// 检查任务是否已经结束
+		auto check_finished = [&](unsigned id)
+		{
+			auto task = tasks.find(id);
+			if (task == tasks.end() || task->second.running())
+				return;
+			auto status = task->second.ExitStatus;
+			forget_task(id);
+			// 主进程退出后, 留在后台的进程也一起结束. cgroup.kill 不等待它们退出; 还有进程没有退出时交给
+			// check_dying, 资源在 cgroup 空了之后才释放. 主进程已经退出, pid 可能被重用, 不再向它发信号.
+			bool oom = false;
+			if (cgroup)
+			{
+				oom = cgroup->oom_killed(id);
+				cgroup->kill(id);
+			}
+			if (auto it = store.find(id))
 			{
-				for (auto& job : input->NewJobs)
+				if (cgroup && cgroup->populated(id))
+				{
+					std::clog << fmt::format("job {} exited, waiting for its remaining processes\n", id);
+					dying[id] = Dying_t
+					{
+						*it, false, it->Status == Job_t::Status_t::Running && !it->Array,
+						std::time(nullptr) + kill_grace, true
+					};
+					set_timer(dying_timer, 1s);
+				}
+				if (status && WIFEXITED(*status))
+					it->ExitCode = WEXITSTATUS(*status);
+				else if (status && WIFSIGNALED(*status))
+					it->ExitSignal = WTERMSIG(*status);
+				finish_job(*it, JournalEntry_t::Type_t::Finish);
+				if (oom)
+				{
+					std::clog << fmt::format("job {} finished, some processes were killed for out of memory\n", it->Id);
+					notify(fmt::format("finish job (out of memory): {} {}", it->Id, it->Comment));
+				}
+				else
 				{
-					job.Id = next_id++;
-					jobs.push_back(job);
 					std::clog << fmt::format
 					(
-						"new job: {} {} {} {} {} {} {} {} {}\n",
-						job.Id, job.User, job.ProgramString, job.Comment, job.UsingCores,
-						job.UsingGpus, nameof::nameof_enum(job.Status), job.RunInContainer, job.RunNow
+						"job {} finished, exit code {}, signal {}\n",
+						it->Id, it->ExitCode.value_or(-1), it->ExitSignal.value_or(0)
 					);
-					notify(fmt::format("new job: {} {}", job.Id, job.Comment));
+					notify(fmt::format("finish job: {} {}", it->Id, it->Comment));
 				}
-				for (auto& job : input->RemoveJobs)
+			}
+			else
+				std::unreachable();
+		};
+
+		// 回收所有已经退出的子进程. 任务的进程的退出状态记下来并立即处理, 其它的 (例如 notify) 直接丢弃.
+		auto record_exit = [&](pid_t pid, int status) -> std::optional<unsigned>
+		{
+			for (auto& [id, task] : tasks)
+				if (!task.Adopted && task.Pid == pid)
 				{
-					auto it = std::find_if(jobs.begin(), jobs.end(), [&](auto& j){return j.Id == job.first;});
-					if (it != jobs.end())
-					{
-						if (it->User == job.second)
-						{
-							if (it->Status == Job_t::Status_t::Running)
-							{
-								auto pid = tasks[it->Id]->id();
-								tasks[it->Id]->detach();
-								tasks[it->Id].reset();
-								std::clog << fmt::format("kill job: {} {}\n", it->Id, pid);
-								auto command = fmt::format("rkill {}", pid);
-								boost::process::child{command}.wait();
-							}
-							it->Status = Job_t::Status_t::Finished;
-							std::clog << fmt::format("remove job {} success\n", job);
-							notify(fmt::format("remove job: {} {}", it->Id, it->Comment));
-						}
-					}
-					else
-						std::clog << fmt::format("remove job {} not found\n", job);
+					task.ExitStatus = status;
+					return id;
+				}
+			return {};
+		};
+		auto reap_children = [&]
+		{
+			std::vector<unsigned> exited;
+			int status;
+			for (pid_t pid; (pid = waitpid(-1, &status, WNOHANG)) > 0;)
+				if (auto id = record_exit(pid, status))
+					exited.push_back(*id);
+			for (auto id : exited)
+				check_finished(id);
+		};
+
+		// 启动一个任务
+		auto start_job = [&](Job_t& job)
+		{
+			// runuser -u chn -- ssh -p 1022 127.0.0.1 ...
+			// runuser -c -u chn -- ...
+			// 由 jobd 挑选的 GPU 通过 CUDA_VISIBLE_DEVICES 告诉任务, 命令中也可以引用这个变量.
+			// 分配到的 CPU 通过 GPUJOB_CPUS 告诉任务 (例如用于 mpirun --cpu-set).
+			// 在本机运行的任务在 exec 之前绑定; 容器中的任务不是 jobd 的后代, 由它自己的 shell 绑定.
+			// 任务在 exec 之前进入自己的 cgroup, 之后产生的所有进程都受到限制. 容器中的任务只有 ssh 客户端在其中.
+			auto command = modules.wrap(job, job.ProgramString);
+			if (job.GpuCount && job.UsingGpus.empty())
+			{
+				job.UsingGpus = ledger.pick_gpus(topology, job);
+				command = fmt::format
+				(
+					"export CUDA_DEVICE_ORDER=PCI_BUS_ID CUDA_VISIBLE_DEVICES={}; {}",
+					fmt::join(job.UsingGpus, ","), command
+				);
+			}
+			job.Cpus = ledger.pick_cpus(topology, job);
+			if (!job.Cpus.empty())
+				command = fmt::format
+				(
+					"export GPUJOB_CPUS={0}; {1}{2}", format_cpu_list(job.Cpus),
+					job.RunInContainer ? fmt::format("taskset -pc {} $$ > /dev/null; ", format_cpu_list(job.Cpus)) : "",
+					command
+				);
+			// 以任务的用户运行的命令. 本地的任务用用户的 shell 运行, 与 runuser -c 相同
+			std::vector<std::string> args;
+			if (job.RunInContainer)
+				args = ssh_masters.args(job.User, command);
+			else if (auto passwd = getpwnam(job.User.c_str()))
+				args = {passwd->pw_shell, "-c", command};
+			std::string procs;
+			if (cgroup && cgroup->create(job))
+				procs = (cgroup->path(job.Id) / "cgroup.procs").string();
+			auto& task = tasks[job.Id];
+			if (helper && !args.empty())
+				try
+				{
+					task.Pid = helper->launch({args, job.User, job.Cpus, procs});
+					task.Helper = true;
+					std::clog << fmt::format("run job args (through launcher helper): {}\n", args);
+				}
+				catch (const std::exception& e)
+				{
+					std::clog << fmt::format("launcher helper failed for job {}: {}\n", job.Id, e.what());
 				}
-				std::erase_if(tasks, [&](auto& task){return task.second.get() == nullptr;});
-				jobs_changed = true;
+			if (!task.Pid)
+			{
+				if (job.RunInContainer)
+					args.insert(args.begin(), {"runuser", "-u", job.User, "--"});
+				else
+					args = {"runuser", "-c", "-u", job.User, "--", command};
+				std::clog << fmt::format("run job args: {}\n", args);
+				task.Pid = spawn(args, [&]{enter_job_context(procs, job.Cpus);});
+				// 自己启动的进程退出时会收到 SIGCHLD, pidfd 只是多一道保险.
+				// 通过启动器启动的进程的退出由启动器告知.
+				task.PidFd = open_pidfd(task.Pid);
+				if (task.PidFd >= 0)
+					loop.add(task.PidFd, reap_children);
 			}
+			task.StartTime = get_process_start_time(task.Pid).value_or(0);
 
-			// check if jobs finished
-			for (auto& task : tasks)
-				if (!task.second->running())
+			std::clog << fmt::format("run job: {} {}\n", job.Id, job.Comment);
+			notify(fmt::format("run job: {} {}", job.Id, job.Comment));
+			store.set_status(job, Job_t::Status_t::Running);
+			job.StartTime = std::time(nullptr);
+			job.Pid = task.Pid;
+			job.PidStartTime = task.StartTime;
+			journal.append(JournalEntry_t::Type_t::Start, job);
+			ledger.acquire(job);
+			fair_share.acquire(job, job.StartTime);
+		};
+
+		// 从数组任务中生成并启动子任务, 直到资源不足或者达到同时运行的数量上限.
+		// 返回是否还有子任务因为资源不足而在等待.
+		auto start_array_tasks = [&](Job_t& job, auto&& can_start) -> bool
+		{
+			auto& array = *job.Array;
+			auto size = array.Last - array.First + 1;
+			// RunNow 的子任务不检查资源, 没有指定上限时最多同时运行能放满所有核的数量, 而不是一次全部启动
+			auto max_running = array.MaxRunning ? array.MaxRunning
+				: job.RunNow ? std::max(1u, ledger.TotalCores / std::max(1u, job.UsingCores)) : 0;
+			bool changed = false;
+			while (array.Dispatched < size && (!max_running || array.Running < max_running) && can_start(job))
+			{
+				auto task = job;
+				task.Id = next_id++;
+				task.Array.reset();
+				task.ArrayTask = {job.Id, array.First + array.Dispatched};
+				task.ProgramString = render_array_task(job, task.ArrayTask->second);
+				task.Comment = fmt::format("{} [{}]", job.Comment, task.ArrayTask->second);
+				array.Dispatched++;
+				array.Running++;
+				changed = true;
+				auto& added = store.add(std::move(task));
+				journal.append(JournalEntry_t::Type_t::Submit, added);
+				start_job(added);
+			}
+			// 所有子任务都已经生成后, 数组任务本身不再等待
+			if (array.Dispatched == size)
+				store.set_status(job, Job_t::Status_t::Running);
+			if (changed)
+				journal.append(JournalEntry_t::Type_t::Start, job);
+			return array.Dispatched < size && (!max_running || array.Running < max_running);
+		};
+
+		// 暂停一个正在运行的任务, 让出它占用的资源
+		auto suspend_job = [&](Job_t& job)
+		{
+			signal_process_tree(tasks[job.Id].Pid, SIGSTOP);
+			ledger.release(job);
+			fair_share.release(job, std::time(nullptr));
+			store.set_status(job, Job_t::Status_t::Suspended);
+			job.SuspendTime = std::time(nullptr);
+			journal.append(JournalEntry_t::Type_t::Suspend, job);
+			std::clog << fmt::format("suspend job: {} {}\n", job.Id, job.Comment);
+			notify(fmt::format("suspend job: {} {}", job.Id, job.Comment));
+		};
+
+		// 继续一个被暂停的任务
+		auto resume_job = [&](Job_t& job)
+		{
+			auto now = std::time(nullptr);
+			// 暂停期间原来的 CPU 可能已经分配给了其它任务, 重新挑选并绑定
+			job.Cpus = ledger.pick_cpus(topology, job);
+			if (!job.Cpus.empty() && !job.RunInContainer)
+				pin_process_tree(tasks[job.Id].Pid, job.Cpus);
+			if (cgroup)
+				cgroup->limit(job);
+			ledger.acquire(job);
+			fair_share.acquire(job, now);
+			store.set_status(job, Job_t::Status_t::Running);
+			job.SuspendedSeconds += now - job.SuspendTime;
+			journal.append(JournalEntry_t::Type_t::Resume, job);
+			signal_process_tree(tasks[job.Id].Pid, SIGCONT);
+			std::clog << fmt::format("resume job: {} {}\n", job.Id, job.Comment);
+			notify(fmt::format("resume job: {} {}", job.Id, job.Comment));
+		};
+
+		// 为了让 job 可以运行, 暂停优先级比它低的任务. 无法腾出足够的资源时什么也不做, 返回 false.
+		// 在容器中运行的任务的进程不在 jobd 之下, 无法暂停.
+		auto preempt = [&](const Job_t& job) -> bool
+		{
+			std::vector<Job_t*> candidates;
+			for (auto id : store.Running)
+				if (auto& other = store.Jobs.at(id); !other.Array && !other.RunInContainer && other.Priority < job.Priority)
+					candidates.push_back(&other);
+			// 优先级最低的先暂停; 优先级相同时, 最后开始的先暂停
+			std::ranges::sort(candidates, {}, [](auto other){return std::pair{other->Priority, -other->StartTime};});
+			// 还没有挑选 GPU 的任务, 先假设所有可以暂停的任务都已经暂停, 按此时会挑选的 GPU 决定暂停哪些任务
+			auto target = job;
+			if (job.GpuCount && job.UsingGpus.empty())
+			{
+				auto preemptable = ledger;
+				for (auto other : candidates)
+					preemptable.release(*other);
+				target.UsingGpus = preemptable.pick_gpus(topology, job);
+			}
+			auto trial = ledger;
+			std::vector<Job_t*> victims;
+			// 要独占的 GPU 上的任务都要暂停, 然后再按顺序暂停其它任务直到资源足够
+			std::erase_if(candidates, [&](auto other)
+			{
+				if
+				(
+					ledger.slots(target) < ledger.SlotsPerGpu
+					|| std::ranges::find_first_of(other->UsingGpus, target.UsingGpus) == other->UsingGpus.end()
+				)
+					return false;
+				victims.push_back(other);
+				trial.release(*other);
+				return true;
+			});
+			for (auto other : candidates)
+			{
+				if (trial.fits(target))
+					break;
+				victims.push_back(other);
+				trial.release(*other);
+			}
+			if (!trial.fits(target))
+				return false;
+			for (auto victim : victims)
+				suspend_job(*victim);
+			return true;
+		};
+
+		// 按优先级从高到低继续被暂停的任务. only_above 有值时, 只继续优先级不低于它的任务.
+		auto resume_suspended_jobs = [&](std::optional<int> only_above)
+		{
+			std::vector<Job_t*> suspended;
+			for (auto id : store.Suspended)
+				suspended.push_back(&store.Jobs.at(id));
+			std::ranges::sort(suspended, {}, [](auto job){return std::pair{-job->Priority, job->Id};});
+			for (auto job : suspended)
+			{
+				if (only_above && job->Priority < *only_above)
+					break;
+				if (ledger.fits(*job) && fair_share.allows(*job))
+					resume_job(*job);
+			}
+		};
+
+		// assign new jobs
+		// fifo: 按顺序启动所有资源足够的任务.
+		// backfill: 第一个资源不足的任务成为队首, 为它预留资源, 之后的任务只有不推迟它时才启动.
+		// 任务的顺序默认是提交的顺序; 使用公平调度时, 每次从负载最小的用户的任务中取最早提交的一个.
+		auto assign_new_jobs = [&]
+		{
+			auto now = std::time(nullptr);
+			std::optional<Reservation_t> reservation;
+			auto can_start = [&](const Job_t& job) -> bool
+			{
+				if (job.RunNow)
+					return true;
+				else if (!fair_share.allows(job))
+					return false;
+				else if (ledger.fits(job))
+					return !reservation || reservation->admit(job, now);
+				else
+					return preemption && preempt(job);
+			};
+			auto wait = [&](const Job_t& job)
+			{
+				// 超出用户上限的任务不是因为资源不足而等待, 不为它预留资源
+				if (policy == "backfill" && !reservation && !job.RunNow && fair_share.allows(job))
+					reservation = reserve(store, ledger, topology, job, now);
+			};
+			auto dispatch = [&](Job_t& job)
+			{
+				if (job.Array)
 				{
-					auto it = std::find_if(jobs.begin(), jobs.end(), [&](auto& job){return job.Id == task.first;});
-					if (it != jobs.end())
+					if (start_array_tasks(job, can_start))
+						wait(job);
+				}
+				else if (can_start(job))
+					start_job(job);
+				else
+					wait(job);
+			};
+			// 被暂停的任务先于优先级比它低的等待中的任务继续
+			resume_suspended_jobs(store.Queue.empty() ? std::nullopt : std::optional{-store.Queue.begin()->first});
+			if (!fair_share_order)
+				for (auto it = store.Queue.begin(); it != store.Queue.end();)
+					// 先移动迭代器, 因为任务开始运行后会从 Queue 中移除
+					dispatch(store.Jobs.at((it++)->second));
+			else
+			{
+				// 用户按负载放在小顶堆中, 每个用户记录下一个要考虑的任务
+				std::priority_queue
+				<
+					std::pair<double, std::string>, std::vector<std::pair<double, std::string>>, std::greater<>
+				> users;
+				std::map<std::string, JobStore_t::Queue_t::iterator> next;
+				for (auto& [user, ids] : store.QueueOf)
+					if (!ids.empty())
 					{
-						it->Status = Job_t::Status_t::Finished;
-						std::clog << fmt::format("job {} finished\n", it->Id);
-						notify(fmt::format("finish job: {} {}", it->Id, it->Comment));
+						users.emplace(fair_share.load(user, now), user);
+						next[user] = ids.begin();
 					}
+				while (!users.empty())
+				{
+					auto user = users.top().second;
+					users.pop();
+					auto& it = next[user];
+					dispatch(store.Jobs.at((it++)->second));
+					if (it != store.QueueOf[user].end())
+						users.emplace(fair_share.load(user, now), user);
+				}
+			}
+			// 等待中的任务都无法运行时, 剩余的资源留给被暂停的任务
+			resume_suspended_jobs(std::nullopt);
+		};
+
+		// 杀死超过时间限制的任务, 并在下一个任务到达时间限制时再次检查
+		int limit_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (limit_timer < 0)
+			throw std::system_error{errno, std::generic_category(), "timerfd_create"};
+		auto enforce_time_limits = [&]
+		{
+			auto now = std::time(nullptr);
+			std::optional<std::int64_t> next;
+			for (auto id : std::set<unsigned>{store.Running})
+			{
+				auto& job = store.Jobs.at(id);
+				if (job.Array || !job.TimeLimit)
+					continue;
+				else if (auto deadline = job.StartTime + job.SuspendedSeconds + job.TimeLimit; deadline <= now)
+				{
+					std::clog << fmt::format("job {} exceeded its time limit\n", job.Id);
+					kill_job(job);
+					finish_job(job, JournalEntry_t::Type_t::Finish);
+					notify(fmt::format("time limit exceeded: {} {}", job.Id, job.Comment));
+				}
+				else
+					next = std::min(next.value_or(deadline), deadline);
+			}
+			set_timer(limit_timer, std::chrono::seconds{next ? *next - now : 0});
+		};
+
+		// 把超出保留数量和时间的已结束任务移到存档中, 使得 out.dat 和内存中的任务表不会无限增长
+		auto archive_finished_jobs = [&]
+		{
+			std::vector<Job_t> expired;
+			auto now = std::time(nullptr);
+			// 结束的子任务只在所属的数组任务中计数, 不必留在 out.dat 中, 需要时可以用 job-cli query 在存档中查找
+			for (auto id : std::set<unsigned>{store.FinishedArrayTasks})
+			{
+				expired.push_back(store.Jobs.at(id));
+				store.remove(id);
+			}
+			while (store.Finished.size() > keep_finished)
+			{
+				auto [finish_time, id] = *store.Finished.begin();
+				if (now - finish_time < keep_seconds)
+					break;
+				expired.push_back(store.Jobs.at(id));
+				store.remove(id);
+			}
+			if (!expired.empty())
+			{
+				journal.archive(expired);
+				std::clog << fmt::format("archived {} finished jobs\n", expired.size());
+			}
+		};
+
+		// 每个连接最多保留 5 秒, 以免不发完请求或者不读回复的客户端一直占用连接.
+		// 有连接时每秒检查一次, 没有连接时不触发.
+		int connection_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (connection_timer < 0)
+			throw std::system_error{errno, std::generic_category(), "timerfd_create"};
+		loop.add(connection_timer, [&]
+		{
+			drain(connection_timer);
+			auto now = std::chrono::steady_clock::now();
+			std::vector<int> expired;
+			for (auto& [fd, connection] : connections)
+				if (connection.Deadline <= now)
+					expired.push_back(fd);
+			for (auto fd : expired)
+			{
+				std::clog << fmt::format("closing connection {}: timed out\n", fd);
+				close_connection(fd);
+			}
+			if (connections.empty())
+				set_periodic_timer(connection_timer, 0s);
+		});
+
+		// 客户端通过 unix socket 提交请求
+		int listener = listen_socket(jobd_socket().string());
+		loop.add(listener, [&]
+		{
+			int fd;
+			while ((fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+			{
+				if (connections.empty())
+					set_periodic_timer(connection_timer, 1s);
+				connections[fd].Deadline = std::chrono::steady_clock::now() + 5s;
+				loop.add(fd, [&, fd]
+				{
+					if (connections.at(fd).Output.empty())
+						read_connection(fd);
 					else
-						std::unreachable();
-					task.second.reset();
-					jobs_changed = true;
+						write_connection(fd);
+				});
+			}
+		});
+
+		// 新任务写入 /tmp/gpujob/in 时立即读取
+		int in_watch = watch_directory("/tmp/gpujob/in");
+		loop.add(in_watch, [&]{drain(in_watch); read_new_jobs();});
+
+		// 定时做一次全面检查, 以防 inotify 溢出或者 pidfd 不可用时漏掉事件
+		int housekeeping = make_timer(60s);
+		loop.add(housekeeping, [&]
+		{
+			drain(housekeeping);
+			read_new_jobs();
+			reap_children();
+			std::vector<unsigned> ids;
+			for (auto& task : tasks)
+				ids.push_back(task.first);
+			for (auto id : ids)
+				check_finished(id);
+			archive_finished_jobs();
+			cleanup_cgroups();
+		});
+
+		loop.add(limit_timer, [&]{drain(limit_timer); enforce_time_limits();});
+
+		// 内核不支持 pidfd 时, 只要还有任务没有 pidfd, 就每秒检查一次它们是否已经结束.
+		// 通过启动器启动的任务没有 pidfd, 但它们的退出总会被告知, 不需要检查
+		int poll_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (poll_timer < 0)
+			throw std::system_error{errno, std::generic_category(), "timerfd_create"};
+		bool polling = false;
+		auto update_poll_timer = [&]
+		{
+			bool needed = std::ranges::any_of(tasks, [](auto& task){return task.second.PidFd < 0 && !task.second.Helper;});
+			if (needed != polling)
+				set_periodic_timer(poll_timer, needed ? 1s : 0s);
+			polling = needed;
+		};
+		loop.add(poll_timer, [&]
+		{
+			drain(poll_timer);
+			std::vector<unsigned> ids;
+			for (auto& [id, task] : tasks)
+				if (task.PidFd < 0 && !task.Helper)
+					ids.push_back(id);
+			for (auto id : ids)
+				check_finished(id);
+		});
+
+		int child_watch = signalfd(-1, &child_signal, SFD_NONBLOCK | SFD_CLOEXEC);
+		if (child_watch < 0)
+			throw std::system_error{errno, std::generic_category(), "signalfd"};
+		loop.add(child_watch, [&]
+		{
+			signalfd_siginfo info;
+			while (read(child_watch, &info, sizeof(info)) > 0);
+			reap_children();
+		});
+		if (helper)
+			loop.add(helper->ExitFd, [&]
+			{
+				std::vector<unsigned> exited;
+				for (auto [pid, status] : helper->exited())
+					if (auto id = record_exit(pid, status))
+						exited.push_back(*id);
+				// 启动器意外退出: 否则 ExitFd 一直可读, 主循环空转. 它启动的任务的进程交给 jobd 回收,
+				// 之后的任务用 runuser 启动
+				if (helper->Closed)
+				{
+					std::clog << "launcher helper exited, start jobs with runuser from now on\n";
+					loop.remove(helper->ExitFd);
+					close(helper->ExitFd);
+					close(helper->RequestFd);
+					helper.reset();
 				}
-			std::erase_if(tasks, [](auto& task){return !task.second;});
+				for (auto id : exited)
+					check_finished(id);
+			});
 
-			// assign new jobs
-			if (jobs_changed)
+		// 杀死使用的内存超过申请的任务. 容器中的任务的进程不在 jobd 之下, 无法统计;
+		// 设定了 memory.max 的任务由内核限制, 不需要检查.
+		if (args["enforce-memory"].as<bool>())
+		{
+			int memory_timer = make_timer(10s);
+			loop.add(memory_timer, [&]
 			{
-				std::set<unsigned> gpu_used;
-				unsigned cpu_used;
-				auto rebuild_usage_statistic = [&]
+				drain(memory_timer);
+				for (auto id : std::set<unsigned>{store.Running})
 				{
-					gpu_used.clear();
-					cpu_used = 0;
-					for (auto& task : tasks)
+					auto& job = store.Jobs.at(id);
+					if (job.Array || !job.Memory || job.RunInContainer || !tasks.contains(id)
+						|| (cgroup && std::filesystem::exists(cgroup->path(id) / "memory.max")))
+						continue;
+					if (auto used = get_process_tree_memory(tasks[id].Pid); used > job.Memory)
 					{
-						auto it = std::find_if(jobs.begin(), jobs.end(), [&](auto& job){return job.Id == task.first;});
-						if (it != jobs.end())
-						{
-							for (auto gpu : it->UsingGpus)
-								gpu_used.insert(gpu);
-							cpu_used += it->UsingCores;
-						}
-						else
-							std::unreachable();
+						std::clog << fmt::format("job {} uses {} MiB memory, more than {} MiB\n", job.Id, used, job.Memory);
+						kill_job(job);
+						finish_job(job, JournalEntry_t::Type_t::Finish);
+						notify(fmt::format("memory limit exceeded: {} {}", job.Id, job.Comment));
 					}
-				};
-				rebuild_usage_statistic();
+				}
+			});
+		}
 
-				for (auto& job : jobs)
-					if (job.Status == Job_t::Status_t::Pending)
-					{
-						if ((!std::ranges::any_of(job.UsingGpus, [&](auto gpu){return gpu_used.contains(gpu);})
-							&& cpu_used + job.UsingCores <= std::thread::hardware_concurrency()) || job.RunNow)
-						{
-							// runuser -u chn -- ssh -p 1022 127.0.0.1 ...
-							// runuser -c -u chn -- ...
-							std::vector<std::string> args;
-							if (job.RunInContainer)
-								args = {"-u", job.User, "--", "ssh", "-p", "1022", "127.0.0.1", job.ProgramString};
-							else
-								args = {"-c", "-u", job.User, "--", job.ProgramString};
-							std::clog << fmt::format("run job args: {}\n", args);
-							tasks[job.Id] = std::make_unique<boost::process::child>
-							(
-								boost::process::search_path("runuser"), boost::process::args(args),
-								boost::process::std_out > stderr, boost::process::std_err > stderr
-							);
-
-							std::clog << fmt::format("run job: {} {}\n", job.Id, job.Comment);
-							notify(fmt::format("run job: {} {}", job.Id, job.Comment));
-							job.Status = Job_t::Status_t::Running;
-							rebuild_usage_statistic();
-						}
-					}
-			}
+		// 统计正在运行的任务实际使用的资源. 容器中的任务的进程不在 jobd 之下, 无法统计.
+		// 统计结果随快照保存, 不单独写入 journal.
+		if (auto interval = args["sample-interval"].as<unsigned>())
+		{
+			int sample_timer = make_timer(std::chrono::seconds{interval});
+			loop.add(sample_timer, [&]
+			{
+				drain(sample_timer);
+				std::vector<Job_t*> jobs;
+				for (auto id : store.Running)
+					if (auto& job = store.Jobs.at(id); !job.Array && !job.RunInContainer && tasks.contains(id))
+						jobs.push_back(&job);
+				sampler.sample(jobs, std::time(nullptr));
+			});
+		}
+
+		// 后台生成的快照写完后, 换上它
+		loop.add(journal.DoneFd, [&]{journal.finish_compaction();});
 
-			// write jobs to out.dat
-			if (jobs_changed)
-				write_out({jobs});
+		// 重新接管的任务
+		for (auto& [id, task] : tasks)
+		{
+			task.PidFd = open_pidfd(task.Pid);
+			if (task.PidFd >= 0)
+				loop.add(task.PidFd, [&, id]{check_finished(id);});
+		}
+
+		// 启动前已经写入的任务
+		read_new_jobs();
+
+		while (true)
+		{
+			// 杀死超时的任务会释放资源, 因此可能需要再分配一次
+			while (jobs_changed)
+			{
+				jobs_changed = false;
+				assign_new_jobs();
+				enforce_time_limits();
+			}
+			if (!store.FinishedArrayTasks.empty())
+				archive_finished_jobs();
+			journal.sync();
+			update_poll_timer();
+			if (journal.needs_compaction())
+				journal.compact({store.all(), next_id, fair_share.Users, inventory.Gpus, ledger.TotalMemory});
+			loop.run_once();
 		}
 	}
 	catch (std::exception const& e)
@@ -205,3 +3097,4 @@ int main()
 		std::cerr << "Unknown exception" << std::endl;
 	}
 }
+# endif
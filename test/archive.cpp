@@ -0,0 +1,78 @@
+# define GPUJOB_NO_MAIN
+# include "../src/jobd.cpp"
+# include "check.hpp"
+
+// 任务不按 Id 的顺序结束时存档, archive.idx 仍然按 Id 排序, read_archived_job 能够二分查找到每一个任务.
+// 旧版本 jobd 写的无序的索引在启动时被重写.
+int main()
+{
+	TemporaryDirectory_t directory;
+	setenv("GPUJOB_STATE_DIRECTORY", directory.Path.c_str(), 1);
+	std::ofstream{directory.Path / "out.lock"};
+
+	auto make_jobs = [](std::vector<unsigned> ids)
+	{
+		std::vector<Job_t> jobs;
+		for (auto id : ids)
+		{
+			Job_t job{};
+			job.Id = id;
+			job.User = "test";
+			job.ProgramString = fmt::format("echo {}", id);
+			job.Status = Job_t::Status_t::Finished;
+			jobs.push_back(job);
+		}
+		return jobs;
+	};
+	auto check_index = [&](std::set<unsigned> ids)
+	{
+		std::vector<unsigned> stored;
+		std::ifstream index{directory.Path / "archive.idx", std::ios::binary};
+		for (std::array<char, ArchiveIndexEntrySize> entry; index.read(entry.data(), entry.size());)
+			stored.push_back(decode_little_endian<std::uint32_t>(entry.data()));
+		CHECK(std::ranges::equal(stored, ids));
+		for (auto id : ids)
+		{
+			auto job = read_archived_job(id);
+			CHECK(job && job->Id == id && job->ProgramString == fmt::format("echo {}", id));
+		}
+		CHECK(!read_archived_job(0));
+		CHECK(!read_archived_job(1000));
+	};
+
+	{
+		Journal_t journal{0};
+		journal.reset({});
+		journal.load_archive_index();
+		CHECK(!read_archived_job(1));
+		// 追加到末尾
+		journal.archive(make_jobs({5, 3, 8}));
+		journal.archive(make_jobs({12, 9}));
+		check_index({3, 5, 8, 9, 12});
+		// Id 比已有的小, 需要重写
+		journal.archive(make_jobs({7, 1, 20}));
+		check_index({1, 3, 5, 7, 8, 9, 12, 20});
+	}
+
+	// 打乱索引中各项的顺序, 模拟旧版本 jobd 写的索引
+	{
+		std::vector<std::string> entries;
+		{
+			std::ifstream index{directory.Path / "archive.idx", std::ios::binary};
+			for (std::string entry(ArchiveIndexEntrySize, '\0'); index.read(entry.data(), entry.size());)
+				entries.push_back(entry);
+		}
+		std::ranges::reverse(entries);
+		std::ofstream index{directory.Path / "archive.idx", std::ios::binary | std::ios::trunc};
+		for (auto& entry : entries)
+			index.write(entry.data(), entry.size());
+	}
+	{
+		Journal_t journal{0};
+		journal.reopen(false);
+		journal.load_archive_index();
+		check_index({1, 3, 5, 7, 8, 9, 12, 20});
+	}
+
+	return check_result();
+}
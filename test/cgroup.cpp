@@ -0,0 +1,81 @@
+# define GPUJOB_NO_MAIN
+# include "../src/jobd.cpp"
+# include "check.hpp"
+
+// 在普通的临时目录中模拟 cgroup v2: 内核会自动创建的控制文件由测试预先创建, 然后检查 Cgroup_t 写入的内容.
+int main()
+{
+	TemporaryDirectory_t directory;
+	auto root = directory.Path / "gpujob.slice";
+	auto read = [](const std::filesystem::path& file)
+	{
+		std::ifstream in{file};
+		return std::string{std::istreambuf_iterator<char>{in}, {}};
+	};
+	auto touch = [](const std::filesystem::path& cgroup, std::vector<std::string> files)
+	{
+		std::filesystem::create_directories(cgroup);
+		for (auto& file : files)
+			std::ofstream{cgroup / file};
+	};
+
+	// 不是 cgroup (没有 cgroup.procs) 时不可用
+	CHECK(!Cgroup_t::open(root));
+	touch(root, {"cgroup.procs", "cgroup.subtree_control"});
+	std::ofstream{root / "cgroup.controllers"} << "cpuset cpu memory pids\n";
+	auto cgroup = Cgroup_t::open(root);
+	CHECK(cgroup && cgroup->Root == root);
+	if (!cgroup)
+		return check_result();
+	// 每次写入一个控制器, 不可用的 io 不写入, 因此最后写入的是 memory
+	CHECK(read(root / "cgroup.subtree_control") == "+memory");
+
+	Job_t job{};
+	job.Id = 7;
+	job.UsingCores = 4;
+	job.Cpus = {0, 1, 2, 3, 8};
+	job.Memory = 2048;
+	touch(cgroup->path(job.Id), {"cgroup.procs", "cpu.max", "cpuset.cpus", "memory.max"});
+	CHECK(cgroup->path(job.Id) == root / "job-7");
+	CHECK(cgroup->create(job));
+	CHECK(read(root / "job-7/cpu.max") == "400000 100000");
+	CHECK(read(root / "job-7/cpuset.cpus") == "0-3,8");
+	CHECK(read(root / "job-7/memory.max") == "2147483648");
+
+	// 不限制核数和内存时写入 max; 重新挑选 CPU 之后更新 cpuset
+	job.UsingCores = 0;
+	job.Memory = 0;
+	job.Cpus = {4, 5};
+	cgroup->limit(job);
+	CHECK(read(root / "job-7/cpu.max") == "max");
+	CHECK(read(root / "job-7/cpuset.cpus") == "4-5");
+	CHECK(read(root / "job-7/memory.max") == "max");
+
+	// 没有控制文件 (控制器不可用) 时不创建它们
+	Job_t other{};
+	other.Id = 8;
+	other.UsingCores = 1;
+	CHECK(cgroup->create(other));
+	CHECK(std::filesystem::is_directory(root / "job-8"));
+	CHECK(!std::filesystem::exists(root / "job-8/cpu.max"));
+
+	std::ofstream{root / "job-7/cgroup.events"} << "populated 1\nfrozen 0\n";
+	std::ofstream{root / "job-7/memory.events"} << "low 0\nhigh 0\nmax 3\noom 1\noom_kill 1\n";
+	CHECK(cgroup->populated(7));
+	CHECK(cgroup->oom_killed(7));
+	CHECK(!cgroup->populated(8));
+	CHECK(!cgroup->oom_killed(8));
+
+	// job-8 是空的, 可以删除; job-9 中还有文件 (相当于还有进程), 删除失败, 先通过 cgroup.kill 杀死;
+	// 仍在运行的 job-7 和不是任务的目录保留
+	touch(root / "job-9", {"cgroup.kill"});
+	std::filesystem::create_directories(root / "other");
+	cgroup->cleanup({7});
+	CHECK(std::filesystem::exists(root / "job-7"));
+	CHECK(!std::filesystem::exists(root / "job-8"));
+	CHECK(std::filesystem::exists(root / "job-9"));
+	CHECK(read(root / "job-9/cgroup.kill") == "1");
+	CHECK(std::filesystem::exists(root / "other"));
+
+	return check_result();
+}
@@ -0,0 +1,42 @@
+# pragma once
+# include <iostream>
+# include <filesystem>
+# include <string>
+# include <cstdlib>
+# include <system_error>
+# include <fmt/format.h>
+# include <unistd.h>
+
+// 测试中的断言: 失败时输出位置和表达式, 继续运行, 最后由 main 返回 check_result()
+inline unsigned check_failures = 0;
+# define CHECK(expression) \
+	do \
+		if (!(expression)) \
+		{ \
+			std::cerr << fmt::format("{}:{}: check failed: {}\n", __FILE__, __LINE__, #expression); \
+			check_failures++; \
+		} \
+	while (false)
+
+inline int check_result()
+{
+	if (check_failures)
+		std::cerr << fmt::format("{} checks failed\n", check_failures);
+	return check_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+struct TemporaryDirectory_t
+// 测试用的临时目录, 析构时删除
+{
+	std::filesystem::path Path;
+
+	TemporaryDirectory_t()
+	{
+		std::string path = (std::filesystem::temp_directory_path() / "gpujob-test-XXXXXX").string();
+		if (!mkdtemp(path.data()))
+			throw std::system_error{errno, std::generic_category(), "mkdtemp"};
+		Path = path;
+	}
+	TemporaryDirectory_t(const TemporaryDirectory_t&) = delete;
+	~TemporaryDirectory_t() {std::filesystem::remove_all(Path);}
+};
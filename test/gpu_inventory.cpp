@@ -0,0 +1,73 @@
+# define GPUJOB_NO_MAIN
+# include "../src/jobd.cpp"
+# include "check.hpp"
+
+// test/gpus.csv 与 nvidia-smi --query-gpu=index,name,memory.total --format=csv,noheader,nounits 的输出格式相同,
+// 其中的 GPU 没有按编号排列.
+int main(int argc, const char** argv)
+{
+	if (argc != 2)
+	{
+		std::cerr << "usage: test-gpu_inventory <test directory>\n";
+		return EXIT_FAILURE;
+	}
+	auto fixture = std::filesystem::path{argv[1]} / "gpus.csv";
+	auto check_inventory = [](GpuInventory_t inventory)
+	{
+		CHECK(inventory.Gpus.size() == 4);
+		if (inventory.Gpus.size() != 4)
+			return;
+		for (unsigned i = 0; i < 4; i++)
+			CHECK(inventory.Gpus[i].Id == i);
+		CHECK(inventory.Gpus[1].Model == "NVIDIA A100-SXM4-40GB");
+		CHECK(inventory.Gpus[2].Model == "NVIDIA GeForce RTX 4090");
+		CHECK(inventory.Gpus[2].Memory == 24564);
+
+		auto match = [&](std::string model, std::uint64_t memory)
+		{
+			Job_t job{};
+			job.GpuModel = model;
+			job.GpuMinMemory = memory;
+			return inventory.match(job);
+		};
+		CHECK((match("", 0) == std::vector<unsigned>{0, 1, 2, 3}));
+		// 型号是不区分大小写的子串
+		CHECK((match("a100", 0) == std::vector<unsigned>{0, 1, 3}));
+		CHECK((match("RTX 4090", 0) == std::vector<unsigned>{2}));
+		CHECK(match("H100", 0).empty());
+		// 显存不小于要求的值
+		CHECK((match("", 40960) == std::vector<unsigned>{0, 1, 3}));
+		CHECK((match("a100", 40961) == std::vector<unsigned>{0, 3}));
+		// 缓存的结果与第一次相同
+		CHECK((match("a100", 40961) == std::vector<unsigned>{0, 3}));
+	};
+	check_inventory(GpuInventory_t::read(fixture.string()));
+
+	// 通过 PATH 中伪造的 nvidia-smi 读取
+	TemporaryDirectory_t directory;
+	{
+		std::ofstream script{directory.Path / "nvidia-smi"};
+		script << fmt::format("#!/bin/sh\ncat '{}'\n", std::filesystem::absolute(fixture).string());
+	}
+	std::filesystem::permissions(directory.Path / "nvidia-smi", std::filesystem::perms::owner_all);
+	setenv("PATH", fmt::format("{}:{}", directory.Path.string(), std::getenv("PATH")).c_str(), 1);
+	check_inventory(GpuInventory_t::read("nvidia-smi"));
+
+	// 读取命令的输出: 卡住的命令在超时后被杀死, 失败的命令没有输出
+	CHECK(read_command_output({"echo", "gpu"}, 5s) == "gpu\n");
+	CHECK(!read_command_output({"false"}, 5s));
+	CHECK(!read_command_output({"gpujob-no-such-command"}, 5s));
+	auto begin = std::chrono::steady_clock::now();
+	CHECK(!read_command_output({"sleep", "30"}, 1s));
+	CHECK(!read_command_output({"sh", "-c", "exec >&-; sleep 30"}, 1s));
+	CHECK(std::chrono::steady_clock::now() - begin < 10s);
+
+	try
+	{
+		GpuInventory_t::read((directory.Path / "missing.csv").string());
+		CHECK(false);
+	}
+	catch (std::runtime_error&) {}
+
+	return check_result();
+}
@@ -0,0 +1,97 @@
+# define GPUJOB_NO_MAIN
+# include "../src/jobd.cpp"
+# include "check.hpp"
+
+// test/modules/init.sh 定义了一个最简单的 module 命令, 模块文件是 shell 脚本. 模块文件复制到临时目录中,
+// 以便修改它们来检查缓存失效. 任务使用的模块由测试用的系统配置给出.
+int main(int argc, const char** argv)
+{
+	if (argc != 2)
+	{
+		std::cerr << "usage: test-module_cache <test directory>\n";
+		return EXIT_FAILURE;
+	}
+	auto fixture = std::filesystem::absolute(std::filesystem::path{argv[1]} / "modules");
+	TemporaryDirectory_t directory;
+	std::filesystem::copy_file(fixture / "cuda", directory.Path / "cuda");
+	setenv("LD_LIBRARY_PATH", "/usr/lib/job", 1);
+
+	std::istringstream config{fmt::format
+	(
+		"[cuda]\nmodule-path = {0}\nmodule = cuda\ncommand = true\n"
+			"[missing]\nmodule-path = {0}\nmodule = missing\ncommand = true\n",
+		directory.Path.string()
+	)};
+	auto test_profiles = Profiles_t::parse(config, "test profiles");
+	EventLoop_t loop;
+	ModuleCache_t cache{(fixture / "init.sh").string(), &loop, &test_profiles};
+	Job_t job{};
+	job.User = getpwuid(geteuid())->pw_name;
+	job.Profile = "cuda";
+	auto wait = [&]
+	{
+		while (!cache.Resolving.empty())
+			loop.run_once();
+	};
+	auto run = [&](const std::string& command)
+		{return read_command_output({"bash", "-c", command}, 10s);};
+	auto command = "echo $CUDA_HOME $LD_LIBRARY_PATH"s;
+
+	// 第一次在后台加载, 任务自己加载模块; 加载完成后直接设置环境变量, 结果相同
+	auto uncached = cache.wrap(job, command);
+	CHECK(uncached.find("module load") != std::string::npos);
+	CHECK(cache.Resolving.size() == 1);
+	CHECK(run(uncached) == "/opt/cuda-12 /opt/cuda-12/lib64:/usr/lib/job\n");
+	wait();
+	auto cached = cache.wrap(job, command);
+	CHECK(cached.find("module") == std::string::npos);
+	CHECK(cached.find("export CUDA_HOME='/opt/cuda-12'; ") != std::string::npos);
+	CHECK(cache.Resolving.empty());
+	CHECK(run(cached) == "/opt/cuda-12 /opt/cuda-12/lib64:/usr/lib/job\n");
+	// 模块加在 PATH 前面的部分加到任务自己的 PATH 上
+	CHECK(run(cache.wrap(job, "echo $PATH")) == fmt::format("/opt/cuda-12/bin:{}\n", std::getenv("PATH")));
+
+	// 修改模块文件之后缓存失效, 重新加载
+	{
+		std::ofstream out{directory.Path / "cuda", std::ios::app};
+		out << "export CUDA_HOME=/opt/cuda-12.4\n";
+	}
+	auto time = std::filesystem::last_write_time(directory.Path / "cuda");
+	std::filesystem::last_write_time(directory.Path / "cuda", time + 1s);
+	auto changed = cache.wrap(job, command);
+	CHECK(changed.find("module load") != std::string::npos);
+	CHECK(cache.Resolving.size() == 1);
+	wait();
+	CHECK(run(cache.wrap(job, command)) == "/opt/cuda-12.4 /opt/cuda-12/lib64:/usr/lib/job\n");
+
+	// 加载失败时不缓存环境变量, 任务仍然自己加载模块 (并且同样失败)
+	job.Profile = "missing";
+	auto missing = cache.wrap(job, command);
+	wait();
+	CHECK(cache.Entries.at({job.User, {directory.Path.string()}, {"missing"}}).Exports.empty());
+	CHECK(cache.wrap(job, command) == missing);
+	CHECK(cache.Resolving.empty());
+	CHECK(!run(missing));
+
+	// 客户端发来的模块目录和模块不起作用: 没有配置时不加载模块, 有配置时只加载配置中的
+	TemporaryDirectory_t forged_directory;
+	{
+		std::ofstream out{forged_directory.Path / "cuda"};
+		out << "export CUDA_HOME=/evil\n";
+	}
+	Job_t forged{};
+	forged.User = job.User;
+	forged.ModulePaths = {forged_directory.Path.string()};
+	forged.Modules = {"cuda"};
+	CHECK(cache.wrap(forged, command) == command);
+	forged.Profile = "cuda";
+	auto honest = cache.wrap(forged, command);
+	CHECK(honest.find(forged_directory.Path.string()) == std::string::npos);
+	CHECK(run(honest) == "/opt/cuda-12.4 /opt/cuda-12/lib64:/usr/lib/job\n");
+	// 不是系统配置 (例如用户自己的配置文件中的) 时也不加载
+	test_profiles.Items[0].System = false;
+	CHECK(cache.wrap(forged, command) == command);
+	CHECK(cache.Resolving.empty());
+
+	return check_result();
+}
@@ -0,0 +1,40 @@
+# 代替 /etc/profile.d/modules.sh 的最简单的 module 命令, 供 test-module_cache 使用 (jobd --module-init).
+# 模块文件是 shell 脚本, 在 MODULEPATH 的目录中按名字查找; 与环境模块一样记录 LOADEDMODULES 和 _LMFILES_.
+module()
+{
+	local command=$1
+	shift
+	case $command in
+	use)
+		local directory
+		for directory in "$@"; do
+			export MODULEPATH="${MODULEPATH:+$MODULEPATH:}$directory"
+		done
+		;;
+	load)
+		local name directory file
+		for name in "$@"; do
+			file=
+			local IFS=:
+			for directory in $MODULEPATH; do
+				if [ -f "$directory/$name" ]; then
+					file=$directory/$name
+					break
+				fi
+			done
+			unset IFS
+			if [ -z "$file" ]; then
+				echo "module: unable to locate a modulefile for '$name'" >&2
+				return 1
+			fi
+			. "$file" || return 1
+			export LOADEDMODULES="${LOADEDMODULES:+$LOADEDMODULES:}$name"
+			export _LMFILES_="${_LMFILES_:+$_LMFILES_:}$file"
+		done
+		;;
+	*)
+		echo "module: unknown command '$command'" >&2
+		return 1
+		;;
+	esac
+}
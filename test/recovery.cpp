@@ -0,0 +1,135 @@
+# define GPUJOB_NO_MAIN
+# include "../src/jobd.cpp"
+# include "check.hpp"
+
+// 模拟 jobd 在运行中被杀死: 子进程不断提交任务, 每个任务写入 journal 并 sync 之后才通过管道确认 (相当于回复客户端).
+// 父进程在子进程运行中途用 SIGKILL 杀死它, 然后检查 recover_state 恢复出了所有已经确认的任务.
+// 之后再模拟一次: 被杀死的 jobd 留下了一个仍在运行的任务, 重启后通过进程号和启动时间重新接管它.
+int main()
+{
+	TemporaryDirectory_t directory;
+	setenv("GPUJOB_STATE_DIRECTORY", directory.Path.c_str(), 1);
+	std::ofstream{directory.Path / "out.lock"};
+	{
+		Journal_t journal{0};
+		journal.reset({});
+	}
+
+	int pipes[2];
+	if (pipe(pipes))
+		throw std::system_error{errno, std::generic_category(), "pipe"};
+	auto pid = fork();
+	if (pid == 0)
+	{
+		close(pipes[0]);
+		Journal_t journal{0};
+		journal.reopen(false);
+		for (unsigned id = 0;; id++)
+		{
+			Job_t job{};
+			job.Id = id;
+			job.User = "test";
+			job.ProgramString = fmt::format("echo {}", id);
+			job.Status = Job_t::Status_t::Pending;
+			journal.append(JournalEntry_t::Type_t::Submit, job);
+			journal.sync();
+			if (write(pipes[1], &id, sizeof(id)) != sizeof(id))
+				_exit(1);
+		}
+	}
+	close(pipes[1]);
+
+	// 收到一些确认之后杀死子进程, 再读完它死前已经写入管道的确认
+	std::set<unsigned> acknowledged;
+	unsigned id;
+	while (acknowledged.size() < 200 && read(pipes[0], &id, sizeof(id)) == sizeof(id))
+		acknowledged.insert(id);
+	kill(pid, SIGKILL);
+	while (read(pipes[0], &id, sizeof(id)) == sizeof(id))
+		acknowledged.insert(id);
+	close(pipes[0]);
+	waitpid(pid, nullptr, 0);
+	CHECK(acknowledged.size() >= 200);
+
+	auto check_recovered = [&]
+	{
+		auto [output, sequence] = recover_state();
+		std::set<unsigned> recovered;
+		for (auto& job : output.Jobs)
+			recovered.insert(job.Id);
+		for (auto id : acknowledged)
+			CHECK(recovered.contains(id));
+		CHECK(output.NextId > *acknowledged.rbegin());
+		CHECK(sequence >= acknowledged.size());
+		CHECK(!std::filesystem::exists(directory.Path / "out.dat.corrupt"));
+	};
+	check_recovered();
+
+	// 写到一半时被杀死, journal 末尾留下不完整的记录: 它应当被忽略, 已确认的任务不受影响
+	{
+		std::ofstream journal{directory.Path / "journal.dat", std::ios::binary | std::ios::app};
+		auto record = serialize_journal_entry({1u << 30, JournalEntry_t::Type_t::Submit, Job_t{}});
+		journal.write(record.data(), record.size() / 2);
+	}
+	check_recovered();
+
+	// 任务的进程在自己的会话中运行, jobd 被杀死后它仍然在运行. 测试进程作为 subreaper 接收它, 以便最后回收
+	prctl(PR_SET_CHILD_SUBREAPER, 1);
+	// 与 jobd 启动时相同, 恢复之后写入新的快照, 丢弃不完整的记录
+	std::uint64_t restarted;
+	{
+		auto [output, sequence] = recover_state();
+		Journal_t journal{sequence};
+		journal.reset(output);
+		restarted = sequence;
+	}
+	if (pipe(pipes))
+		throw std::system_error{errno, std::generic_category(), "pipe"};
+	pid = fork();
+	if (pid == 0)
+	{
+		close(pipes[0]);
+		Journal_t journal{restarted};
+		journal.reopen(false);
+		Job_t job{};
+		job.Id = 100000;
+		job.User = "test";
+		job.ProgramString = "sleep 60";
+		job.Status = Job_t::Status_t::Running;
+		job.Pid = spawn({"sleep", "60"}, []{});
+		job.PidStartTime = get_process_start_time(job.Pid).value_or(0);
+		journal.append(JournalEntry_t::Type_t::Start, job);
+		journal.sync();
+		if (write(pipes[1], &job.Pid, sizeof(job.Pid)) != sizeof(job.Pid))
+			_exit(1);
+		pause();
+		_exit(0);
+	}
+	close(pipes[1]);
+	pid_t task_pid = 0;
+	CHECK(read(pipes[0], &task_pid, sizeof(task_pid)) == sizeof(task_pid));
+	close(pipes[0]);
+	kill(pid, SIGKILL);
+	waitpid(pid, nullptr, 0);
+
+	auto [output, sequence] = recover_state();
+	auto job = std::ranges::find(output.Jobs, 100000u, &Job_t::Id);
+	CHECK(job != output.Jobs.end());
+	if (job != output.Jobs.end())
+	{
+		CHECK(job->Status == Job_t::Status_t::Running && job->Pid == task_pid);
+		auto task = Task_t::adopt(*job);
+		CHECK(task && task->Adopted && task->running());
+		// 进程号被重用 (启动时间不同) 时不接管
+		auto reused = *job;
+		reused.PidStartTime++;
+		CHECK(!Task_t::adopt(reused));
+		// 进程退出后不再认为任务在运行
+		kill(task_pid, SIGKILL);
+		waitpid(task_pid, nullptr, 0);
+		CHECK(task && !task->running());
+		CHECK(!Task_t::adopt(*job));
+	}
+
+	return check_result();
+}
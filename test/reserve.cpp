@@ -0,0 +1,67 @@
+# define GPUJOB_NO_MAIN
+# include "../src/jobd.cpp"
+# include "check.hpp"
+
+// 回填调度为只指定了 GPU 数量的队首任务预留资源时, 预留的是到时会为它挑选的具体的 GPU,
+// 不会再被没有时间限制的任务占用; 其它的 GPU 仍然可以回填.
+int main(int argc, const char** argv)
+{
+	if (argc != 2)
+	{
+		std::cerr << "usage: test-reserve <test directory>\n";
+		return EXIT_FAILURE;
+	}
+	auto topology = Topology_t::read(std::filesystem::path{argv[1]} / "sysfs");
+	GpuInventory_t inventory;
+	for (unsigned gpu = 0; gpu < 4; gpu++)
+		inventory.Gpus.push_back({gpu, "NVIDIA A100", 81920});
+	Ledger_t ledger;
+	ledger.TotalCores = topology.Cpus.size();
+	ledger.Inventory = &inventory;
+	JobStore_t store;
+	auto make_job = [&](unsigned id, std::vector<unsigned> gpus, std::int64_t time_limit, unsigned gpu_count = 0)
+	{
+		Job_t job{};
+		job.Id = id;
+		job.User = "test";
+		job.UsingCores = 1;
+		job.UsingGpus = gpus;
+		job.GpuCount = gpu_count;
+		job.TimeLimit = time_limit;
+		job.Status = Job_t::Status_t::Pending;
+		return job;
+	};
+	auto run = [&](Job_t job)
+	{
+		job.Status = Job_t::Status_t::Running;
+		ledger.acquire(job);
+		store.add(job);
+	};
+	// GPU 0 上的任务在 100 秒后结束, GPU 1 和 2 上的任务没有时间限制, GPU 3 空闲
+	run(make_job(1, {0}, 100));
+	run(make_job(2, {1}, 0));
+	run(make_job(3, {2}, 0));
+
+	auto head = make_job(4, {}, 0, 2);
+	auto reservation = reserve(store, ledger, topology, head, 0);
+	CHECK(reservation && reservation->Time == 100);
+	if (reservation)
+	{
+		// GPU 0 和 3 都预留给了队首任务, 没有时间限制的任务不能占用任何一个
+		CHECK(reservation->Spare.used_slots(0) == ledger.SlotsPerGpu);
+		CHECK(reservation->Spare.used_slots(3) == ledger.SlotsPerGpu);
+		CHECK(!reservation->admit(make_job(5, {}, 0, 1), 0));
+		CHECK(!reservation->admit(make_job(6, {3}, 0), 0));
+		// 在队首任务开始之前结束的任务仍然可以回填
+		CHECK(reservation->admit(make_job(7, {}, 50, 1), 0));
+	}
+
+	// 指定了具体 GPU 的队首任务只预留这些 GPU
+	auto pinned = make_job(8, {0}, 0);
+	reservation = reserve(store, ledger, topology, pinned, 0);
+	CHECK(reservation && reservation->Time == 100);
+	if (reservation)
+		CHECK(reservation->admit(make_job(9, {}, 0, 1), 0));
+
+	return check_result();
+}
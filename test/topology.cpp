@@ -0,0 +1,72 @@
+# define GPUJOB_NO_MAIN
+# include "../src/jobd.cpp"
+# include "check.hpp"
+
+// test/sysfs 是一台伪造的机器: 两个 NUMA 节点, 每个节点 4 个物理核, 每个物理核 2 个 SMT 线程
+// (CPU n 和 n + 8 在同一个物理核上), 每个节点上有两个挂在同一个 PCIe 交换芯片上的 GPU, 节点 0 上还有一块网卡.
+int main(int argc, const char** argv)
+{
+	if (argc != 2)
+	{
+		std::cerr << "usage: test-topology <test directory>\n";
+		return EXIT_FAILURE;
+	}
+	auto topology = Topology_t::read(std::filesystem::path{argv[1]} / "sysfs");
+
+	CHECK(topology.Cpus.size() == 16);
+	for (auto& cpu : topology.Cpus)
+	{
+		CHECK(cpu.Node == cpu.Id % 8 / 4);
+		CHECK(cpu.Core == std::pair(cpu.Id % 8 / 4, cpu.Id % 4));
+	}
+	CHECK((topology.GpuNodes == std::vector{0, 0, 1, 1}));
+	CHECK(topology.gpu_distance(0, 1) == 4);
+	CHECK(topology.gpu_distance(2, 3) == 4);
+	CHECK(topology.gpu_distance(0, 2) > 100);
+
+	Ledger_t ledger;
+	ledger.TotalCores = topology.Cpus.size();
+	auto pick = [&](unsigned cores, std::vector<unsigned> gpus = {})
+	{
+		Job_t job{};
+		job.UsingCores = cores;
+		job.UsingGpus = gpus;
+		auto cpus = ledger.pick_cpus(topology, job);
+		return std::set<unsigned>(cpus.begin(), cpus.end());
+	};
+	auto hold = [&](std::vector<unsigned> cpus)
+	{
+		Job_t job{};
+		job.UsingCores = cpus.size();
+		job.Cpus = cpus;
+		ledger.acquire(job);
+		return job;
+	};
+
+	// 放在 GPU 所在的节点上, 并且占用完整的物理核
+	CHECK((pick(4, {2}) == std::set<unsigned>{4, 5, 12, 13}));
+	CHECK((pick(4, {0}) == std::set<unsigned>{0, 1, 8, 9}));
+	// 空闲的 CPU 不够时不绑定
+	CHECK(pick(17).empty());
+	// 一个节点放不下时跨越两个节点, 仍然占用完整的物理核
+	{
+		auto cpus = pick(12);
+		CHECK(cpus.size() == 12);
+		for (auto cpu : cpus)
+			CHECK(cpus.contains(cpu < 8 ? cpu + 8 : cpu - 8));
+	}
+
+	// 节点 0 被占用一半后, 能放下任务的节点中选空闲 CPU 最少的, 把完整的节点留给更大的任务
+	auto first = hold({0, 1, 8, 9});
+	CHECK((pick(3) == std::set<unsigned>{2, 3, 10}));
+	// 奇数个核的任务的零头填补已经被占用了一半的物理核
+	auto second = hold({6});
+	CHECK((pick(1, {2}) == std::set<unsigned>{14}));
+	CHECK((pick(3, {2}) == std::set<unsigned>{4, 12, 14}));
+	// 释放之后又可以使用
+	ledger.release(first);
+	ledger.release(second);
+	CHECK((pick(4, {0}) == std::set<unsigned>{0, 1, 8, 9}));
+
+	return check_result();
+}